@@ -45,6 +45,9 @@ have_func("rb_io_descriptor", "ruby/io.h")
 have_func("rb_io_maybe_wait(0, Qnil, Qnil, Qnil)", "ruby/io.h")
 # Ruby 3.2
 have_func("rb_io_timeout", "ruby/io.h")
+# Ruby 3.0
+have_header("ruby/atomic.h")
+have_func("rb_native_cond_wait", "ruby/thread_native.h")
 
 Logging::message "=== Checking for system dependent stuff... ===\n"
 have_library("nsl", "t_open")
@@ -52,6 +55,7 @@ have_library("socket", "socket")
 if $mswin || $mingw
   have_library("ws2_32")
 end
+have_header("sys/mman.h")
 
 if $mingw
   append_cflags '-D_FORTIFY_SOURCE=2'
@@ -151,9 +155,21 @@ have_func("EVP_PBE_scrypt(\"\", 0, (unsigned char *)\"\", 0, 0, 0, 0, 0, NULL, 0
 # added in OpenSSL 1.1.1 and LibreSSL 3.5.0, then removed in LibreSSL 4.0.0
 have_func("EVP_PKEY_check(NULL)", evp_h)
 
+# added in 1.1.0, currently not in LibreSSL
+have_func("SSL_CTX_set_split_send_fragment(NULL, 0)", ssl_h)
+have_func("SSL_CTX_set_max_pipelines(NULL, 0)", ssl_h)
+have_func("SSL_CTX_set_default_read_buffer_len(NULL, 0)", ssl_h)
+have_func("OPENSSL_LH_doall_arg(NULL, NULL, NULL)", "openssl/lhash.h")
+
 # added in OpenSSL 1.1.1, currently not in LibreSSL
 have_func("OPENSSL_sk_new_reserve(NULL, 0)", stack_h)
 
+# added in OpenSSL 1.1.1, missing in AWS-LC
+have_func("SSL_read_early_data(NULL, NULL, 0, NULL)", ssl_h)
+
+# added in OpenSSL 1.1.1, currently not in LibreSSL
+have_func("SSL_CTX_set_psk_find_session_callback(NULL, NULL)", ssl_h)
+
 # added in 3.0.0
 have_func("SSL_CTX_set0_tmp_dh_pkey(NULL, NULL)", ssl_h)
 have_func("ERR_get_error_all(NULL, NULL, NULL, NULL, NULL)", "openssl/err.h")
@@ -164,9 +180,13 @@ have_func("EVP_MD_CTX_get_pkey_ctx(NULL)", evp_h)
 have_func("EVP_PKEY_eq(NULL, NULL)", evp_h)
 have_func("EVP_PKEY_dup(NULL)", evp_h)
 have_func("EVP_PKEY_encapsulate_init(NULL, NULL)", evp_h)
+have_func("SSL_sendfile(NULL, 0, 0, 0, 0)", ssl_h)
+have_func("SSL_CTX_set_tlsext_ticket_key_evp_cb(NULL, NULL)", ssl_h)
 
 # added in 3.2.0
 have_func("SSL_get0_group_name(NULL)", ssl_h)
+have_func("SSL_CTX_compress_certs(NULL, 0)", ssl_h)
+have_func("SSL_CTX_set1_server_cert_type(NULL, NULL, 0)", ssl_h)
 have_func("OSSL_HPKE_CTX_new(0, (OSSL_HPKE_SUITE){0}, 0, NULL, NULL)", "openssl/hpke.h")
 
 # added in 3.4.0
@@ -1143,6 +1143,7 @@ Init_openssl(void)
      */
     Init_ossl_asn1();
     Init_ossl_bn();
+    Init_ossl_buffering();
     Init_ossl_cipher();
     Init_ossl_config();
     Init_ossl_digest();
@@ -181,6 +181,7 @@ extern VALUE dOSSL;
 #include "ossl_asn1.h"
 #include "ossl_bio.h"
 #include "ossl_bn.h"
+#include "ossl_buffering.h"
 #include "ossl_cipher.h"
 #include "ossl_config.h"
 #include "ossl_digest.h"
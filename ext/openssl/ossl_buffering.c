@@ -0,0 +1,281 @@
+/*
+ * This program is licensed under the same licence as Ruby.
+ * (See the file 'COPYING'.)
+ */
+#include "ossl.h"
+
+static VALUE cReadBuffer;
+
+static void
+ossl_read_buffer_free(void *ptr)
+{
+    struct ossl_read_buffer *rb = ptr;
+
+    ruby_xfree(rb->ptr);
+    ruby_xfree(rb);
+}
+
+static size_t
+ossl_read_buffer_memsize(const void *ptr)
+{
+    const struct ossl_read_buffer *rb = ptr;
+
+    return sizeof(*rb) + rb->capa;
+}
+
+static const rb_data_type_t ossl_read_buffer_type = {
+    "OpenSSL/Buffering/ReadBuffer",
+    {
+        0, ossl_read_buffer_free, ossl_read_buffer_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static VALUE
+ossl_read_buffer_alloc(VALUE klass)
+{
+    struct ossl_read_buffer *rb;
+
+    return TypedData_Make_Struct(klass, struct ossl_read_buffer,
+                                 &ossl_read_buffer_type, rb);
+}
+
+struct ossl_read_buffer *
+ossl_read_buffer_get(VALUE self, int modify)
+{
+    struct ossl_read_buffer *rb;
+
+    TypedData_Get_Struct(self, struct ossl_read_buffer, &ossl_read_buffer_type, rb);
+    if (modify && rb->busy)
+        rb_raise(rb_eRuntimeError, "read buffer is in use by another thread");
+    return rb;
+}
+
+/*
+ * Makes sure that at least _size_ bytes are available after the buffered
+ * data. The data is moved to the head of the memory if that is enough,
+ * otherwise the memory is reallocated.
+ */
+void
+ossl_read_buffer_reserve(struct ossl_read_buffer *rb, long size)
+{
+    if (rb->capa - rb->off - rb->len >= size)
+        return;
+    if (rb->off) {
+        memmove(rb->ptr, rb->ptr + rb->off, rb->len);
+        rb->off = 0;
+    }
+    if (rb->capa - rb->len < size) {
+        long capa = rb->capa ? rb->capa : size;
+
+        while (capa - rb->len < size)
+            capa *= 2;
+        REALLOC_N(rb->ptr, char, capa);
+        rb->capa = capa;
+    }
+}
+
+static void
+read_buffer_consumed(struct ossl_read_buffer *rb, long size)
+{
+    rb->len -= size;
+    rb->off = rb->len ? rb->off + size : 0;
+}
+
+/*
+ * call-seq:
+ *    rbuff.size -> integer
+ *
+ * Returns the number of the buffered bytes.
+ */
+static VALUE
+ossl_read_buffer_size(VALUE self)
+{
+    return LONG2NUM(ossl_read_buffer_get(self, 0)->len);
+}
+
+/*
+ * call-seq:
+ *    rbuff.empty? -> true or false
+ */
+static VALUE
+ossl_read_buffer_empty_p(VALUE self)
+{
+    return ossl_read_buffer_get(self, 0)->len ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *    rbuff.to_s -> string
+ *
+ * Returns a copy of the buffered bytes.
+ */
+static VALUE
+ossl_read_buffer_to_s(VALUE self)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 0);
+
+    return rb_str_new(rb->ptr + rb->off, rb->len);
+}
+
+/*
+ * call-seq:
+ *    rbuff.index(substring, offset = 0) -> integer or nil
+ *
+ * Returns the byte offset of the first occurrence of _substring_ at or after
+ * _offset_, or +nil+ if it is not found.
+ */
+static VALUE
+ossl_read_buffer_index(int argc, VALUE *argv, VALUE self)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 0);
+    VALUE sub, offset;
+    const char *head, *p, *end, *s;
+    long slen, pos = 0;
+
+    rb_scan_args(argc, argv, "11", &sub, &offset);
+    StringValue(sub);
+    if (!NIL_P(offset))
+        pos = NUM2LONG(offset);
+    if (pos < 0 || pos > rb->len)
+        return Qnil;
+
+    s = RSTRING_PTR(sub);
+    slen = RSTRING_LEN(sub);
+    head = rb->ptr + rb->off;
+    if (slen == 0)
+        return LONG2NUM(pos);
+    if (rb->len - pos < slen)
+        return Qnil;
+    end = head + rb->len - slen + 1;
+    for (p = head + pos; p < end; p++) {
+        p = memchr(p, s[0], end - p);
+        if (!p)
+            break;
+        if (!memcmp(p, s, slen))
+            return LONG2NUM(p - head);
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    rbuff.consume(size = nil, buffer = nil) -> string or nil
+ *
+ * Removes at most _size_ bytes, or everything if _size_ is +nil+, from the
+ * head of the buffer and returns them. If a _buffer_ String is given, the
+ * bytes are written into it. Returns +nil+ if the buffer is empty.
+ */
+static VALUE
+ossl_read_buffer_consume(int argc, VALUE *argv, VALUE self)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 1);
+    VALUE size, str;
+    long len;
+
+    rb_scan_args(argc, argv, "02", &size, &str);
+    len = NIL_P(size) ? rb->len : NUM2LONG(size);
+    if (len < 0)
+        rb_raise(rb_eArgError, "negative size");
+    if (!rb->len)
+        return Qnil;
+    if (len > rb->len)
+        len = rb->len;
+
+    if (NIL_P(str))
+        str = rb_str_new(rb->ptr + rb->off, len);
+    else {
+        StringValue(str);
+        rb_str_resize(str, len);
+        memcpy(RSTRING_PTR(str), rb->ptr + rb->off, len);
+        rb_enc_associate(str, rb_ascii8bit_encoding());
+    }
+    read_buffer_consumed(rb, len);
+    return str;
+}
+
+/*
+ * call-seq:
+ *    rbuff.getbyte -> integer or nil
+ *
+ * Removes one byte from the head of the buffer and returns it.
+ */
+static VALUE
+ossl_read_buffer_getbyte(VALUE self)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 1);
+    unsigned char c;
+
+    if (!rb->len)
+        return Qnil;
+    c = (unsigned char)rb->ptr[rb->off];
+    read_buffer_consumed(rb, 1);
+    return INT2FIX(c);
+}
+
+/*
+ * call-seq:
+ *    rbuff.append(string) -> self
+ *
+ * Appends the bytes in _string_ to the tail of the buffer.
+ */
+static VALUE
+ossl_read_buffer_append(VALUE self, VALUE str)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 1);
+
+    StringValue(str);
+    ossl_read_buffer_reserve(rb, RSTRING_LEN(str));
+    memcpy(rb->ptr + rb->off + rb->len, RSTRING_PTR(str), RSTRING_LEN(str));
+    rb->len += RSTRING_LEN(str);
+    return self;
+}
+
+/*
+ * call-seq:
+ *    rbuff.unshift(string) -> self
+ *
+ * Prepends the bytes in _string_ to the head of the buffer.
+ */
+static VALUE
+ossl_read_buffer_unshift(VALUE self, VALUE str)
+{
+    struct ossl_read_buffer *rb = ossl_read_buffer_get(self, 1);
+    long slen;
+
+    StringValue(str);
+    slen = RSTRING_LEN(str);
+    if (rb->off < slen) {
+        ossl_read_buffer_reserve(rb, slen);
+        memmove(rb->ptr + slen, rb->ptr + rb->off, rb->len);
+        rb->off = slen;
+    }
+    rb->off -= slen;
+    rb->len += slen;
+    memcpy(rb->ptr + rb->off, RSTRING_PTR(str), slen);
+    return self;
+}
+
+void
+Init_ossl_buffering(void)
+{
+    VALUE mBuffering = rb_define_module_under(mOSSL, "Buffering");
+
+    /*
+     * Document-class: OpenSSL::Buffering::ReadBuffer
+     *
+     * The receive buffer used by OpenSSL::Buffering. This class is internal
+     * and subject to change.
+     */
+    cReadBuffer = rb_define_class_under(mBuffering, "ReadBuffer", rb_cObject);
+    rb_define_alloc_func(cReadBuffer, ossl_read_buffer_alloc);
+    rb_undef_method(cReadBuffer, "initialize_copy");
+    rb_define_method(cReadBuffer, "size", ossl_read_buffer_size, 0);
+    rb_define_method(cReadBuffer, "empty?", ossl_read_buffer_empty_p, 0);
+    rb_define_method(cReadBuffer, "to_s", ossl_read_buffer_to_s, 0);
+    rb_define_method(cReadBuffer, "index", ossl_read_buffer_index, -1);
+    rb_define_method(cReadBuffer, "consume", ossl_read_buffer_consume, -1);
+    rb_define_method(cReadBuffer, "getbyte", ossl_read_buffer_getbyte, 0);
+    rb_define_method(cReadBuffer, "append", ossl_read_buffer_append, 1);
+    rb_define_method(cReadBuffer, "unshift", ossl_read_buffer_unshift, 1);
+}
@@ -0,0 +1,30 @@
+/*
+ * This program is licensed under the same licence as Ruby.
+ * (See the file 'COPYING'.)
+ */
+#if !defined(_OSSL_BUFFERING_H_)
+#define _OSSL_BUFFERING_H_
+
+/*
+ * OpenSSL::Buffering::ReadBuffer
+ *
+ * The receive buffer of OpenSSL::Buffering. The buffered data is
+ * ptr[off, len], so that consuming bytes from the head only advances the
+ * offset. SSLSocket#fill_rbuff decrypts directly into the free space at the
+ * tail.
+ */
+struct ossl_read_buffer {
+    char *ptr;
+    long off;
+    long len;
+    long capa;
+    /* Set while SSLSocket#fill_rbuff is writing into the buffer */
+    int busy;
+};
+
+struct ossl_read_buffer *ossl_read_buffer_get(VALUE obj, int modify);
+void ossl_read_buffer_reserve(struct ossl_read_buffer *rb, long size);
+
+void Init_ossl_buffering(void);
+
+#endif /* _OSSL_BUFFERING_H_ */
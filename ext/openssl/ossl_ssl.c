@@ -10,6 +10,31 @@
  * (See the file 'COPYING'.)
  */
 #include "ossl.h"
+#include <ruby/thread_native.h>
+#include <fcntl.h>
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+#include <openssl/core_names.h>
+#endif
+
+#ifdef HAVE_RUBY_ATOMIC_H
+#include <ruby/atomic.h>
+#ifndef RUBY_ATOMIC_LOAD
+# define RUBY_ATOMIC_LOAD(var) RUBY_ATOMIC_FETCH_ADD((var), 0)
+#endif
+#ifndef RUBY_ATOMIC_PTR_LOAD
+# define RUBY_ATOMIC_PTR_LOAD(var) RUBY_ATOMIC_PTR_CAS((var), NULL, NULL)
+#endif
+#else
+/*
+ * SSL_* calls keep the GVL without it (see OSSL_SSL_NOGVL), so the fields
+ * they share with Ruby code need no atomic access.
+ */
+typedef unsigned int rb_atomic_t;
+# define RUBY_ATOMIC_INC(var) ((void)++(var))
+# define RUBY_ATOMIC_LOAD(var) (var)
+# define RUBY_ATOMIC_FETCH_ADD(var, val) (((var) += (val)) - (val))
+# define RUBY_ATOMIC_PTR_LOAD(var) (var)
+#endif
 
 #ifndef OPENSSL_NO_SOCK
 #define numberof(ary) (int)(sizeof(ary)/sizeof((ary)[0]))
@@ -18,6 +43,19 @@
 # define OSSL_USE_NEXTPROTONEG
 #endif
 
+/*
+ * SSL_read(), SSL_write() and SSL_shutdown() are called without the GVL (see
+ * ossl_ssl_call()). This requires a thread-local flag to tell whether OpenSSL
+ * callbacks are invoked from such a region, so that they can re-acquire the
+ * GVL before touching Ruby objects, condition variables to pause the calls
+ * during SSLContext#export_sessions, and atomic operations to read the
+ * counters they update. Keep the GVL if they're not available.
+ */
+#if defined(RB_THREAD_LOCAL_SPECIFIER) && defined(HAVE_RB_NATIVE_COND_WAIT) && \
+    defined(HAVE_RUBY_ATOMIC_H)
+# define OSSL_SSL_NOGVL
+#endif
+
 #ifdef _WIN32
 #  define TO_SOCKET(s) _get_osfhandle(s)
 #else
@@ -29,15 +67,17 @@
 } while (0)
 
 VALUE mSSL;
-static VALUE eSSLError;
-static VALUE cSSLContext;
+VALUE eSSLError;
+VALUE cSSLContext;
 VALUE cSSLSocket;
 
 static VALUE eSSLErrorWaitReadable;
 static VALUE eSSLErrorWaitWritable;
+static VALUE eSSLTimeoutError;
 
 static ID id_call, ID_callback_state, id_npn_protocols_encoded, id_each;
-static VALUE sym_exception, sym_wait_readable, sym_wait_writable;
+static VALUE sym_exception, sym_wait_readable, sym_wait_writable, sym_native,
+    sym_sent, sym_received;
 
 static ID id_i_cert_store, id_i_ca_file, id_i_ca_path, id_i_verify_mode,
           id_i_verify_depth, id_i_verify_callback, id_i_client_ca,
@@ -46,17 +86,525 @@ static ID id_i_cert_store, id_i_ca_file, id_i_ca_path, id_i_verify_mode,
           id_i_session_id_context, id_i_session_get_cb, id_i_session_new_cb,
           id_i_session_remove_cb, id_i_npn_select_cb, id_i_npn_protocols,
           id_i_alpn_select_cb, id_i_alpn_protocols, id_i_servername_cb,
-          id_i_verify_hostname, id_i_keylog_cb, id_i_tmp_dh_callback;
-static ID id_i_io, id_i_context, id_i_hostname, id_i_sync_close;
+          id_i_verify_hostname, id_i_keylog_cb, id_i_tmp_dh_callback,
+          id_i_handshake_without_gvl, id_i_shared_session_cache,
+          id_i_allow_early_data_cb, id_i_cert_compression, id_i_cert_loader,
+          id_i_cert_cache_size, id_i_alpn_preference, id_i_handshake_trace,
+          id_i_ocsp_status_request, id_i_keylog_file, id_i_max_send_fragment,
+          id_i_split_send_fragment, id_i_max_pipelines, id_i_read_buffer_len,
+          id_i_dynamic_record_sizing, id_i_psk_identity, id_i_server_cert_type,
+          id_i_client_cert_type, id_i_expected_rpks, id_i_client_session_cache;
+static ID id_i_io, id_i_context, id_i_hostname, id_i_sync_close, id_i_rbuffer,
+          id_i_eof;
 
 static int ossl_ssl_ex_ptr_idx;
+static int ossl_ssl_ex_data_idx;
 static int ossl_sslctx_ex_ptr_idx;
+static int ossl_sslctx_ex_data_idx;
+
+/* A certificate cached for a host name, see SSLContext#cert_loader */
+struct ossl_cert_entry {
+    char *name;
+    /* NULL if the loader has no certificate for the host name */
+    X509 *cert;
+    EVP_PKEY *pkey;
+    STACK_OF(X509) *chain;
+    /* The LRU list, most recently used first */
+    struct ossl_cert_entry *prev, *next;
+};
+
+#if !defined(OPENSSL_NO_OCSP)
+/* An OCSP response to staple, see SSLContext#set_ocsp_response */
+struct ossl_ocsp_staple {
+    X509 *cert;
+    unsigned char *der;
+    long len;
+    /* NULL if the response has no nextUpdate */
+    ASN1_GENERALIZEDTIME *next_update;
+};
+#endif
+
+/* A session ticket key, see SSLContext#session_ticket_keys= */
+struct ossl_ticket_key {
+    unsigned char name[16];
+    unsigned char hmac_key[32];
+    unsigned char aes_key[32];
+    int size; /* 16 or 32, the length of hmac_key and aes_key */
+};
+
+/* A protocol message recorded by SSLContext#handshake_trace */
+struct ossl_trace_entry {
+    uint64_t time;
+    uint32_t len;
+    unsigned char write_p, content_type, msg_type;
+};
+
+/* The ring buffer of SSLSocket#handshake_trace */
+struct ossl_trace {
+    unsigned int size;
+    unsigned long count;
+    struct ossl_trace_entry entries[];
+};
+
+/*
+ * I/O counters of an SSLSocket, see SSLSocket#stats. The raw_* fields are
+ * only filled by ssl_stats_get() since the BIOs count them.
+ */
+struct ossl_ssl_stats {
+    uint64_t bytes_read, bytes_written;
+    uint64_t raw_bytes_read, raw_bytes_written;
+    uint64_t records_read, records_written;
+    uint64_t wait_readable, wait_writable;
+};
+
+/*
+ * Native state of an SSLContext, stored in the SSL_CTX object's ex_data and
+ * freed together with the SSL_CTX.
+ */
+struct ossl_sslctx_data {
+    /*
+     * Whether the callbacks installed unconditionally must call into Ruby.
+     * Filled by ossl_sslctx_setup() and never change afterwards since the
+     * SSLContext is frozen by then.
+     */
+    unsigned int verify_callback : 1;
+    unsigned int verify_hostname : 1;
+    /* SSLContext#verify_hostname is :native */
+    unsigned int verify_hostname_native : 1;
+    unsigned int renegotiation_cb : 1;
+    unsigned int alpn_select_cb : 1;
+    unsigned int keylog_cb : 1;
+    /* SSLContext#alpn_preference in the wire format */
+    unsigned char *alpn_preference;
+    unsigned int alpn_preference_len;
+    /* SSLContext#max_send_fragment and #split_send_fragment, or 0 */
+    unsigned int max_send_fragment, split_send_fragment;
+    /* SSLContext#dynamic_record_sizing in bytes, or 0 if disabled */
+    unsigned long dyn_record_threshold;
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    /* SSLContext#expected_rpks */
+    EVP_PKEY **expected_rpks;
+    long num_expected_rpks;
+#endif
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    /* SSLContext#psk_identity */
+    unsigned char *psk_identity;
+    size_t psk_identity_len;
+#endif
+
+    /*
+     * SSLContext#servername_contexts= as a frozen Hash, and the same map
+     * keyed by C strings for lookups. Only accessed with the GVL held.
+     */
+    VALUE servername_contexts;
+    st_table *servername_table;
+
+    /*
+     * The fields below are updated while connections are running, possibly
+     * without the GVL, so they are protected by lock.
+     */
+    rb_nativethread_lock_t lock;
+    /* The session ticket key ring. The first key encrypts new tickets. */
+    struct ossl_ticket_key *ticket_keys;
+    long num_ticket_keys;
+    unsigned long ticket_encrypt, ticket_decrypt, ticket_renew;
+    /*
+     * The certificates loaded by SSLContext#cert_loader, keyed by host name.
+     * Entries are only added and removed with the GVL held.
+     */
+    st_table *cert_table;
+    struct ossl_cert_entry *cert_head, *cert_tail;
+    long num_certs, max_certs;
+    unsigned long cert_hits, cert_misses, cert_evictions;
+    /*
+     * SSLContext#keylog_file. Lines are appended to keylog_buf and written
+     * out when it is full or a handshake completes. NULL if disabled.
+     */
+    char *keylog_buf;
+    size_t keylog_len;
+    int keylog_fd;
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    /*
+     * SSLContext#psk_keys= as a set of struct ossl_psk_entry. The table is
+     * replaced, not modified, and only with the GVL held.
+     */
+    st_table *psk_table;
+#endif
+#if !defined(OPENSSL_NO_OCSP)
+    /*
+     * The OCSP responses to staple. The array is replaced, not modified, so
+     * it may be read without the lock with the GVL held.
+     */
+    struct ossl_ocsp_staple *ocsp_staples;
+    long num_ocsp_staples;
+#endif
+    /* SSLContext#stats */
+    unsigned long connections, handshakes, resumed;
+    uint64_t handshake_time;
+    struct ossl_ssl_stats stats;
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    /* Handshakes in which certificate compression was used */
+    unsigned long cert_comp_handshakes;
+#endif
+
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+    /* SSLContext#shared_session_cache, set by ossl_sslctx_setup() */
+    struct ossl_scache *session_cache;
+#endif
+
+    /*
+     * The number of SSL_* calls running without the GVL on the SSLs using
+     * this SSL_CTX's session cache, not counting those in a callback, the
+     * number of calls waiting for SSLContext#export_sessions, and whether
+     * an export is in progress. Protected by lock; sessions_cond is
+     * broadcast when they drop. See sessions_call_enter().
+     */
+    long nogvl_calls, waiting_calls;
+    int exporting_sessions;
+#ifdef OSSL_SSL_NOGVL
+    rb_nativethread_cond_t sessions_cond;
+#endif
+};
+
+#define GetSSLCTXData(ctx) \
+    ((struct ossl_sslctx_data *)SSL_CTX_get_ex_data((ctx), ossl_sslctx_ex_data_idx))
+
+/*
+ * Native state of an SSLSocket, stored in the SSL object's ex_data. Unlike
+ * instance variables, it may be accessed while the GVL is released.
+ */
+struct ossl_ssl_data {
+    /*
+     * Serializes the SSL_* calls made without the GVL. Released while a
+     * callback runs Ruby code, see ossl_ssl_with_gvl().
+     */
+    rb_nativethread_lock_t lock;
+    /*
+     * The SSL_CTX the SSL was created with. Unlike SSL_get_SSL_CTX(), this
+     * does not change when servername_cb switches the context.
+     */
+    SSL_CTX *session_ctx;
+    /* Scratch buffer for SSLSocket#syswritev to gather a whole record */
+    char *wbuf;
+    int wbuf_busy;
+    /* Set once the first handshake is completed */
+    int handshake_done;
+    /*
+     * The values returned to OpenSSL by the callbacks, which are used after
+     * the GVL is released again and so must not be owned by a Ruby object.
+     */
+#if !defined(OPENSSL_NO_DH)
+    EVP_PKEY *tmp_dh;
+#endif
+    unsigned char selected_protocol[255];
+    /*
+     * Updated by the thread calling SSL_* functions, which holds lock or the
+     * GVL. folded is the part already added to the SSLContext#stats.
+     *
+     * seq is odd while stats, the handshake times or trace are being
+     * updated, so that they can be read without lock; see
+     * ssl_data_read_begin().
+     */
+    rb_atomic_t seq;
+    struct ossl_ssl_stats stats, folded;
+    uint64_t handshake_start, handshake_time;
+    /*
+     * SSLSocket#handshake_trace, NULL if disabled. Replaced with the GVL held
+     * by ssl_trace_resize(), and loaded by the writer with seq odd.
+     */
+    struct ossl_trace *trace;
+    /*
+     * Dynamic record sizing. dyn_bytes counts the bytes written since the
+     * connection became idle; dyn_retry is the length of an SSL_write() call
+     * that must be retried.
+     */
+    unsigned long dyn_bytes;
+    uint64_t dyn_last_write;
+    int dyn_retry;
+    int dyn_small;
+};
+
+#define GetSSLData(ssl) \
+    ((struct ossl_ssl_data *)SSL_get_ex_data((ssl), ossl_ssl_ex_data_idx))
+
+/* Monotonic clock in nanoseconds, for the durations in SSLSocket#stats */
+static uint64_t
+ossl_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Dynamic record sizing: a burst starts with records that fit in a single
+ * TCP segment (1460 bytes MSS minus the TCP options and the TLS record
+ * overhead), so that the peer can decrypt the first bytes before the whole
+ * congestion window arrives. After SSLContext#dynamic_record_sizing bytes,
+ * full-sized records are used. The burst ends after one second without
+ * writes.
+ */
+#define OSSL_DYN_RECORD_SMALL 1369
+#define OSSL_DYN_RECORD_DEFAULT_THRESHOLD (64 * 1024)
+#define OSSL_DYN_RECORD_IDLE_NS 1000000000
+
+/*
+ * Returns the number of bytes out of _num_ to pass to SSL_write(), and sets
+ * the record size for them. The caller must hold the GVL or the lock of the
+ * SSL.
+ */
+int
+ossl_ssl_dyn_record_begin(SSL *ssl, int num)
+{
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+    struct ossl_sslctx_data *ctx_data = GetSSLCTXData(data->session_ctx);
+    unsigned long threshold = ctx_data->dyn_record_threshold;
+    unsigned int max = ctx_data->max_send_fragment ?
+        ctx_data->max_send_fragment : SSL3_RT_MAX_PLAIN_LENGTH;
+    int small;
+
+    if (!threshold)
+        return num;
+    /* SSL_write() must be retried with the same arguments */
+    if (data->dyn_retry)
+        return num < data->dyn_retry ? num : data->dyn_retry;
+
+    if (ossl_clock_ns() - data->dyn_last_write > OSSL_DYN_RECORD_IDLE_NS)
+        data->dyn_bytes = 0;
+    small = data->dyn_bytes < threshold && max > OSSL_DYN_RECORD_SMALL;
+    if (small != data->dyn_small) {
+        SSL_set_max_send_fragment(ssl, small ? OSSL_DYN_RECORD_SMALL : max);
+#ifdef HAVE_SSL_CTX_SET_SPLIT_SEND_FRAGMENT
+        /* Lowering max_send_fragment lowers split_send_fragment too */
+        if (!small)
+            SSL_set_split_send_fragment(ssl, ctx_data->split_send_fragment ?
+                                        ctx_data->split_send_fragment : max);
+#endif
+        data->dyn_small = small;
+    }
+    if (small && threshold - data->dyn_bytes < (unsigned long)num)
+        num = (int)(threshold - data->dyn_bytes);
+    return num;
+}
+
+/* Accounts the result _ret_ of SSL_write() of _num_ bytes */
+void
+ossl_ssl_dyn_record_end(SSL *ssl, int num, int ret)
+{
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+
+    if (!GetSSLCTXData(data->session_ctx)->dyn_record_threshold)
+        return;
+    if (ret > 0) {
+        data->dyn_bytes += ret;
+        data->dyn_last_write = ossl_clock_ns();
+        data->dyn_retry = 0;
+    }
+    else {
+        data->dyn_retry = num;
+    }
+}
+
+/*
+ * The counters of an SSL are read with the GVL held, while the thread
+ * calling SSL_* functions may be updating them without it. Taking the lock of
+ * the SSL with the GVL held could deadlock, so the writer makes data->seq odd
+ * for the duration of the update instead, and the reader retries until it
+ * sees the same even value before and after copying.
+ */
+static void
+ssl_data_write_begin(struct ossl_ssl_data *data)
+{
+    RUBY_ATOMIC_INC(data->seq);
+}
+
+static void
+ssl_data_write_end(struct ossl_ssl_data *data)
+{
+    RUBY_ATOMIC_INC(data->seq);
+}
+
+static rb_atomic_t
+ssl_data_read_begin(struct ossl_ssl_data *data)
+{
+    rb_atomic_t seq;
+
+    /* The writer never blocks while seq is odd */
+    while ((seq = RUBY_ATOMIC_LOAD(data->seq)) & 1)
+        ;
+    return seq;
+}
+
+/* Returns true if the copy made since ssl_data_read_begin() may be torn */
+static int
+ssl_data_read_retry(struct ossl_ssl_data *data, rb_atomic_t seq)
+{
+    /* A read-modify-write, so that the copy is not reordered after it */
+    return RUBY_ATOMIC_FETCH_ADD(data->seq, 0) != seq;
+}
+
+/*
+ * Counts the bytes transferred by an SSL_* call and whether it has to wait
+ * for the socket. The caller must hold the GVL or the lock of the SSL.
+ */
+void
+ossl_ssl_stats_update(const SSL *ssl, long nread, long nwritten, int code)
+{
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+    struct ossl_ssl_stats *stats = &data->stats;
+
+    ssl_data_write_begin(data);
+    stats->bytes_read += nread;
+    stats->bytes_written += nwritten;
+    if (code == SSL_ERROR_WANT_READ)
+        stats->wait_readable++;
+    else if (code == SSL_ERROR_WANT_WRITE)
+        stats->wait_writable++;
+    ssl_data_write_end(data);
+}
+
+static void
+ssl_stats_get(const SSL *ssl, struct ossl_ssl_stats *out)
+{
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+    BIO *rbio = SSL_get_rbio(ssl), *wbio = SSL_get_wbio(ssl);
+    rb_atomic_t seq;
+
+    do {
+        seq = ssl_data_read_begin(data);
+        *out = data->stats;
+    } while (ssl_data_read_retry(data, seq));
+    out->raw_bytes_read = rbio ? BIO_number_read(rbio) : 0;
+    out->raw_bytes_written = wbio ? BIO_number_written(wbio) : 0;
+}
+
+/*
+ * Adds the counters of the SSL to SSLContext#stats. It may be called more
+ * than once, only the growth since the previous call is added.
+ */
+static void
+ssl_stats_fold(const SSL *ssl)
+{
+    struct ossl_ssl_data *ssl_data = GetSSLData(ssl);
+    struct ossl_sslctx_data *data = GetSSLCTXData(ssl_data->session_ctx);
+    struct ossl_ssl_stats cur, *prev = &ssl_data->folded, *sum = &data->stats;
+
+    ssl_stats_get(ssl, &cur);
+    rb_nativethread_lock_lock(&data->lock);
+    sum->bytes_read += cur.bytes_read - prev->bytes_read;
+    sum->bytes_written += cur.bytes_written - prev->bytes_written;
+    sum->raw_bytes_read += cur.raw_bytes_read - prev->raw_bytes_read;
+    sum->raw_bytes_written += cur.raw_bytes_written - prev->raw_bytes_written;
+    sum->records_read += cur.records_read - prev->records_read;
+    sum->records_written += cur.records_written - prev->records_written;
+    sum->wait_readable += cur.wait_readable - prev->wait_readable;
+    sum->wait_writable += cur.wait_writable - prev->wait_writable;
+    rb_nativethread_lock_unlock(&data->lock);
+    *prev = cur;
+}
+
+#ifdef OSSL_SSL_NOGVL
+/*
+ * The SSL whose SSL_* call the current thread is running without the GVL, or
+ * NULL. ossl_ssl_in_callback is set while a callback invoked from such a call
+ * runs with the GVL.
+ */
+static RB_THREAD_LOCAL_SPECIFIER struct ossl_ssl_data *ossl_ssl_gvl_released;
+static RB_THREAD_LOCAL_SPECIFIER int ossl_ssl_in_callback;
+
+/*
+ * SSLContext#export_sessions walks the internal session cache with the GVL
+ * held, while OpenSSL may modify it from SSL_* calls running without the GVL.
+ * Each such call is counted in nogvl_calls of the session SSL_CTX except while
+ * it is in a callback, and waits while an export is in progress before it
+ * enters or returns to OpenSSL. An export starts once the calls that waited
+ * for the previous one have resumed, so that repeated exports cannot starve
+ * them, and walks the cache once nogvl_calls is 0.
+ *
+ * Returns 0 without counting the call if *interrupted is set while waiting.
+ */
+static int
+sessions_call_enter(struct ossl_sslctx_data *data, const int *interrupted)
+{
+    int ok;
+
+    rb_nativethread_lock_lock(&data->lock);
+    if (data->exporting_sessions) {
+        data->waiting_calls++;
+        while (data->exporting_sessions && !(interrupted && *interrupted))
+            rb_native_cond_wait(&data->sessions_cond, &data->lock);
+        if (!--data->waiting_calls)
+            rb_native_cond_broadcast(&data->sessions_cond);
+    }
+    if ((ok = !data->exporting_sessions))
+        data->nogvl_calls++;
+    rb_nativethread_lock_unlock(&data->lock);
+    return ok;
+}
+
+static void
+sessions_call_leave(struct ossl_sslctx_data *data)
+{
+    rb_nativethread_lock_lock(&data->lock);
+    if (!--data->nogvl_calls && data->exporting_sessions)
+        rb_native_cond_broadcast(&data->sessions_cond);
+    rb_nativethread_lock_unlock(&data->lock);
+}
+
+/* Wakes up the threads waiting in sessions_call_enter() and export_sessions */
+static void
+sessions_call_wakeup(struct ossl_sslctx_data *data)
+{
+    rb_nativethread_lock_lock(&data->lock);
+    rb_native_cond_broadcast(&data->sessions_cond);
+    rb_nativethread_lock_unlock(&data->lock);
+}
+#endif
+
+/*
+ * Calls func(arg) with the GVL. Every OpenSSL callback that may call into Ruby
+ * must go through this, since it may be invoked from SSL_read() etc. running
+ * without the GVL.
+ *
+ * The lock of the SSL is released meanwhile, as Ruby code may use the same
+ * SSLSocket, from the callback or from another thread, and a thread waiting
+ * for the GVL must not hold it.
+ */
+static void *
+ossl_ssl_with_gvl(void *(*func)(void *), void *arg)
+{
+#ifdef OSSL_SSL_NOGVL
+    struct ossl_ssl_data *data = ossl_ssl_gvl_released;
+
+    if (data) {
+        struct ossl_sslctx_data *ctx_data = GetSSLCTXData(data->session_ctx);
+        void *ret;
+
+        ossl_ssl_gvl_released = NULL;
+        rb_nativethread_lock_unlock(&data->lock);
+        sessions_call_leave(ctx_data);
+        ossl_ssl_in_callback = 1;
+        ret = rb_thread_call_with_gvl(func, arg);
+        ossl_ssl_in_callback = 0;
+        sessions_call_enter(ctx_data, NULL);
+        rb_nativethread_lock_lock(&data->lock);
+        ossl_ssl_gvl_released = data;
+        return ret;
+    }
+#endif
+    return func(arg);
+}
 
 static void
 ossl_sslctx_mark(void *ptr)
 {
     SSL_CTX *ctx = ptr;
+    struct ossl_sslctx_data *data = GetSSLCTXData(ctx);
+
     rb_gc_mark((VALUE)SSL_CTX_get_ex_data(ctx, ossl_sslctx_ex_ptr_idx));
+    if (data)
+        rb_gc_mark(data->servername_contexts);
 }
 
 static void
@@ -65,6 +613,169 @@ ossl_sslctx_free(void *ptr)
     SSL_CTX_free(ptr);
 }
 
+static void
+cert_entry_free(struct ossl_cert_entry *entry)
+{
+    X509_free(entry->cert);
+    EVP_PKEY_free(entry->pkey);
+    sk_X509_pop_free(entry->chain, X509_free);
+    ruby_xfree(entry->name);
+    ruby_xfree(entry);
+}
+
+#if !defined(OPENSSL_NO_OCSP)
+static void
+ocsp_staple_free(struct ossl_ocsp_staple *staple)
+{
+    X509_free(staple->cert);
+    ruby_xfree(staple->der);
+    ASN1_GENERALIZEDTIME_free(staple->next_update);
+}
+#endif
+
+#define OSSL_KEYLOG_BUF_SIZE 4096
+
+static void
+keylog_write(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Nowhere to report the error; the lines are dropped */
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Must be called with data->lock held, or when there are no connections */
+static void
+keylog_flush(struct ossl_sslctx_data *data)
+{
+    keylog_write(data->keylog_fd, data->keylog_buf, data->keylog_len);
+    data->keylog_len = 0;
+}
+
+static void
+ssl_keylog_flush(const SSL *ssl)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
+
+    if (!data->keylog_buf)
+        return;
+    rb_nativethread_lock_lock(&data->lock);
+    if (data->keylog_len)
+        keylog_flush(data);
+    rb_nativethread_lock_unlock(&data->lock);
+}
+
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+/* An external PSK set by SSLContext#psk_keys= */
+struct ossl_psk_entry {
+    const unsigned char *identity;
+    size_t identity_len;
+    unsigned char *key;
+    size_t key_len;
+};
+
+static int
+psk_entry_cmp(st_data_t a, st_data_t b)
+{
+    const struct ossl_psk_entry *x = (void *)a, *y = (void *)b;
+
+    return x->identity_len != y->identity_len ||
+        memcmp(x->identity, y->identity, x->identity_len);
+}
+
+static st_index_t
+psk_entry_hash(st_data_t a)
+{
+    const struct ossl_psk_entry *x = (void *)a;
+
+    return rb_memhash(x->identity, x->identity_len);
+}
+
+static const struct st_hash_type psk_entry_hash_type = {
+    psk_entry_cmp,
+    psk_entry_hash,
+};
+
+static int
+psk_entry_free_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct ossl_psk_entry *entry = (void *)key;
+
+    OPENSSL_cleanse(entry->key, entry->key_len);
+    ruby_xfree(entry);
+
+    return ST_CONTINUE;
+}
+
+static void
+psk_table_free(st_table *table)
+{
+    st_foreach(table, psk_entry_free_i, 0);
+    st_free_table(table);
+}
+#endif
+
+static void
+ossl_sslctx_data_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                      int idx, long argl, void *argp)
+{
+    struct ossl_sslctx_data *data = ptr;
+
+    if (!data)
+        return;
+    rb_nativethread_lock_destroy(&data->lock);
+#ifdef OSSL_SSL_NOGVL
+    rb_native_cond_destroy(&data->sessions_cond);
+#endif
+    if (data->servername_table)
+        st_free_table(data->servername_table);
+    ruby_xfree(data->alpn_preference);
+    while (data->cert_head) {
+        struct ossl_cert_entry *entry = data->cert_head;
+        data->cert_head = entry->next;
+        cert_entry_free(entry);
+    }
+    if (data->cert_table)
+        st_free_table(data->cert_table);
+    if (data->keylog_buf) {
+        keylog_flush(data);
+        close(data->keylog_fd);
+        ruby_xfree(data->keylog_buf);
+    }
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    for (long i = 0; i < data->num_expected_rpks; i++)
+        EVP_PKEY_free(data->expected_rpks[i]);
+    ruby_xfree(data->expected_rpks);
+#endif
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    if (data->psk_table)
+        psk_table_free(data->psk_table);
+    ruby_xfree(data->psk_identity);
+#endif
+#if !defined(OPENSSL_NO_OCSP)
+    for (long i = 0; i < data->num_ocsp_staples; i++)
+        ocsp_staple_free(&data->ocsp_staples[i]);
+    ruby_xfree(data->ocsp_staples);
+#endif
+    if (data->ticket_keys) {
+        OPENSSL_cleanse(data->ticket_keys,
+                        sizeof(*data->ticket_keys) * data->num_ticket_keys);
+        ruby_xfree(data->ticket_keys);
+    }
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+    if (data->session_cache)
+        ossl_scache_release(data->session_cache);
+#endif
+    ruby_xfree(data);
+}
+
 static const rb_data_type_t ossl_sslctx_type = {
     "OpenSSL/SSL/CTX",
     {
@@ -82,6 +793,7 @@ ossl_sslctx_s_alloc(VALUE klass)
         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
         SSL_MODE_RELEASE_BUFFERS;
     VALUE obj;
+    struct ossl_sslctx_data *data;
 
     obj = TypedData_Wrap_Struct(klass, &ossl_sslctx_type, 0);
     ctx = SSL_CTX_new(TLS_method());
@@ -93,6 +805,20 @@ ossl_sslctx_s_alloc(VALUE klass)
     RTYPEDDATA_DATA(obj) = ctx;
     if (!SSL_CTX_set_ex_data(ctx, ossl_sslctx_ex_ptr_idx, (void *)obj))
         ossl_raise(eSSLError, "SSL_CTX_set_ex_data");
+    data = ZALLOC(struct ossl_sslctx_data);
+    data->servername_contexts = Qnil;
+    rb_nativethread_lock_initialize(&data->lock);
+#ifdef OSSL_SSL_NOGVL
+    rb_native_cond_initialize(&data->sessions_cond);
+#endif
+    if (!SSL_CTX_set_ex_data(ctx, ossl_sslctx_ex_data_idx, data)) {
+        rb_nativethread_lock_destroy(&data->lock);
+#ifdef OSSL_SSL_NOGVL
+        rb_native_cond_destroy(&data->sessions_cond);
+#endif
+        ruby_xfree(data);
+        ossl_raise(eSSLError, "SSL_CTX_set_ex_data");
+    }
 
     return obj;
 }
@@ -115,24 +841,40 @@ ossl_call_client_cert_cb(VALUE obj)
     return rb_ary_new3(2, cert, key);
 }
 
-static int
-ossl_client_cert_cb(SSL *ssl, X509 **x509, EVP_PKEY **pkey)
+struct client_cert_cb_args {
+    SSL *ssl;
+    X509 **x509;
+    EVP_PKEY **pkey;
+};
+
+static void *
+ossl_client_cert_cb_i(void *ptr)
 {
+    struct client_cert_cb_args *args = ptr;
     VALUE obj, ret;
 
-    obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    obj = (VALUE)SSL_get_ex_data(args->ssl, ossl_ssl_ex_ptr_idx);
     ret = rb_protect(ossl_call_client_cert_cb, obj, NULL);
     if (NIL_P(ret))
-        return 0;
+        return (void *)0;
 
-    *x509 = DupX509CertPtr(RARRAY_AREF(ret, 0));
-    *pkey = DupPKeyPtr(RARRAY_AREF(ret, 1));
+    *args->x509 = DupX509CertPtr(RARRAY_AREF(ret, 0));
+    *args->pkey = DupPKeyPtr(RARRAY_AREF(ret, 1));
 
-    return 1;
+    return (void *)1;
+}
+
+static int
+ossl_client_cert_cb(SSL *ssl, X509 **x509, EVP_PKEY **pkey)
+{
+    struct client_cert_cb_args args = { ssl, x509, pkey };
+
+    return (int)(VALUE)ossl_ssl_with_gvl(ossl_client_cert_cb_i, &args);
 }
 
 #if !defined(OPENSSL_NO_DH)
 struct tmp_dh_callback_args {
+    SSL *ssl;
     VALUE ssl_obj;
     int is_export;
     int keylength;
@@ -142,7 +884,9 @@ static VALUE
 ossl_call_tmp_dh_callback(VALUE arg)
 {
     struct tmp_dh_callback_args *args = (struct tmp_dh_callback_args *)arg;
+    struct ossl_ssl_data *data = GetSSLData(args->ssl);
     VALUE ctx_obj, cb, obj;
+    EVP_PKEY *pkey;
     const DH *dh;
 
     ctx_obj = rb_attr_get(args->ssl_obj, id_i_context);
@@ -153,28 +897,77 @@ ossl_call_tmp_dh_callback(VALUE arg)
     obj = rb_funcall(cb, id_call, 3, args->ssl_obj, INT2NUM(args->is_export),
                      INT2NUM(args->keylength));
     // TODO: We should riase if obj is not DH
-    dh = EVP_PKEY_get0_DH(GetPKeyPtr(obj));
-    if (!dh)
+    pkey = GetPKeyPtr(obj);
+    dh = EVP_PKEY_get0_DH(pkey);
+    if (!dh) {
         ossl_clear_error();
-
-    return (VALUE)dh;
+        return (VALUE)NULL;
+    }
+    /* OpenSSL does not take a reference to the returned DH */
+    EVP_PKEY_up_ref(pkey);
+    EVP_PKEY_free(data->tmp_dh);
+    data->tmp_dh = pkey;
+
+    return (VALUE)dh;
 }
 
-static DH *
-ossl_tmp_dh_callback(SSL *ssl, int is_export, int keylength)
+static void *
+ossl_tmp_dh_callback_i(void *ptr)
 {
+    struct tmp_dh_callback_args *args = ptr;
     int state;
-    VALUE rb_ssl = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
-    struct tmp_dh_callback_args args = {rb_ssl, is_export, keylength};
-    VALUE ret = rb_protect(ossl_call_tmp_dh_callback, (VALUE)&args, &state);
+    VALUE ret = rb_protect(ossl_call_tmp_dh_callback, (VALUE)args, &state);
     if (state) {
-        rb_ivar_set(rb_ssl, ID_callback_state, INT2NUM(state));
+        rb_ivar_set(args->ssl_obj, ID_callback_state, INT2NUM(state));
         return NULL;
     }
-    return (DH *)ret;
+    return (void *)ret;
+}
+
+static DH *
+ossl_tmp_dh_callback(SSL *ssl, int is_export, int keylength)
+{
+    VALUE rb_ssl = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    struct tmp_dh_callback_args args = {ssl, rb_ssl, is_export, keylength};
+
+    return ossl_ssl_with_gvl(ossl_tmp_dh_callback_i, &args);
 }
 #endif /* OPENSSL_NO_DH */
 
+#ifdef HAVE_SSL_READ_EARLY_DATA
+static VALUE
+ossl_call_allow_early_data_cb(VALUE ssl_obj)
+{
+    VALUE ctx_obj, cb;
+
+    ctx_obj = rb_attr_get(ssl_obj, id_i_context);
+    cb = rb_attr_get(ctx_obj, id_i_allow_early_data_cb);
+    if (NIL_P(cb))
+        return Qtrue;
+
+    return rb_funcallv(cb, id_call, 1, &ssl_obj);
+}
+
+static void *
+ossl_allow_early_data_cb_i(void *ptr)
+{
+    VALUE ssl_obj = (VALUE)SSL_get_ex_data(ptr, ossl_ssl_ex_ptr_idx);
+    int state;
+    VALUE ret = rb_protect(ossl_call_allow_early_data_cb, ssl_obj, &state);
+    if (state) {
+        rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
+        return (void *)0;
+    }
+    return (void *)(VALUE)RTEST(ret);
+}
+
+static int
+ossl_allow_early_data_cb(SSL *ssl, void *arg)
+{
+    return (int)(VALUE)ossl_ssl_with_gvl(ossl_allow_early_data_cb_i, ssl);
+}
+#endif
+
 static VALUE
 call_verify_certificate_identity(VALUE ctx_v)
 {
@@ -196,10 +989,18 @@ call_verify_certificate_identity(VALUE ctx_v)
                       cert_obj, hostname);
 }
 
-static int
-ossl_ssl_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
+struct verify_callback_args {
+    int preverify_ok;
+    X509_STORE_CTX *ctx;
+};
+
+static void *
+ossl_ssl_verify_callback_i(void *ptr)
 {
-    VALUE cb, ssl_obj, sslctx_obj, verify_hostname, ret;
+    struct verify_callback_args *args = ptr;
+    X509_STORE_CTX *ctx = args->ctx;
+    int preverify_ok = args->preverify_ok;
+    VALUE cb, ssl_obj, sslctx_obj, ret;
     SSL *ssl;
     int status;
 
@@ -207,14 +1008,15 @@ ossl_ssl_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
     ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
     sslctx_obj = rb_attr_get(ssl_obj, id_i_context);
     cb = rb_attr_get(sslctx_obj, id_i_verify_callback);
-    verify_hostname = rb_attr_get(sslctx_obj, id_i_verify_hostname);
 
-    if (preverify_ok && RTEST(verify_hostname) && !SSL_is_server(ssl) &&
+    /* Not set if verify_hostname is :native */
+    if (preverify_ok && GetSSLCTXData(SSL_get_SSL_CTX(ssl))->verify_hostname &&
+        !SSL_is_server(ssl) &&
         !X509_STORE_CTX_get_error_depth(ctx)) {
         ret = rb_protect(call_verify_certificate_identity, (VALUE)ctx, &status);
         if (status) {
             rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(status));
-            return 0;
+            return (void *)0;
         }
         if (ret != Qtrue) {
             preverify_ok = 0;
@@ -222,7 +1024,23 @@ ossl_ssl_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
         }
     }
 
-    return ossl_verify_cb_call(cb, preverify_ok, ctx);
+    return (void *)(VALUE)ossl_verify_cb_call(cb, preverify_ok, ctx);
+}
+
+static int
+ossl_ssl_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
+{
+    struct verify_callback_args args = { preverify_ok, ctx };
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    struct ossl_sslctx_data *data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
+
+    /* Avoid taking the GVL if there is nothing to do in Ruby */
+    if (!data->verify_callback &&
+        !(preverify_ok && data->verify_hostname && !SSL_is_server(ssl) &&
+          !X509_STORE_CTX_get_error_depth(ctx)))
+        return preverify_ok;
+
+    return (int)(VALUE)ossl_ssl_with_gvl(ossl_ssl_verify_callback_i, &args);
 }
 
 static VALUE
@@ -239,18 +1057,26 @@ ossl_call_session_get_cb(VALUE ary)
     return rb_funcallv(cb, id_call, 1, &ary);
 }
 
-static SSL_SESSION *
-ossl_sslctx_session_get_cb(SSL *ssl, const unsigned char *buf, int len, int *copy)
+struct session_get_cb_args {
+    SSL *ssl;
+    const unsigned char *buf;
+    int len;
+    int *copy;
+};
+
+static void *
+ossl_sslctx_session_get_cb_i(void *ptr)
 {
+    struct session_get_cb_args *args = ptr;
     VALUE ary, ssl_obj, ret_obj;
     SSL_SESSION *sess;
     int state = 0;
 
     OSSL_Debug("SSL SESSION get callback entered");
-    ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    ssl_obj = (VALUE)SSL_get_ex_data(args->ssl, ossl_ssl_ex_ptr_idx);
     ary = rb_ary_new2(2);
     rb_ary_push(ary, ssl_obj);
-    rb_ary_push(ary, rb_str_new((const char *)buf, len));
+    rb_ary_push(ary, rb_str_new((const char *)args->buf, args->len));
 
     ret_obj = rb_protect(ossl_call_session_get_cb, ary, &state);
     if (state) {
@@ -260,12 +1086,22 @@ ossl_sslctx_session_get_cb(SSL *ssl, const unsigned char *buf, int len, int *cop
     if (!rb_obj_is_instance_of(ret_obj, cSSLSession))
         return NULL;
 
+    /* The Session may be freed once the GVL is released */
     GetSSLSession(ret_obj, sess);
-    *copy = 1;
+    SSL_SESSION_up_ref(sess);
+    *args->copy = 0;
 
     return sess;
 }
 
+static SSL_SESSION *
+ossl_sslctx_session_get_cb(SSL *ssl, const unsigned char *buf, int len, int *copy)
+{
+    struct session_get_cb_args args = { ssl, buf, len, copy };
+
+    return ossl_ssl_with_gvl(ossl_sslctx_session_get_cb_i, &args);
+}
+
 static VALUE
 ossl_call_session_new_cb(VALUE ary)
 {
@@ -280,19 +1116,24 @@ ossl_call_session_new_cb(VALUE ary)
     return rb_funcallv(cb, id_call, 1, &ary);
 }
 
-/* return 1 normal.  return 0 removes the session */
-static int
-ossl_sslctx_session_new_cb(SSL *ssl, SSL_SESSION *sess)
+struct session_new_cb_args {
+    SSL *ssl;
+    SSL_SESSION *sess;
+};
+
+static void *
+ossl_sslctx_session_new_cb_i(void *ptr)
 {
+    struct session_new_cb_args *args = ptr;
     VALUE ary, ssl_obj, sess_obj;
     int state = 0;
 
     OSSL_Debug("SSL SESSION new callback entered");
 
-    ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    ssl_obj = (VALUE)SSL_get_ex_data(args->ssl, ossl_ssl_ex_ptr_idx);
     sess_obj = rb_obj_alloc(cSSLSession);
-    SSL_SESSION_up_ref(sess);
-    DATA_PTR(sess_obj) = sess;
+    SSL_SESSION_up_ref(args->sess);
+    DATA_PTR(sess_obj) = args->sess;
 
     ary = rb_ary_new2(2);
     rb_ary_push(ary, ssl_obj);
@@ -303,6 +1144,17 @@ ossl_sslctx_session_new_cb(SSL *ssl, SSL_SESSION *sess)
         rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
     }
 
+    return NULL;
+}
+
+/* return 1 normal.  return 0 removes the session */
+static int
+ossl_sslctx_session_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    struct session_new_cb_args args = { ssl, sess };
+
+    ossl_ssl_with_gvl(ossl_sslctx_session_new_cb_i, &args);
+
     /*
      * return 0 which means to OpenSSL that the session is still
      * valid (since we created Ruby Session object) and was not freed by us
@@ -341,23 +1193,85 @@ ossl_call_keylog_cb(VALUE args_v)
     return rb_funcall(cb, id_call, 2, args->ssl_obj, line_v);
 }
 
+static void *
+ossl_sslctx_keylog_cb_i(void *ptr)
+{
+    struct ossl_call_keylog_cb_args *args = ptr;
+    int state = 0;
+
+    OSSL_Debug("SSL keylog callback entered");
+
+    rb_protect(ossl_call_keylog_cb, (VALUE)args, &state);
+    if (state) {
+        rb_ivar_set(args->ssl_obj, ID_callback_state, INT2NUM(state));
+    }
+
+    return NULL;
+}
+
+static void
+keylog_append(struct ossl_sslctx_data *data, const char *line)
+{
+    size_t len = strlen(line);
+
+    rb_nativethread_lock_lock(&data->lock);
+    if (data->keylog_len + len + 1 > OSSL_KEYLOG_BUF_SIZE)
+        keylog_flush(data);
+    if (len + 1 > OSSL_KEYLOG_BUF_SIZE) {
+        keylog_write(data->keylog_fd, line, len);
+        keylog_write(data->keylog_fd, "\n", 1);
+    }
+    else {
+        memcpy(data->keylog_buf + data->keylog_len, line, len);
+        data->keylog_buf[data->keylog_len + len] = '\n';
+        data->keylog_len += len + 1;
+    }
+    rb_nativethread_lock_unlock(&data->lock);
+}
+
 static void
 ossl_sslctx_keylog_cb(const SSL *ssl, const char *line)
 {
-    VALUE ssl_obj;
+    struct ossl_sslctx_data *data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
     struct ossl_call_keylog_cb_args args;
-    int state = 0;
 
-    OSSL_Debug("SSL keylog callback entered");
+    if (data->keylog_buf)
+        keylog_append(data, line);
+    if (!data->keylog_cb)
+        return;
 
-    ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
-    args.ssl_obj = ssl_obj;
+    args.ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
     args.line = line;
 
-    rb_protect(ossl_call_keylog_cb, (VALUE)&args, &state);
-    if (state) {
-        rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
+    ossl_ssl_with_gvl(ossl_sslctx_keylog_cb_i, &args);
+}
+
+/*
+ * Opens SSLContext#keylog_file. The descriptor is owned by the SSL_CTX and
+ * closed when it is freed.
+ */
+static void
+keylog_open(struct ossl_sslctx_data *data, VALUE val)
+{
+    int fd;
+
+    if (RB_INTEGER_TYPE_P(val) || rb_respond_to(val, rb_intern("fileno"))) {
+        if (!RB_INTEGER_TYPE_P(val))
+            val = rb_funcall(val, rb_intern("fileno"), 0);
+        fd = rb_cloexec_dup(NUM2INT(val));
+        if (fd < 0)
+            rb_sys_fail("dup");
+    }
+    else {
+        val = rb_get_path(val);
+        fd = rb_cloexec_open(RSTRING_PTR(val), O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (fd < 0)
+            rb_sys_fail_str(val);
     }
+    rb_update_max_fd(fd);
+    data->keylog_buf = ALLOC_N(char, OSSL_KEYLOG_BUF_SIZE);
+    data->keylog_len = 0;
+    data->keylog_fd = fd;
 }
 #endif
 
@@ -375,9 +1289,15 @@ ossl_call_session_remove_cb(VALUE ary)
     return rb_funcallv(cb, id_call, 1, &ary);
 }
 
-static void
-ossl_sslctx_session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+struct session_remove_cb_args {
+    SSL_CTX *ctx;
+    SSL_SESSION *sess;
+};
+
+static void *
+ossl_sslctx_session_remove_cb_i(void *ptr)
 {
+    struct session_remove_cb_args *args = ptr;
     VALUE ary, sslctx_obj, sess_obj;
     int state = 0;
 
@@ -386,14 +1306,14 @@ ossl_sslctx_session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
      * when SSL_CTX_free() is called.
      */
     if (rb_during_gc())
-        return;
+        return NULL;
 
     OSSL_Debug("SSL SESSION remove callback entered");
 
-    sslctx_obj = (VALUE)SSL_CTX_get_ex_data(ctx, ossl_sslctx_ex_ptr_idx);
+    sslctx_obj = (VALUE)SSL_CTX_get_ex_data(args->ctx, ossl_sslctx_ex_ptr_idx);
     sess_obj = rb_obj_alloc(cSSLSession);
-    SSL_SESSION_up_ref(sess);
-    DATA_PTR(sess_obj) = sess;
+    SSL_SESSION_up_ref(args->sess);
+    DATA_PTR(sess_obj) = args->sess;
 
     ary = rb_ary_new2(2);
     rb_ary_push(ary, sslctx_obj);
@@ -407,7 +1327,124 @@ ossl_sslctx_session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
         rb_ivar_set(sslctx_obj, ID_callback_state, INT2NUM(state));
 */
     }
+
+    return NULL;
+}
+
+static void
+ossl_sslctx_session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    struct session_remove_cb_args args = { ctx, sess };
+
+    ossl_ssl_with_gvl(ossl_sslctx_session_remove_cb_i, &args);
+}
+
+/*
+ * Encrypts or decrypts a session ticket with the key ring installed by
+ * SSLContext#session_ticket_keys=. It does not call into Ruby, so it is safe
+ * to run without the GVL.
+ */
+static int
+ossl_sslctx_ticket_key_cb(SSL *ssl, unsigned char key_name[16],
+                          unsigned char iv[EVP_MAX_IV_LENGTH],
+                          EVP_CIPHER_CTX *cctx,
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+                          EVP_MAC_CTX *hctx,
+#else
+                          HMAC_CTX *hctx,
+#endif
+                          int enc)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(GetSSLData(ssl)->session_ctx);
+    struct ossl_ticket_key key;
+    const EVP_CIPHER *cipher;
+    long i;
+    int ret = 0;
+
+    rb_nativethread_lock_lock(&data->lock);
+    if (enc) {
+        if (data->num_ticket_keys > 0) {
+            key = data->ticket_keys[0];
+            data->ticket_encrypt++;
+            ret = 1;
+        }
+    }
+    else {
+        for (i = 0; i < data->num_ticket_keys; i++) {
+            if (!memcmp(key_name, data->ticket_keys[i].name, 16)) {
+                key = data->ticket_keys[i];
+                data->ticket_decrypt++;
+                /* Issue a new ticket if it was made with a previous key */
+                if (i > 0)
+                    data->ticket_renew++;
+                ret = i > 0 ? 2 : 1;
+                break;
+            }
+        }
+    }
+    rb_nativethread_lock_unlock(&data->lock);
+    if (!ret)
+        return 0;
+
+    cipher = key.size == 32 ? EVP_aes_256_cbc() : EVP_aes_128_cbc();
+    if (enc) {
+        memcpy(key_name, key.name, 16);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) != 1 ||
+            !EVP_EncryptInit_ex(cctx, cipher, NULL, key.aes_key, iv))
+            ret = -1;
+    }
+    else {
+        if (!EVP_DecryptInit_ex(cctx, cipher, NULL, key.aes_key, iv))
+            ret = -1;
+    }
+    if (ret > 0) {
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, key.size),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+            OSSL_PARAM_construct_end(),
+        };
+        if (!EVP_MAC_CTX_set_params(hctx, params))
+            ret = -1;
+#else
+        if (!HMAC_Init_ex(hctx, key.hmac_key, key.size, EVP_sha256(), NULL))
+            ret = -1;
+#endif
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+
+    return ret;
+}
+
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+/*
+ * Session callbacks for SSLContext#shared_session_cache. They do not call into
+ * Ruby, so they are safe to run without the GVL.
+ */
+static SSL_SESSION *
+ossl_sslctx_scache_get_cb(SSL *ssl, const unsigned char *id, int len, int *copy)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(GetSSLData(ssl)->session_ctx);
+
+    *copy = 0;
+    return ossl_scache_lookup(data->session_cache, id, len);
+}
+
+static int
+ossl_sslctx_scache_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(GetSSLData(ssl)->session_ctx);
+
+    ossl_scache_store(data->session_cache, sess);
+    return 0;
+}
+
+static void
+ossl_sslctx_scache_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    ossl_scache_remove(GetSSLCTXData(ctx)->session_cache, sess);
 }
+#endif
 
 static VALUE
 ossl_sslctx_add_extra_chain_cert_i(RB_BLOCK_CALL_FUNC_ARGLIST(i, arg))
@@ -427,6 +1464,35 @@ ossl_sslctx_add_extra_chain_cert_i(RB_BLOCK_CALL_FUNC_ARGLIST(i, arg))
 
 static VALUE ossl_sslctx_setup(VALUE self);
 
+/*
+ * Looks up the host name in SSLContext#servername_contexts, first as is and
+ * then with the leftmost label replaced by "*". Returns the SSLContext, or
+ * Qnil if there is no entry for it.
+ */
+static VALUE
+ossl_sslctx_servername_lookup(SSL_CTX *ctx, const char *servername)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(ctx);
+    const char *dot;
+    char wildcard[256];
+    st_data_t val;
+
+    if (!data->servername_table)
+        return Qnil;
+    if (st_lookup(data->servername_table, (st_data_t)servername, &val))
+        return (VALUE)val;
+
+    dot = strchr(servername, '.');
+    if (!dot || !dot[1] || strlen(dot) >= sizeof(wildcard) - 1)
+        return Qnil;
+    wildcard[0] = '*';
+    strcpy(wildcard + 1, dot);
+    if (st_lookup(data->servername_table, (st_data_t)wildcard, &val))
+        return (VALUE)val;
+
+    return Qnil;
+}
+
 static VALUE
 ossl_call_servername_cb(VALUE arg)
 {
@@ -436,11 +1502,24 @@ ossl_call_servername_cb(VALUE arg)
         return Qnil;
 
     VALUE ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    VALUE ret_obj = ossl_sslctx_servername_lookup(SSL_get_SSL_CTX(ssl), servername);
+    if (!NIL_P(ret_obj)) {
+        /* Already set up by SSLContext#servername_contexts= */
+        SSL_CTX *ctx2;
+        GetSSLCTX(ret_obj, ctx2);
+        if (!SSL_set_SSL_CTX(ssl, ctx2))
+            ossl_raise(eSSLError, "SSL_set_SSL_CTX");
+        rb_ivar_set(ssl_obj, id_i_context, ret_obj);
+        return Qnil;
+    }
+
     VALUE sslctx_obj = rb_attr_get(ssl_obj, id_i_context);
     VALUE cb = rb_attr_get(sslctx_obj, id_i_servername_cb);
+    if (NIL_P(cb))
+        return Qnil;
     VALUE ary = rb_assoc_new(ssl_obj, rb_str_new_cstr(servername));
 
-    VALUE ret_obj = rb_funcallv(cb, id_call, 1, &ary);
+    ret_obj = rb_funcallv(cb, id_call, 1, &ary);
     if (rb_obj_is_kind_of(ret_obj, cSSLContext)) {
         SSL_CTX *ctx2;
         ossl_sslctx_setup(ret_obj);
@@ -456,67 +1535,507 @@ ossl_call_servername_cb(VALUE arg)
     return Qnil;
 }
 
-static int
-ssl_servername_cb(SSL *ssl, int *ad, void *arg)
+static void *
+ssl_servername_cb_i(void *ptr)
 {
+    SSL *ssl = ptr;
     int state;
 
     rb_protect(ossl_call_servername_cb, (VALUE)ssl, &state);
     if (state) {
         VALUE ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
         rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        return (void *)SSL_TLSEXT_ERR_ALERT_FATAL;
     }
 
-    return SSL_TLSEXT_ERR_OK;
+    return (void *)SSL_TLSEXT_ERR_OK;
 }
 
-static void
-ssl_renegotiation_cb(const SSL *ssl)
+static int
+ssl_servername_cb(SSL *ssl, int *ad, void *arg)
 {
-    VALUE ssl_obj, sslctx_obj, cb;
+    return (int)(VALUE)ossl_ssl_with_gvl(ssl_servername_cb_i, ssl);
+}
 
-    ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
-    sslctx_obj = rb_attr_get(ssl_obj, id_i_context);
-    cb = rb_attr_get(sslctx_obj, id_i_renegotiation_cb);
-    if (NIL_P(cb)) return;
+/*
+ * Copies the host name to buf in lowercase, for use as the key of the
+ * certificate cache and in a file name. Returns 0 if it contains a character
+ * other than alphanumerics, '-', '_' and '.', or is empty or too long.
+ */
+static int
+cert_cache_key(const char *servername, char *buf, size_t size)
+{
+    size_t i;
+
+    if (servername[0] == '\0' || servername[0] == '.')
+        return 0;
+    for (i = 0; servername[i]; i++) {
+        char c = servername[i];
 
-    rb_funcallv(cb, id_call, 1, &ssl_obj);
+        if (i + 1 >= size)
+            return 0;
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        else if (!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9') &&
+                 c != '-' && c != '_' && c != '.')
+            return 0;
+        if (c == '.' && buf[i - 1] == '.')
+            return 0;
+        buf[i] = c;
+    }
+    buf[i] = '\0';
+
+    return 1;
 }
 
-static VALUE
-ssl_npn_encode_protocol_i(RB_BLOCK_CALL_FUNC_ARGLIST(cur, encoded))
+static void
+cert_lru_unlink(struct ossl_sslctx_data *data, struct ossl_cert_entry *entry)
 {
-    int len = RSTRING_LENINT(cur);
-    char len_byte;
-    if (len < 1 || len > 255)
-        ossl_raise(eSSLError, "Advertised protocol must have length 1..255");
-    /* Encode the length byte */
-    len_byte = len;
-    rb_str_buf_cat(encoded, &len_byte, 1);
-    rb_str_buf_cat(encoded, RSTRING_PTR(cur), len);
-    return Qnil;
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        data->cert_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        data->cert_tail = entry->prev;
+    entry->prev = entry->next = NULL;
 }
 
-static VALUE
-ssl_encode_npn_protocols(VALUE protocols)
+static void
+cert_lru_push(struct ossl_sslctx_data *data, struct ossl_cert_entry *entry)
 {
-    VALUE encoded = rb_str_new(NULL, 0);
-    rb_block_call(protocols, id_each, 0, 0, ssl_npn_encode_protocol_i, encoded);
-    return encoded;
+    entry->next = data->cert_head;
+    if (data->cert_head)
+        data->cert_head->prev = entry;
+    else
+        data->cert_tail = entry;
+    data->cert_head = entry;
 }
 
-struct npn_select_cb_common_args {
-    VALUE cb;
-    const unsigned char *in;
-    unsigned inlen;
+/* Must be called with data->lock held */
+static int
+cert_entry_use(SSL *ssl, struct ossl_cert_entry *entry)
+{
+    if (!entry->cert)
+        return 1;
+    /* Drop the default certificates, which may be of another key type */
+    SSL_certs_clear(ssl);
+    return SSL_use_certificate(ssl, entry->cert) &&
+        SSL_use_PrivateKey(ssl, entry->pkey) &&
+        SSL_set1_chain(ssl, entry->chain);
+}
+
+struct cert_load_args {
+    SSL *ssl;
+    const char *name;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    STACK_OF(X509) *chain;
 };
 
-static VALUE
-npn_select_cb_common_i(VALUE tmp)
+/*
+ * Reads a certificate, its chain and its private key from the PEM blocks in
+ * bio, in any order.
+ */
+static void
+cert_load_bio(struct cert_load_args *args, BIO *bio)
 {
-    struct npn_select_cb_common_args *args = (void *)tmp;
-    const unsigned char *in = args->in, *in_end = in + args->inlen;
+    X509 *x509;
+
+    args->cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    if (!args->cert)
+        ossl_raise(eSSLError, "PEM_read_bio_X509_AUX");
+    args->chain = sk_X509_new_null();
+    if (!args->chain)
+        ossl_raise(eSSLError, "sk_X509_new_null");
+    while ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL))) {
+        if (!sk_X509_push(args->chain, x509)) {
+            X509_free(x509);
+            ossl_raise(eSSLError, "sk_X509_push");
+        }
+    }
+    ossl_clear_error();
+    if (BIO_reset(bio) < 0)
+        ossl_raise(eSSLError, "BIO_reset");
+    /* An encrypted key fails to decrypt with an empty passphrase */
+    args->pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, (void *)"");
+    if (!args->pkey)
+        ossl_raise(eSSLError, "PEM_read_bio_PrivateKey");
+}
+
+static VALUE
+cert_load_bio_i(VALUE ptr)
+{
+    VALUE *argv = (VALUE *)ptr;
+
+    cert_load_bio((struct cert_load_args *)argv[0], (BIO *)argv[1]);
+    return Qnil;
+}
+
+static void
+cert_load_bio_free(struct cert_load_args *args, BIO *bio)
+{
+    VALUE argv[2] = { (VALUE)args, (VALUE)bio };
+    int state;
+
+    rb_protect(cert_load_bio_i, (VALUE)argv, &state);
+    BIO_free(bio);
+    if (state)
+        rb_jump_tag(state);
+}
+
+static VALUE
+ossl_call_cert_loader(VALUE ptr)
+{
+    struct cert_load_args *args = (struct cert_load_args *)ptr;
+    VALUE ssl_obj = (VALUE)SSL_get_ex_data(args->ssl, ossl_ssl_ex_ptr_idx);
+    VALUE sslctx_obj = rb_attr_get(ssl_obj, id_i_context);
+    VALUE loader = rb_attr_get(sslctx_obj, id_i_cert_loader);
+    VALUE name = rb_str_new_cstr(args->name), ret;
+    BIO *bio;
+
+    if (RB_TYPE_P(loader, T_STRING)) {
+        VALUE path = rb_str_format(1, &name, loader);
+
+        bio = BIO_new_file(StringValueCStr(path), "rb");
+        if (!bio) {
+            /* No certificate for the host name */
+            ossl_clear_error();
+            return Qnil;
+        }
+        cert_load_bio_free(args, bio);
+    }
+    else {
+        ret = rb_funcallv(loader, id_call, 1, &name);
+        if (NIL_P(ret))
+            return Qnil;
+        if (RB_TYPE_P(ret, T_STRING)) {
+            bio = ossl_obj2bio(&ret);
+            cert_load_bio_free(args, bio);
+        }
+        else {
+            VALUE cert, key, chain;
+
+            Check_Type(ret, T_ARRAY);
+            cert = rb_ary_entry(ret, 0);
+            key = rb_ary_entry(ret, 1);
+            chain = rb_ary_entry(ret, 2);
+            args->cert = X509_dup(GetX509CertPtr(cert));
+            if (!args->cert)
+                ossl_raise(eSSLError, "X509_dup");
+            args->pkey = GetPrivPKeyPtr(key);
+            EVP_PKEY_up_ref(args->pkey);
+            args->chain = NIL_P(chain) ? sk_X509_new_null() :
+                ossl_x509_ary2sk(chain);
+            if (!args->chain)
+                ossl_raise(eSSLError, "sk_X509_new_null");
+        }
+    }
+    if (!X509_check_private_key(args->cert, args->pkey))
+        ossl_raise(eSSLError, "X509_check_private_key");
+
+    return Qnil;
+}
+
+static void *
+ossl_sslctx_cert_load_i(void *ptr)
+{
+    struct cert_load_args *args = ptr;
+    struct ossl_sslctx_data *data = GetSSLCTXData(SSL_get_SSL_CTX(args->ssl));
+    struct ossl_cert_entry *entry, *old;
+    st_data_t val;
+    int state, ret;
+
+    rb_protect(ossl_call_cert_loader, (VALUE)args, &state);
+    if (state) {
+        VALUE ssl_obj = (VALUE)SSL_get_ex_data(args->ssl, ossl_ssl_ex_ptr_idx);
+
+        X509_free(args->cert);
+        EVP_PKEY_free(args->pkey);
+        sk_X509_pop_free(args->chain, X509_free);
+        rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
+        return (void *)0;
+    }
+
+    entry = ZALLOC(struct ossl_cert_entry);
+    entry->name = ALLOC_N(char, strlen(args->name) + 1);
+    strcpy(entry->name, args->name);
+    entry->cert = args->cert;
+    entry->pkey = args->pkey;
+    entry->chain = args->chain;
+
+    rb_nativethread_lock_lock(&data->lock);
+    /* Another thread may have loaded it while the loader was running */
+    if (st_lookup(data->cert_table, (st_data_t)args->name, &val)) {
+        cert_entry_free(entry);
+        entry = (struct ossl_cert_entry *)val;
+        cert_lru_unlink(data, entry);
+    }
+    else {
+        st_insert(data->cert_table, (st_data_t)entry->name, (st_data_t)entry);
+        data->num_certs++;
+        while (data->num_certs > data->max_certs) {
+            st_data_t key;
+
+            old = data->cert_tail;
+            cert_lru_unlink(data, old);
+            key = (st_data_t)old->name;
+            st_delete(data->cert_table, &key, NULL);
+            cert_entry_free(old);
+            data->num_certs--;
+            data->cert_evictions++;
+        }
+    }
+    cert_lru_push(data, entry);
+    ret = cert_entry_use(args->ssl, entry);
+    rb_nativethread_lock_unlock(&data->lock);
+
+    return (void *)(VALUE)ret;
+}
+
+/*
+ * The certificate callback for SSLContext#cert_loader. Certificates found in
+ * the cache are used without calling into Ruby, the loader is only called on
+ * a cache miss.
+ */
+static int
+ossl_sslctx_cert_cb(SSL *ssl, void *arg)
+{
+    const char *servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    struct ossl_sslctx_data *data;
+    struct cert_load_args args = { ssl };
+    char name[256];
+    st_data_t val;
+    int ret;
+
+    if (!SSL_is_server(ssl) || !servername ||
+        !cert_cache_key(servername, name, sizeof(name)))
+        return 1;
+
+    data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
+    rb_nativethread_lock_lock(&data->lock);
+    if (st_lookup(data->cert_table, (st_data_t)name, &val)) {
+        struct ossl_cert_entry *entry = (struct ossl_cert_entry *)val;
+
+        cert_lru_unlink(data, entry);
+        cert_lru_push(data, entry);
+        data->cert_hits++;
+        ret = cert_entry_use(ssl, entry);
+        rb_nativethread_lock_unlock(&data->lock);
+        return ret;
+    }
+    data->cert_misses++;
+    rb_nativethread_lock_unlock(&data->lock);
+
+    args.name = name;
+    return (int)(VALUE)ossl_ssl_with_gvl(ossl_sslctx_cert_load_i, &args);
+}
+
+#if !defined(OPENSSL_NO_OCSP)
+/*
+ * The status_request callback installed by SSLContext#set_ocsp_response.
+ * Staples a copy of the cached response for the certificate in use, without
+ * calling into Ruby.
+ */
+static int
+ossl_sslctx_status_cb(SSL *ssl, void *arg)
+{
+    struct ossl_sslctx_data *data;
+    X509 *cert = SSL_get_certificate(ssl);
+    unsigned char *buf = NULL;
+    long i, len = 0;
+
+    if (!SSL_is_server(ssl))
+        return 1;
+    if (!cert)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
+    rb_nativethread_lock_lock(&data->lock);
+    for (i = 0; i < data->num_ocsp_staples; i++) {
+        struct ossl_ocsp_staple *staple = &data->ocsp_staples[i];
+
+        if (X509_cmp(staple->cert, cert))
+            continue;
+        /* An expired response would make the client fail the handshake */
+        if (staple->next_update && X509_cmp_time(staple->next_update, NULL) <= 0)
+            break;
+        buf = OPENSSL_malloc(staple->len);
+        if (buf) {
+            memcpy(buf, staple->der, staple->len);
+            len = staple->len;
+        }
+        break;
+    }
+    rb_nativethread_lock_unlock(&data->lock);
+
+    if (!buf)
+        return SSL_TLSEXT_ERR_NOACK;
+    /* OpenSSL takes the ownership of buf */
+    SSL_set_tlsext_status_ocsp_resp(ssl, buf, len);
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+/*
+ * Builds the session for a TLS 1.3 external PSK. As with "openssl s_server
+ * -psk", the PSK is associated with SHA-256 (RFC 8446 section 4.2.11), so
+ * it is only used if the cipher suite chosen by the server uses SHA-256.
+ */
+static SSL_SESSION *
+psk_session_new(SSL *ssl, const struct ossl_psk_entry *entry)
+{
+    static const unsigned char tls13_aes128gcmsha256_id[] = { 0x13, 0x01 };
+    const SSL_CIPHER *cipher = SSL_get_pending_cipher(ssl);
+    const EVP_MD *md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : NULL;
+    SSL_SESSION *sess;
+
+    if (!md || EVP_MD_type(md) != NID_sha256)
+        cipher = SSL_CIPHER_find(ssl, tls13_aes128gcmsha256_id);
+
+    if (!cipher)
+        return NULL;
+    sess = SSL_SESSION_new();
+    if (!sess)
+        return NULL;
+    if (!SSL_SESSION_set1_master_key(sess, entry->key, entry->key_len) ||
+        !SSL_SESSION_set_cipher(sess, cipher) ||
+        !SSL_SESSION_set_protocol_version(sess, TLS1_3_VERSION)) {
+        SSL_SESSION_free(sess);
+        return NULL;
+    }
+    return sess;
+}
+
+/*
+ * Looks up the PSK identity sent by the client in SSLContext#psk_keys=,
+ * without calling into Ruby. An unknown identity falls back to a
+ * certificate-based handshake.
+ */
+static int
+ossl_sslctx_psk_find_session_cb(SSL *ssl, const unsigned char *identity,
+                                size_t identity_len, SSL_SESSION **sess)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(GetSSLData(ssl)->session_ctx);
+    struct ossl_psk_entry key = { identity, identity_len };
+    st_data_t found;
+    int ret = 1;
+
+    *sess = NULL;
+    rb_nativethread_lock_lock(&data->lock);
+    if (data->psk_table &&
+        st_lookup(data->psk_table, (st_data_t)&key, &found)) {
+        *sess = psk_session_new(ssl, (struct ossl_psk_entry *)found);
+        ret = *sess != NULL;
+    }
+    rb_nativethread_lock_unlock(&data->lock);
+
+    return ret;
+}
+
+/* Offers SSLContext#psk_identity with the key from SSLContext#psk_keys= */
+static int
+ossl_sslctx_psk_use_session_cb(SSL *ssl, const EVP_MD *md,
+                               const unsigned char **id, size_t *idlen,
+                               SSL_SESSION **sess)
+{
+    struct ossl_sslctx_data *data = GetSSLCTXData(GetSSLData(ssl)->session_ctx);
+    struct ossl_psk_entry key;
+    st_data_t found;
+    int ret = 1;
+
+    *sess = NULL;
+    /* After HelloRetryRequest, the PSK must match the chosen hash */
+    if (!data->psk_identity || (md && EVP_MD_type(md) != NID_sha256))
+        return 1;
+    key.identity = data->psk_identity;
+    key.identity_len = data->psk_identity_len;
+    rb_nativethread_lock_lock(&data->lock);
+    if (data->psk_table &&
+        st_lookup(data->psk_table, (st_data_t)&key, &found)) {
+        *sess = psk_session_new(ssl, (struct ossl_psk_entry *)found);
+        ret = *sess != NULL;
+    }
+    rb_nativethread_lock_unlock(&data->lock);
+    /* Owned by the SSL_CTX, which outlives the SSL */
+    *id = data->psk_identity;
+    *idlen = data->psk_identity_len;
+
+    return ret;
+}
+#endif
+
+static VALUE
+ossl_call_renegotiation_cb(VALUE ssl_obj)
+{
+    VALUE sslctx_obj, cb;
+
+    sslctx_obj = rb_attr_get(ssl_obj, id_i_context);
+    cb = rb_attr_get(sslctx_obj, id_i_renegotiation_cb);
+    if (NIL_P(cb)) return Qnil;
+
+    return rb_funcallv(cb, id_call, 1, &ssl_obj);
+}
+
+static void *
+ssl_renegotiation_cb_i(void *ptr)
+{
+    const SSL *ssl = ptr;
+    VALUE ssl_obj;
+    int state;
+
+    ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+    rb_protect(ossl_call_renegotiation_cb, ssl_obj, &state);
+    if (state)
+        rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(state));
+
+    return NULL;
+}
+
+static void
+ssl_renegotiation_cb(const SSL *ssl)
+{
+    if (!GetSSLCTXData(SSL_get_SSL_CTX(ssl))->renegotiation_cb)
+        return;
+
+    ossl_ssl_with_gvl(ssl_renegotiation_cb_i, (void *)ssl);
+}
+
+static VALUE
+ssl_npn_encode_protocol_i(RB_BLOCK_CALL_FUNC_ARGLIST(cur, encoded))
+{
+    int len = RSTRING_LENINT(cur);
+    char len_byte;
+    if (len < 1 || len > 255)
+        ossl_raise(eSSLError, "Advertised protocol must have length 1..255");
+    /* Encode the length byte */
+    len_byte = len;
+    rb_str_buf_cat(encoded, &len_byte, 1);
+    rb_str_buf_cat(encoded, RSTRING_PTR(cur), len);
+    return Qnil;
+}
+
+static VALUE
+ssl_encode_npn_protocols(VALUE protocols)
+{
+    VALUE encoded = rb_str_new(NULL, 0);
+    rb_block_call(protocols, id_each, 0, 0, ssl_npn_encode_protocol_i, encoded);
+    return encoded;
+}
+
+struct npn_select_cb_common_args {
+    VALUE cb;
+    const unsigned char *in;
+    unsigned inlen;
+};
+
+static VALUE
+npn_select_cb_common_i(VALUE tmp)
+{
+    struct npn_select_cb_common_args *args = (void *)tmp;
+    const unsigned char *in = args->in, *in_end = in + args->inlen;
     unsigned char l;
     long len;
     VALUE selected, protocols = rb_ary_new();
@@ -539,39 +2058,70 @@ npn_select_cb_common_i(VALUE tmp)
     return selected;
 }
 
-static int
-ssl_npn_select_cb_common(SSL *ssl, VALUE cb, const unsigned char **out,
-                         unsigned char *outlen, const unsigned char *in,
-                         unsigned int inlen)
+struct ssl_npn_select_cb_common_args {
+    SSL *ssl;
+    VALUE sslctx_obj;
+    ID cb_id;
+    const unsigned char **out;
+    unsigned char *outlen;
+    const unsigned char *in;
+    unsigned int inlen;
+};
+
+static void *
+ssl_npn_select_cb_common_i(void *ptr)
 {
+    struct ssl_npn_select_cb_common_args *cargs = ptr;
+    struct ossl_ssl_data *data;
     VALUE selected;
     int status;
     struct npn_select_cb_common_args args;
 
-    args.cb = cb;
-    args.in = in;
-    args.inlen = inlen;
+    args.cb = rb_attr_get(cargs->sslctx_obj, cargs->cb_id);
+    args.in = cargs->in;
+    args.inlen = cargs->inlen;
 
     selected = rb_protect(npn_select_cb_common_i, (VALUE)&args, &status);
     if (status) {
-        VALUE ssl_obj = (VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx);
+        VALUE ssl_obj = (VALUE)SSL_get_ex_data(cargs->ssl, ossl_ssl_ex_ptr_idx);
 
         rb_ivar_set(ssl_obj, ID_callback_state, INT2NUM(status));
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        return (void *)SSL_TLSEXT_ERR_ALERT_FATAL;
     }
 
-    *out = (unsigned char *)RSTRING_PTR(selected);
-    *outlen = (unsigned char)RSTRING_LEN(selected);
+    /* OpenSSL copies it after the GVL is released */
+    data = GetSSLData(cargs->ssl);
+    memcpy(data->selected_protocol, RSTRING_PTR(selected), RSTRING_LEN(selected));
+    *cargs->out = data->selected_protocol;
+    *cargs->outlen = (unsigned char)RSTRING_LEN(selected);
 
-    return SSL_TLSEXT_ERR_OK;
+    return (void *)SSL_TLSEXT_ERR_OK;
+}
+
+static int
+ssl_npn_select_cb_common(SSL *ssl, VALUE sslctx_obj, ID cb_id,
+                         const unsigned char **out, unsigned char *outlen,
+                         const unsigned char *in, unsigned int inlen)
+{
+    struct ssl_npn_select_cb_common_args args = {
+        ssl, sslctx_obj, cb_id, out, outlen, in, inlen
+    };
+
+    return (int)(VALUE)ossl_ssl_with_gvl(ssl_npn_select_cb_common_i, &args);
 }
 
 #ifdef OSSL_USE_NEXTPROTONEG
+static void *
+ssl_npn_advertise_cb_i(void *arg)
+{
+    return (void *)rb_attr_get((VALUE)arg, id_npn_protocols_encoded);
+}
+
 static int
 ssl_npn_advertise_cb(SSL *ssl, const unsigned char **out, unsigned int *outlen,
                      void *arg)
 {
-    VALUE protocols = rb_attr_get((VALUE)arg, id_npn_protocols_encoded);
+    VALUE protocols = (VALUE)ossl_ssl_with_gvl(ssl_npn_advertise_cb_i, arg);
 
     *out = (const unsigned char *) RSTRING_PTR(protocols);
     *outlen = RSTRING_LENINT(protocols);
@@ -583,13 +2133,9 @@ static int
 ssl_npn_select_cb(SSL *ssl, unsigned char **out, unsigned char *outlen,
                   const unsigned char *in, unsigned int inlen, void *arg)
 {
-    VALUE sslctx_obj, cb;
-
-    sslctx_obj = (VALUE) arg;
-    cb = rb_attr_get(sslctx_obj, id_i_npn_select_cb);
-
-    return ssl_npn_select_cb_common(ssl, cb, (const unsigned char **)out,
-                                    outlen, in, inlen);
+    return ssl_npn_select_cb_common(ssl, (VALUE)arg, id_i_npn_select_cb,
+                                    (const unsigned char **)out, outlen,
+                                    in, inlen);
 }
 #endif
 
@@ -597,12 +2143,183 @@ static int
 ssl_alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
                    const unsigned char *in, unsigned int inlen, void *arg)
 {
-    VALUE sslctx_obj, cb;
+    struct ossl_sslctx_data *data = GetSSLCTXData(SSL_get_SSL_CTX(ssl));
+
+    if (data->alpn_preference) {
+        if (SSL_select_next_proto((unsigned char **)out, outlen,
+                                  data->alpn_preference,
+                                  data->alpn_preference_len,
+                                  in, inlen) == OPENSSL_NPN_NEGOTIATED)
+            return SSL_TLSEXT_ERR_OK;
+        /* RFC 7301 requires the no_application_protocol alert */
+        if (!data->alpn_select_cb)
+            return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
 
-    sslctx_obj = (VALUE) arg;
-    cb = rb_attr_get(sslctx_obj, id_i_alpn_select_cb);
+    return ssl_npn_select_cb_common(ssl, (VALUE)arg, id_i_alpn_select_cb,
+                                    out, outlen, in, inlen);
+}
+
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+static const struct {
+    const char *name;
+    int alg;
+} ossl_cert_comp_algs[] = {
+    { "zlib", TLSEXT_comp_cert_zlib },
+    { "brotli", TLSEXT_comp_cert_brotli },
+    { "zstd", TLSEXT_comp_cert_zstd },
+};
+
+static int
+parse_cert_comp_alg(VALUE name)
+{
+    int i;
+
+    if (SYMBOL_P(name))
+        name = rb_sym2str(name);
+    StringValue(name);
+    for (i = 0; i < numberof(ossl_cert_comp_algs); i++)
+        if (!strcmp(ossl_cert_comp_algs[i].name, StringValueCStr(name)))
+            return ossl_cert_comp_algs[i].alg;
+    rb_raise(rb_eArgError, "unknown certificate compression algorithm %+"PRIsVALUE, name);
+}
+
+static VALUE
+cert_comp_alg_name(int alg)
+{
+    int i;
+
+    for (i = 0; i < numberof(ossl_cert_comp_algs); i++)
+        if (ossl_cert_comp_algs[i].alg == alg)
+            return rb_str_new_cstr(ossl_cert_comp_algs[i].name);
+    return Qnil;
+}
+#endif
+
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+static const struct {
+    const char *name;
+    unsigned char type;
+} ossl_cert_types[] = {
+    { "x509", TLSEXT_cert_type_x509 },
+    { "rpk", TLSEXT_cert_type_rpk },
+};
+
+/* Converts an Array of certificate type names into the wire format */
+static void
+parse_cert_types(VALUE ary, unsigned char *types, size_t *len)
+{
+    long i;
+    int j;
+
+    Check_Type(ary, T_ARRAY);
+    if (RARRAY_LEN(ary) < 1 || RARRAY_LEN(ary) > (long)numberof(ossl_cert_types))
+        rb_raise(rb_eArgError, "certificate types must be 1 to %d types",
+                 (int)numberof(ossl_cert_types));
+    for (i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE name = RARRAY_AREF(ary, i);
+
+        if (SYMBOL_P(name))
+            name = rb_sym2str(name);
+        StringValue(name);
+        for (j = 0; j < (int)numberof(ossl_cert_types); j++)
+            if (!strcmp(ossl_cert_types[j].name, StringValueCStr(name)))
+                break;
+        if (j == (int)numberof(ossl_cert_types))
+            rb_raise(rb_eArgError, "unknown certificate type %+"PRIsVALUE, name);
+        types[i] = ossl_cert_types[j].type;
+    }
+    *len = (size_t)i;
+}
+
+static VALUE
+cert_type_name(int type)
+{
+    int i;
+
+    for (i = 0; i < (int)numberof(ossl_cert_types); i++)
+        if (ossl_cert_types[i].type == type)
+            return rb_str_new_cstr(ossl_cert_types[i].name);
+    return Qnil;
+}
+#endif
+
+static void
+ssl_handshake_done(const SSL *ssl)
+{
+    struct ossl_ssl_data *ssl_data = GetSSLData(ssl);
+
+    struct ossl_sslctx_data *data = GetSSLCTXData(ssl_data->session_ctx);
+    int resumed;
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    int compressed;
+#endif
+
+    /* TLS 1.3 post-handshake messages are reported as handshakes too */
+    if (ssl_data->handshake_done)
+        return;
+    ssl_data_write_begin(ssl_data);
+    ssl_data->handshake_done = 1;
+    ssl_data->handshake_time = ossl_clock_ns() - ssl_data->handshake_start;
+    ssl_data_write_end(ssl_data);
+    resumed = SSL_session_reused((SSL *)ssl);
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    compressed =
+        SSL_get_negotiated_server_cert_comp((SSL *)ssl) != TLSEXT_comp_cert_none ||
+        SSL_get_negotiated_client_cert_comp((SSL *)ssl) != TLSEXT_comp_cert_none;
+#endif
+
+    rb_nativethread_lock_lock(&data->lock);
+    data->handshakes++;
+    if (resumed)
+        data->resumed++;
+    data->handshake_time += ssl_data->handshake_time;
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    if (compressed)
+        data->cert_comp_handshakes++;
+#endif
+    rb_nativethread_lock_unlock(&data->lock);
+
+    /* All secrets of the handshake have been logged by now */
+    ssl_keylog_flush(ssl);
+}
 
-    return ssl_npn_select_cb_common(ssl, cb, out, outlen, in, inlen);
+/*
+ * Counts the records for SSLSocket#stats, and records the protocol messages
+ * for SSLSocket#handshake_trace.
+ */
+static void
+ssl_msg_cb(int write_p, int version, int content_type, const void *buf,
+           size_t len, SSL *ssl, void *arg)
+{
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+    struct ossl_trace *trace;
+    struct ossl_trace_entry *entry;
+
+    switch (content_type) {
+      case SSL3_RT_HEADER:
+        ssl_data_write_begin(data);
+        if (write_p)
+            data->stats.records_written++;
+        else
+            data->stats.records_read++;
+        ssl_data_write_end(data);
+        return;
+      case SSL3_RT_HANDSHAKE:
+      case SSL3_RT_CHANGE_CIPHER_SPEC:
+      case SSL3_RT_ALERT:
+        ssl_data_write_begin(data);
+        if ((trace = RUBY_ATOMIC_PTR_LOAD(data->trace))) {
+            entry = &trace->entries[trace->count++ % trace->size];
+            entry->time = ossl_clock_ns();
+            entry->len = (uint32_t)len;
+            entry->write_p = write_p ? 1 : 0;
+            entry->content_type = (unsigned char)content_type;
+            entry->msg_type = len ? ((const unsigned char *)buf)[0] : 0;
+        }
+        ssl_data_write_end(data);
+        return;
+    }
 }
 
 /* This function may serve as the entry point to support further callbacks. */
@@ -611,9 +2328,21 @@ ssl_info_cb(const SSL *ssl, int where, int val)
 {
     int is_server = SSL_is_server((SSL *)ssl);
 
+    if (where & SSL_CB_HANDSHAKE_START) {
+        struct ossl_ssl_data *data = GetSSLData(ssl);
+
+        if (!data->handshake_start) {
+            ssl_data_write_begin(data);
+            data->handshake_start = ossl_clock_ns();
+            ssl_data_write_end(data);
+        }
+    }
     if (is_server && where & SSL_CB_HANDSHAKE_START) {
         ssl_renegotiation_cb(ssl);
     }
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+        ssl_handshake_done(ssl);
+    }
 }
 
 /*
@@ -679,6 +2408,7 @@ static VALUE
 ossl_sslctx_setup(VALUE self)
 {
     SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
     X509 *cert = NULL, *client_ca = NULL;
     EVP_PKEY *key = NULL;
     char *ca_path = NULL, *ca_file = NULL;
@@ -688,6 +2418,7 @@ ossl_sslctx_setup(VALUE self)
 
     if(OBJ_FROZEN(self)) return Qnil;
     GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
 
 #if !defined(OPENSSL_NO_DH)
     if (!NIL_P(rb_attr_get(self, id_i_tmp_dh_callback))) {
@@ -731,8 +2462,48 @@ ossl_sslctx_setup(VALUE self)
         }
     }
 
-    val = rb_attr_get(self, id_i_client_ca);
-    if(!NIL_P(val)){
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    val = rb_attr_get(self, id_i_server_cert_type);
+    if (!NIL_P(val)) {
+        unsigned char types[numberof(ossl_cert_types)];
+        size_t len;
+
+        parse_cert_types(val, types, &len);
+        if (!SSL_CTX_set1_server_cert_type(ctx, types, len))
+            ossl_raise(eSSLError, "SSL_CTX_set1_server_cert_type");
+        /* A raw public key needs no certificate */
+        if (key && !cert && !SSL_CTX_use_PrivateKey(ctx, key))
+            ossl_raise(eSSLError, "SSL_CTX_use_PrivateKey");
+    }
+    val = rb_attr_get(self, id_i_client_cert_type);
+    if (!NIL_P(val)) {
+        unsigned char types[numberof(ossl_cert_types)];
+        size_t len;
+
+        parse_cert_types(val, types, &len);
+        if (!SSL_CTX_set1_client_cert_type(ctx, types, len))
+            ossl_raise(eSSLError, "SSL_CTX_set1_client_cert_type");
+        if (key && !cert && !SSL_CTX_use_PrivateKey(ctx, key))
+            ossl_raise(eSSLError, "SSL_CTX_use_PrivateKey");
+    }
+    val = rb_attr_get(self, id_i_expected_rpks);
+    if (!NIL_P(val) && !data->expected_rpks) {
+        Check_Type(val, T_ARRAY);
+        /* The pins are checked with DANE-EE SPKI records on each SSL */
+        if (SSL_CTX_dane_enable(ctx) <= 0)
+            ossl_raise(eSSLError, "SSL_CTX_dane_enable");
+        data->expected_rpks = ALLOC_N(EVP_PKEY *, RARRAY_LEN(val));
+        for (i = 0; i < RARRAY_LEN(val); i++) {
+            EVP_PKEY *pkey = GetPKeyPtr(RARRAY_AREF(val, i));
+
+            EVP_PKEY_up_ref(pkey);
+            data->expected_rpks[data->num_expected_rpks++] = pkey;
+        }
+    }
+#endif
+
+    val = rb_attr_get(self, id_i_client_ca);
+    if(!NIL_P(val)){
         if (RB_TYPE_P(val, T_ARRAY)) {
             for(i = 0; i < RARRAY_LEN(val); i++){
                 client_ca = GetX509CertPtr(RARRAY_AREF(val, i));
@@ -770,9 +2541,34 @@ ossl_sslctx_setup(VALUE self)
     val = rb_attr_get(self, id_i_verify_mode);
     verify_mode = NIL_P(val) ? SSL_VERIFY_NONE : NUM2INT(val);
     SSL_CTX_set_verify(ctx, verify_mode, ossl_ssl_verify_callback);
+    data->verify_callback = !NIL_P(rb_attr_get(self, id_i_verify_callback));
+    val = rb_attr_get(self, id_i_verify_hostname);
+    data->verify_hostname_native = val == sym_native;
+    data->verify_hostname = RTEST(val) && !data->verify_hostname_native;
+    data->renegotiation_cb = !NIL_P(rb_attr_get(self, id_i_renegotiation_cb));
     if (RTEST(rb_attr_get(self, id_i_client_cert_cb)))
         SSL_CTX_set_client_cert_cb(ctx, ossl_client_cert_cb);
 
+    val = rb_attr_get(self, id_i_cert_loader);
+    if (!NIL_P(val)) {
+        if (RB_TYPE_P(val, T_STRING)) {
+            const char *p = strchr(RSTRING_PTR(val), '%');
+
+            if (!p || p[1] != 's' || strchr(p + 2, '%'))
+                rb_raise(rb_eArgError, "cert_loader must contain exactly one %%s");
+        }
+        else if (!rb_respond_to(val, id_call)) {
+            rb_raise(rb_eTypeError, "cert_loader must be a String or respond to #call");
+        }
+        val = rb_attr_get(self, id_i_cert_cache_size);
+        data->max_certs = NIL_P(val) ? 1024 : NUM2LONG(val);
+        if (data->max_certs < 1)
+            rb_raise(rb_eArgError, "cert_cache_size must be positive");
+        if (!data->cert_table)
+            data->cert_table = st_init_strtable();
+        SSL_CTX_set_cert_cb(ctx, ossl_sslctx_cert_cb, NULL);
+    }
+
     val = rb_attr_get(self, id_i_timeout);
     if(!NIL_P(val)) SSL_CTX_set_timeout(ctx, NUM2LONG(val));
 
@@ -803,11 +2599,122 @@ ossl_sslctx_setup(VALUE self)
             ossl_raise(eSSLError, "SSL_CTX_set_alpn_protos");
         OSSL_Debug("SSL ALPN values added");
     }
-    if (RTEST(rb_attr_get(self, id_i_alpn_select_cb))) {
+    data->alpn_select_cb = RTEST(rb_attr_get(self, id_i_alpn_select_cb));
+    val = rb_attr_get(self, id_i_alpn_preference);
+    if (!NIL_P(val) && !data->alpn_preference) {
+        VALUE encoded = ssl_encode_npn_protocols(val);
+
+        if (!RSTRING_LEN(encoded))
+            rb_raise(rb_eArgError, "alpn_preference must not be empty");
+        data->alpn_preference = ALLOC_N(unsigned char, RSTRING_LEN(encoded));
+        memcpy(data->alpn_preference, RSTRING_PTR(encoded), RSTRING_LEN(encoded));
+        data->alpn_preference_len = RSTRING_LENINT(encoded);
+    }
+    if (data->alpn_select_cb || data->alpn_preference) {
         SSL_CTX_set_alpn_select_cb(ctx, ssl_alpn_select_cb, (void *) self);
         OSSL_Debug("SSL ALPN select callback added");
     }
 
+    val = rb_attr_get(self, id_i_max_send_fragment);
+    if (!NIL_P(val)) {
+        if (!SSL_CTX_set_max_send_fragment(ctx, NUM2UINT(val)))
+            ossl_raise(eSSLError, "SSL_CTX_set_max_send_fragment");
+        data->max_send_fragment = NUM2UINT(val);
+    }
+#ifdef HAVE_SSL_CTX_SET_SPLIT_SEND_FRAGMENT
+    val = rb_attr_get(self, id_i_split_send_fragment);
+    if (!NIL_P(val)) {
+        if (!SSL_CTX_set_split_send_fragment(ctx, NUM2UINT(val)))
+            ossl_raise(eSSLError, "SSL_CTX_set_split_send_fragment");
+        data->split_send_fragment = NUM2UINT(val);
+    }
+#endif
+#ifdef HAVE_SSL_CTX_SET_MAX_PIPELINES
+    val = rb_attr_get(self, id_i_max_pipelines);
+    if (!NIL_P(val) && !SSL_CTX_set_max_pipelines(ctx, NUM2UINT(val)))
+        ossl_raise(eSSLError, "SSL_CTX_set_max_pipelines");
+#endif
+#ifdef HAVE_SSL_CTX_SET_DEFAULT_READ_BUFFER_LEN
+    val = rb_attr_get(self, id_i_read_buffer_len);
+    if (!NIL_P(val))
+        SSL_CTX_set_default_read_buffer_len(ctx, NUM2SIZET(val));
+#endif
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    val = rb_attr_get(self, id_i_psk_identity);
+    if (!NIL_P(val) && !data->psk_identity) {
+        StringValue(val);
+        data->psk_identity = ALLOC_N(unsigned char, RSTRING_LEN(val));
+        memcpy(data->psk_identity, RSTRING_PTR(val), RSTRING_LEN(val));
+        data->psk_identity_len = RSTRING_LEN(val);
+    }
+#endif
+
+    val = rb_attr_get(self, id_i_dynamic_record_sizing);
+    if (val == Qtrue)
+        data->dyn_record_threshold = OSSL_DYN_RECORD_DEFAULT_THRESHOLD;
+    else if (RTEST(val)) {
+        data->dyn_record_threshold = NUM2ULONG(val);
+        if (!data->dyn_record_threshold)
+            rb_raise(rb_eArgError, "dynamic_record_sizing must be positive");
+    }
+
+#if !OSSL_IS_LIBRESSL
+    /* Opened before freezing so that a bad path can be corrected */
+    val = rb_attr_get(self, id_i_keylog_file);
+    if (!NIL_P(val) && !data->keylog_buf)
+        keylog_open(data, val);
+#endif
+
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    val = rb_attr_get(self, id_i_cert_compression);
+    if (!NIL_P(val)) {
+        int algs[numberof(ossl_cert_comp_algs)];
+
+        Check_Type(val, T_ARRAY);
+        if (RARRAY_LEN(val) > numberof(algs))
+            rb_raise(rb_eArgError, "too many certificate compression algorithms");
+        for (i = 0; i < RARRAY_LEN(val); i++)
+            algs[i] = parse_cert_comp_alg(RARRAY_AREF(val, i));
+        if (i == 0)
+            SSL_CTX_set_options(ctx, SSL_OP_NO_TX_CERTIFICATE_COMPRESSION |
+                                SSL_OP_NO_RX_CERTIFICATE_COMPRESSION);
+        else if (!SSL_CTX_set1_cert_comp_preference(ctx, algs, (size_t)i))
+            ossl_raise(eSSLError, "SSL_CTX_set1_cert_comp_preference");
+    }
+    /*
+     * Compress the certificate chain once now rather than in every handshake.
+     * This fails if no algorithm is available, in which case there is nothing
+     * to compress anyway.
+     */
+    if (SSL_CTX_get0_certificate(ctx) &&
+        !(SSL_CTX_get_options(ctx) & SSL_OP_NO_TX_CERTIFICATE_COMPRESSION) &&
+        !SSL_CTX_compress_certs(ctx, 0))
+        ossl_clear_error();
+#endif
+
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+    val = rb_attr_get(self, id_i_shared_session_cache);
+    if (!NIL_P(val) && !data->session_cache) {
+        if (RTEST(rb_attr_get(self, id_i_session_get_cb)) ||
+            RTEST(rb_attr_get(self, id_i_session_new_cb)) ||
+            RTEST(rb_attr_get(self, id_i_session_remove_cb)) ||
+            RTEST(rb_attr_get(self, id_i_client_session_cache)))
+            rb_raise(rb_eArgError, "shared_session_cache cannot be used " \
+                     "together with session_{get,new,remove}_cb or " \
+                     "client_session_cache");
+        data->session_cache = ossl_scache_ref(val);
+        /*
+         * Sessions in the internal cache would be removed from the shared
+         * cache when this SSL_CTX is freed, so only use the shared cache.
+         */
+        SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_get_cb(ctx, ossl_sslctx_scache_get_cb);
+        SSL_CTX_sess_set_new_cb(ctx, ossl_sslctx_scache_new_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, ossl_sslctx_scache_remove_cb);
+    }
+#endif
+
     rb_obj_freeze(self);
 
     val = rb_attr_get(self, id_i_session_id_context);
@@ -831,20 +2738,38 @@ ossl_sslctx_setup(VALUE self)
         SSL_CTX_sess_set_remove_cb(ctx, ossl_sslctx_session_remove_cb);
         OSSL_Debug("SSL SESSION remove callback added");
     }
+    if (RTEST(rb_attr_get(self, id_i_client_session_cache))) {
+        /*
+         * SSLSocket#session_new_cb stores the session in the cache. The
+         * internal cache of the SSL_CTX is never looked up by a client.
+         */
+        SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) |
+                                       SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, ossl_sslctx_session_new_cb);
+    }
 
     val = rb_attr_get(self, id_i_servername_cb);
-    if (!NIL_P(val)) {
+    if (!NIL_P(val) || GetSSLCTXData(ctx)->servername_table) {
         SSL_CTX_set_tlsext_servername_callback(ctx, ssl_servername_cb);
         OSSL_Debug("SSL TLSEXT servername callback added");
     }
 
+#ifdef HAVE_SSL_READ_EARLY_DATA
+    if (RTEST(rb_attr_get(self, id_i_allow_early_data_cb))) {
+        SSL_CTX_set_allow_early_data_cb(ctx, ossl_allow_early_data_cb, NULL);
+        OSSL_Debug("SSL allow early data callback added");
+    }
+#endif
+
 #if !OSSL_IS_LIBRESSL
     /*
      * It is only compatible with OpenSSL >= 1.1.1. Even if LibreSSL implements
      * SSL_CTX_set_keylog_callback() from v3.4.2, it does nothing (see
      * https://github.com/libressl-portable/openbsd/commit/648d39f0f035835d0653342d139883b9661e9cb6).
      */
-    if (RTEST(rb_attr_get(self, id_i_keylog_cb))) {
+    data->keylog_cb = RTEST(rb_attr_get(self, id_i_keylog_cb));
+    if (data->keylog_cb || data->keylog_buf) {
         SSL_CTX_set_keylog_callback(ctx, ossl_sslctx_keylog_cb);
         OSSL_Debug("SSL keylog callback added");
     }
@@ -1268,6 +3193,51 @@ ossl_sslctx_set_security_level(VALUE self, VALUE value)
     return value;
 }
 
+#ifdef HAVE_SSL_READ_EARLY_DATA
+/*
+ * call-seq:
+ *    ctx.max_early_data -> integer
+ *
+ * Returns the maximum number of bytes of TLS 1.3 early data a server accepts,
+ * or 0 if early data is not accepted. See #max_early_data=.
+ */
+static VALUE
+ossl_sslctx_get_max_early_data(VALUE self)
+{
+    SSL_CTX *ctx;
+
+    GetSSLCTX(self, ctx);
+
+    return UINT2NUM(SSL_CTX_get_max_early_data(ctx));
+}
+
+/*
+ * call-seq:
+ *    ctx.max_early_data = integer
+ *
+ * Sets the maximum number of bytes of TLS 1.3 early data (0-RTT data) a server
+ * accepts. The default is 0, which disables early data. Sessions issued by the
+ * server carry this limit, see Session#max_early_data.
+ *
+ * Early data can be replayed by an attacker. Unless OP_NO_ANTI_REPLAY is set,
+ * OpenSSL only accepts it for sessions found in the session cache and removes
+ * them on use. #allow_early_data_cb can apply further restrictions.
+ */
+static VALUE
+ossl_sslctx_set_max_early_data(VALUE self, VALUE value)
+{
+    SSL_CTX *ctx;
+
+    rb_check_frozen(self);
+    GetSSLCTX(self, ctx);
+
+    if (!SSL_CTX_set_max_early_data(ctx, NUM2UINT(value)))
+        ossl_raise(eSSLError, "SSL_CTX_set_max_early_data");
+
+    return value;
+}
+#endif
+
 #ifdef SSL_MODE_SEND_FALLBACK_SCSV
 /*
  * call-seq:
@@ -1522,461 +3492,2261 @@ ossl_sslctx_get_session_cache_stats(VALUE self)
     return hash;
 }
 
-
 /*
- *  call-seq:
- *     ctx.flush_sessions(time) -> self
+ * call-seq:
+ *    ctx.session_ticket_keys = [key, ...] or nil
  *
- * Removes sessions in the internal cache that have expired at _time_.
+ * Sets the ring of keys used to encrypt and decrypt stateless session
+ * tickets, instead of the random keys OpenSSL generates for each SSL_CTX.
+ * Processes sharing the same keys can resume sessions established by one
+ * another.
+ *
+ * Each key is a 48 or 80 bytes String made of a 16 bytes key name, followed
+ * by an HMAC-SHA256 key and an AES-CBC key, of 16 bytes each for a 48 bytes
+ * key (AES-128) or 32 bytes each for an 80 bytes key (AES-256). This is the
+ * same format as the session ticket key files of nginx.
+ *
+ * The first key is used to issue new tickets. The others are only used to
+ * decrypt tickets issued earlier; a client presenting such a ticket receives
+ * a new one made with the first key. An empty Array disables session tickets
+ * and +nil+ restores OpenSSL's own keys.
+ *
+ * Unlike most other attributes, this may be called after the context is in
+ * use, to rotate the keys. The ring is replaced atomically.
  */
 static VALUE
-ossl_sslctx_flush_sessions(int argc, VALUE *argv, VALUE self)
+ossl_sslctx_set_session_ticket_keys(VALUE self, VALUE ary)
 {
-    VALUE arg1;
     SSL_CTX *ctx;
-    time_t tm = 0;
-
-    rb_scan_args(argc, argv, "01", &arg1);
+    struct ossl_sslctx_data *data;
+    struct ossl_ticket_key *keys = NULL, *old_keys;
+    long i, num = 0, old_num;
+    VALUE strs;
 
     GetSSLCTX(self, ctx);
+    if (!NIL_P(ary)) {
+        Check_Type(ary, T_ARRAY);
+        strs = rb_ary_new_capa(RARRAY_LEN(ary));
+        for (i = 0; i < RARRAY_LEN(ary); i++) {
+            VALUE str = RARRAY_AREF(ary, i);
+            StringValue(str);
+            if (RSTRING_LEN(str) != 48 && RSTRING_LEN(str) != 80)
+                rb_raise(rb_eArgError, "session ticket key must be 48 or 80 bytes");
+            rb_ary_push(strs, str);
+        }
+        num = RARRAY_LEN(strs);
+        keys = ALLOC_N(struct ossl_ticket_key, num ? num : 1);
+        for (i = 0; i < num; i++) {
+            const unsigned char *p = (unsigned char *)RSTRING_PTR(RARRAY_AREF(strs, i));
+            int size = (int)(RSTRING_LEN(RARRAY_AREF(strs, i)) - 16) / 2;
+
+            memcpy(keys[i].name, p, 16);
+            memcpy(keys[i].hmac_key, p + 16, size);
+            memcpy(keys[i].aes_key, p + 16 + size, size);
+            keys[i].size = size;
+        }
+    }
 
-    if (NIL_P(arg1)) {
-        tm = time(0);
-    } else if (rb_obj_is_instance_of(arg1, rb_cTime)) {
-        tm = NUM2LONG(rb_funcall(arg1, rb_intern("to_i"), 0));
-    } else {
-        ossl_raise(rb_eArgError, "arg must be Time or nil");
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    old_keys = data->ticket_keys;
+    old_num = data->num_ticket_keys;
+    data->ticket_keys = keys;
+    data->num_ticket_keys = num;
+    rb_nativethread_lock_unlock(&data->lock);
+    if (old_keys) {
+        OPENSSL_cleanse(old_keys, sizeof(*old_keys) * old_num);
+        ruby_xfree(old_keys);
     }
 
-    SSL_CTX_flush_sessions(ctx, (long)tm);
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, keys ? ossl_sslctx_ticket_key_cb : NULL);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, keys ? ossl_sslctx_ticket_key_cb : NULL);
+#endif
 
-    return self;
+    return ary;
 }
 
-/*
- * SSLSocket class
- */
-static inline int
-ssl_started(SSL *ssl)
+static int
+servername_contexts_check_i(VALUE key, VALUE value, VALUE hash)
 {
-    /* BIO is created through ossl_ssl_setup(), called by #connect or #accept */
-    return SSL_get_rbio(ssl) != NULL;
+    const char *p;
+
+    StringValueCStr(key);
+    p = RSTRING_PTR(key);
+    if (!RSTRING_LEN(key) || strchr(p[0] == '*' ? p + 1 : p, '*') ||
+        (p[0] == '*' && (p[1] != '.' || !p[2])))
+        rb_raise(rb_eArgError, "invalid host name pattern: %"PRIsVALUE,
+                 rb_inspect(key));
+    if (!rb_obj_is_kind_of(value, cSSLContext))
+        rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE
+                 " (expected OpenSSL::SSL::SSLContext)", rb_obj_class(value));
+    ossl_sslctx_setup(value);
+    rb_hash_aset(hash, key, value);
+
+    return ST_CONTINUE;
 }
 
-static void
-ossl_ssl_mark(void *ptr)
+static int
+servername_contexts_insert_i(VALUE key, VALUE value, VALUE arg)
 {
-    SSL *ssl = ptr;
-    rb_gc_mark((VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx));
-}
+    st_table *table = (st_table *)arg;
 
-static void
-ossl_ssl_free(void *ssl)
-{
-    SSL_free(ssl);
-}
+    st_insert(table, (st_data_t)RSTRING_PTR(key), (st_data_t)value);
 
-const rb_data_type_t ossl_ssl_type = {
-    "OpenSSL/SSL",
-    {
-        ossl_ssl_mark, ossl_ssl_free,
-    },
-    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
-};
+    return ST_CONTINUE;
+}
 
+/*
+ * call-seq:
+ *    ctx.servername_contexts = { hostname => context, ... } or nil
+ *
+ * Sets a map from host names to SSLContext objects to switch to when a
+ * client sends the server_name extension (SNI). A key may start with "*." to
+ * match any single leftmost label, such as "*.example.com" for
+ * "www.example.com" but not "example.com". An exact match is preferred, and
+ * host names are compared case-insensitively.
+ *
+ * The lookup is done without calling into Ruby. #servername_cb, if set, is
+ * only called for host names that are not in the map.
+ *
+ * The contexts in the map are set up and frozen. Unlike most other
+ * attributes, this may be called after the context is in use; the new map
+ * applies to the handshakes started afterwards.
+ */
 static VALUE
-ossl_ssl_s_alloc(VALUE klass)
+ossl_sslctx_set_servername_contexts(VALUE self, VALUE map)
 {
-    return TypedData_Wrap_Struct(klass, &ossl_ssl_type, NULL);
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    st_table *table = NULL, *old_table;
+    VALUE hash = Qnil;
+
+    GetSSLCTX(self, ctx);
+    if (!NIL_P(map)) {
+        Check_Type(map, T_HASH);
+        hash = rb_hash_new();
+        rb_hash_foreach(map, servername_contexts_check_i, hash);
+        rb_obj_freeze(hash);
+        /* The keys are the frozen Strings owned by hash */
+        table = st_init_strcasetable_with_size(RHASH_SIZE(hash));
+        rb_hash_foreach(hash, servername_contexts_insert_i, (VALUE)table);
+    }
+
+    data = GetSSLCTXData(ctx);
+    old_table = data->servername_table;
+    data->servername_table = table;
+    RB_OBJ_WRITE(self, &data->servername_contexts, hash);
+    if (old_table)
+        st_free_table(old_table);
+    if (table)
+        SSL_CTX_set_tlsext_servername_callback(ctx, ssl_servername_cb);
+
+    return map;
 }
 
+/*
+ * call-seq:
+ *    ctx.servername_contexts -> hash or nil
+ *
+ * Returns the map set by #servername_contexts=, as a frozen Hash.
+ */
 static VALUE
-peer_ip_address(VALUE io)
+ossl_sslctx_get_servername_contexts(VALUE self)
 {
-    VALUE remote_address = rb_funcall(io, rb_intern("remote_address"), 0);
+    SSL_CTX *ctx;
 
-    return rb_funcall(remote_address, rb_intern("inspect_sockaddr"), 0);
+    GetSSLCTX(self, ctx);
+    return GetSSLCTXData(ctx)->servername_contexts;
 }
 
-static VALUE
-fallback_peer_ip_address(VALUE self, VALUE exc)
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+static int
+psk_keys_insert_i(VALUE identity, VALUE key, VALUE arg)
 {
-    return rb_str_new_cstr("(null)");
+    st_table *table = (st_table *)arg;
+    struct ossl_psk_entry *entry;
+
+    StringValue(identity);
+    StringValue(key);
+    if (!RSTRING_LEN(identity))
+        rb_raise(rb_eArgError, "PSK identity must not be empty");
+    if (!RSTRING_LEN(key) || RSTRING_LEN(key) > SSL_MAX_MASTER_KEY_LENGTH)
+        rb_raise(rb_eArgError, "PSK must be 1 to %d bytes",
+                 SSL_MAX_MASTER_KEY_LENGTH);
+    entry = ruby_xmalloc(sizeof(*entry) + RSTRING_LEN(identity) + RSTRING_LEN(key));
+    entry->key = (unsigned char *)(entry + 1);
+    entry->key_len = RSTRING_LEN(key);
+    memcpy(entry->key, RSTRING_PTR(key), entry->key_len);
+    entry->identity = entry->key + entry->key_len;
+    entry->identity_len = RSTRING_LEN(identity);
+    memcpy((unsigned char *)entry->identity, RSTRING_PTR(identity),
+           entry->identity_len);
+    if (st_insert(table, (st_data_t)entry, (st_data_t)entry)) {
+        /* The same identity given twice; keep the later one */
+        st_data_t old = (st_data_t)entry;
+
+        st_delete(table, &old, NULL);
+        psk_entry_free_i(old, 0, 0);
+        st_insert(table, (st_data_t)entry, (st_data_t)entry);
+    }
+
+    return ST_CONTINUE;
 }
 
 static VALUE
-peeraddr_ip_str(VALUE io)
+psk_keys_build_i(VALUE arg)
 {
-    return rb_rescue2(peer_ip_address, io, fallback_peer_ip_address, Qnil,
-                      rb_eSystemCallError, (VALUE)0);
+    VALUE *args = (VALUE *)arg;
+
+    rb_hash_foreach(args[0], psk_keys_insert_i, args[1]);
+    return Qnil;
 }
 
 /*
  * call-seq:
- *    SSLSocket.new(io) => aSSLSocket
- *    SSLSocket.new(io, ctx) => aSSLSocket
- *    SSLSocket.new(io, ctx, sync_close:) => aSSLSocket
+ *    ctx.psk_keys = { identity => key, ... } or nil
  *
- * Creates a new SSL socket from _io_ which must be a real IO object (not an
- * IO-like object that responds to read/write).
+ * Sets the TLS 1.3 external pre-shared keys (PSK), a map from identities
+ * to keys of up to 48 bytes, both binary Strings. The keys are associated
+ * with SHA-256, so the negotiated cipher suite must use it too: list
+ * TLS_AES_128_GCM_SHA256 or TLS_CHACHA20_POLY1305_SHA256 first in
+ * #ciphersuites of the client, or of the server together with
+ * OP_CIPHER_SERVER_PREFERENCE.
  *
- * If _ctx_ is provided the SSL Sockets initial params will be taken from
- * the context.
+ * A server resumes a session from the key of the identity offered by the
+ * client, so that no certificate is sent or verified. A client offers
+ * #psk_identity. Unknown identities fall back to a certificate-based
+ * handshake. The lookups are done without calling into Ruby.
  *
- * The optional _sync_close_ keyword parameter sets the _sync_close_ instance
- * variable. Setting this to +true+ will cause the underlying socket to be
- * closed when the SSL/TLS connection is shut down.
+ * The handshake still uses (EC)DHE for forward secrecy. To skip it as well,
+ * set OP_ALLOW_NO_DHE_KEX on both peers and OP_PREFER_NO_DHE_KEX (OpenSSL
+ * 3.3 or later) on the server.
  *
- * The OpenSSL::Buffering module provides additional IO methods.
+ * Unlike most other attributes, this may be called after the context is in
+ * use, to rotate the keys; the new keys apply to the handshakes started
+ * afterwards.
  *
- * This method will freeze the SSLContext if one is provided;
- * however, session management is still allowed in the frozen SSLContext.
+ * === Example
+ *
+ *   ctx.psk_keys = { "service-a" => key }
+ *   ctx.psk_identity = "service-a" # on the client
  */
 static VALUE
-ossl_ssl_initialize(int argc, VALUE *argv, VALUE self)
+ossl_sslctx_set_psk_keys(VALUE self, VALUE keys)
 {
-    static ID kw_ids[1];
-    VALUE kw_args[1];
-    VALUE opts;
-
-    VALUE io, v_ctx;
-    SSL *ssl;
     SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    st_table *table = NULL, *old_table;
 
-    TypedData_Get_Struct(self, SSL, &ossl_ssl_type, ssl);
-    if (ssl)
-        ossl_raise(eSSLError, "SSL already initialized");
-
-    if (rb_scan_args(argc, argv, "11:", &io, &v_ctx, &opts) == 1)
-        v_ctx = rb_funcall(cSSLContext, rb_intern("new"), 0);
-
-    if (!kw_ids[0]) {
-        kw_ids[0] = rb_intern_const("sync_close");
+    GetSSLCTX(self, ctx);
+    if (!NIL_P(keys)) {
+        VALUE args[2];
+        int state;
+
+        Check_Type(keys, T_HASH);
+        table = st_init_table_with_size(&psk_entry_hash_type, RHASH_SIZE(keys));
+        args[0] = keys;
+        args[1] = (VALUE)table;
+        rb_protect(psk_keys_build_i, (VALUE)args, &state);
+        if (state) {
+            psk_table_free(table);
+            rb_jump_tag(state);
+        }
     }
 
-    rb_get_kwargs(opts, kw_ids, 0, 1, kw_args);
-    if (kw_args[0] != Qundef) {
-        rb_ivar_set(self, id_i_sync_close, kw_args[0]);
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    old_table = data->psk_table;
+    data->psk_table = table;
+    rb_nativethread_lock_unlock(&data->lock);
+    if (old_table)
+        psk_table_free(old_table);
+    if (table) {
+        SSL_CTX_set_psk_find_session_callback(ctx, ossl_sslctx_psk_find_session_cb);
+        SSL_CTX_set_psk_use_session_callback(ctx, ossl_sslctx_psk_use_session_cb);
     }
 
-    GetSSLCTX(v_ctx, ctx);
-    rb_ivar_set(self, id_i_context, v_ctx);
-    ossl_sslctx_setup(v_ctx);
-
-    if (rb_respond_to(io, rb_intern("nonblock=")))
-        rb_funcall(io, rb_intern("nonblock="), 1, Qtrue);
-    Check_Type(io, T_FILE);
-    rb_ivar_set(self, id_i_io, io);
-
-    ssl = SSL_new(ctx);
-    if (!ssl)
-        ossl_raise(eSSLError, NULL);
-    RTYPEDDATA_DATA(self) = ssl;
+    return keys;
+}
+#endif
 
-    if (!SSL_set_ex_data(ssl, ossl_ssl_ex_ptr_idx, (void *)self))
-        ossl_raise(eSSLError, "SSL_set_ex_data");
-    SSL_set_info_callback(ssl, ssl_info_cb);
+/*
+ * call-seq:
+ *    ctx.session_ticket_key_stats -> hash
+ *
+ * Returns the number of session tickets processed with the keys set by
+ * #session_ticket_keys=, as a Hash with the following keys:
+ *
+ * :encrypt:: Number of session tickets issued
+ * :decrypt:: Number of session tickets decrypted with a known key
+ * :renew:: Number of session tickets decrypted with a previous key, for
+ *          which a new ticket was issued
+ */
+static VALUE
+ossl_sslctx_get_session_ticket_key_stats(VALUE self)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    unsigned long encrypt, decrypt, renew;
+    VALUE hash;
 
-    rb_call_super(0, NULL);
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    encrypt = data->ticket_encrypt;
+    decrypt = data->ticket_decrypt;
+    renew = data->ticket_renew;
+    rb_nativethread_lock_unlock(&data->lock);
 
-    return self;
-}
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("encrypt")), ULONG2NUM(encrypt));
+    rb_hash_aset(hash, ID2SYM(rb_intern("decrypt")), ULONG2NUM(decrypt));
+    rb_hash_aset(hash, ID2SYM(rb_intern("renew")), ULONG2NUM(renew));
 
-#ifndef HAVE_RB_IO_DESCRIPTOR
-static int
-io_descriptor_fallback(VALUE io)
-{
-    rb_io_t *fptr;
-    GetOpenFile(io, fptr);
-    return fptr->fd;
+    return hash;
 }
-#define rb_io_descriptor io_descriptor_fallback
-#endif
 
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+/*
+ * call-seq:
+ *    ctx.cert_compression_stats -> hash
+ *
+ * Returns the number of handshakes completed by connections created from the
+ * context, as a Hash with the following keys:
+ *
+ * :handshakes:: Number of completed handshakes
+ * :compressed:: Number of handshakes in which a certificate chain was sent
+ *               compressed, in either direction
+ */
 static VALUE
-ossl_ssl_setup(VALUE self)
+ossl_sslctx_get_cert_compression_stats(VALUE self)
 {
-    VALUE io;
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    unsigned long handshakes, compressed;
+    VALUE hash;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    handshakes = data->handshakes;
+    compressed = data->cert_comp_handshakes;
+    rb_nativethread_lock_unlock(&data->lock);
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("handshakes")), ULONG2NUM(handshakes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("compressed")), ULONG2NUM(compressed));
+
+    return hash;
+}
+#endif
+
+static void
+ssl_stats_to_hash(VALUE hash, const struct ossl_ssl_stats *stats)
+{
+#define SET(name) \
+    rb_hash_aset(hash, ID2SYM(rb_intern(#name)), ULL2NUM(stats->name))
+    SET(bytes_read);
+    SET(bytes_written);
+    SET(raw_bytes_read);
+    SET(raw_bytes_written);
+    SET(records_read);
+    SET(records_written);
+    SET(wait_readable);
+    SET(wait_writable);
+#undef SET
+}
+
+/*
+ * call-seq:
+ *    ctx.stats -> hash
+ *
+ * Returns the statistics of the connections created from the context, as a
+ * Hash with the following keys:
+ *
+ * :connections:: Number of SSLSocket and SSLEngine objects created
+ * :handshakes:: Number of completed handshakes
+ * :resumed:: Number of completed handshakes that resumed a session
+ * :handshake_time:: Total duration of the completed handshakes in seconds
+ *
+ * as well as the sums of the counters in SSLSocket#stats, from :bytes_read
+ * to :wait_writable. The counters of a connection are added when it is
+ * closed with SSLSocket#sysclose, or garbage collected.
+ */
+static VALUE
+ossl_sslctx_get_stats(VALUE self)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    unsigned long connections, handshakes, resumed;
+    uint64_t handshake_time;
+    struct ossl_ssl_stats stats;
+    VALUE hash;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    connections = data->connections;
+    handshakes = data->handshakes;
+    resumed = data->resumed;
+    handshake_time = data->handshake_time;
+    stats = data->stats;
+    rb_nativethread_lock_unlock(&data->lock);
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("connections")), ULONG2NUM(connections));
+    rb_hash_aset(hash, ID2SYM(rb_intern("handshakes")), ULONG2NUM(handshakes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("resumed")), ULONG2NUM(resumed));
+    rb_hash_aset(hash, ID2SYM(rb_intern("handshake_time")),
+                 DBL2NUM(handshake_time / 1e9));
+    ssl_stats_to_hash(hash, &stats);
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *    ctx.cert_cache_stats -> hash
+ *
+ * Returns the statistics of the certificate cache used by #cert_loader, as a
+ * Hash with the following keys:
+ *
+ * :hits:: Number of handshakes that found the host name in the cache
+ * :misses:: Number of handshakes that called the loader
+ * :evictions:: Number of entries removed to make room for new ones
+ * :size:: Number of host names in the cache
+ */
+static VALUE
+ossl_sslctx_get_cert_cache_stats(VALUE self)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    unsigned long hits, misses, evictions;
+    long size;
+    VALUE hash;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    rb_nativethread_lock_lock(&data->lock);
+    hits = data->cert_hits;
+    misses = data->cert_misses;
+    evictions = data->cert_evictions;
+    size = data->num_certs;
+    rb_nativethread_lock_unlock(&data->lock);
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULONG2NUM(evictions));
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")), LONG2NUM(size));
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *    ctx.flush_cert_cache -> self
+ *
+ * Removes all certificates from the cache used by #cert_loader, so that they
+ * are loaded again, for example after they are renewed.
+ */
+static VALUE
+ossl_sslctx_flush_cert_cache(VALUE self)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    struct ossl_cert_entry *entry;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    if (!data->cert_table)
+        return self;
+    rb_nativethread_lock_lock(&data->lock);
+    entry = data->cert_head;
+    data->cert_head = data->cert_tail = NULL;
+    data->num_certs = 0;
+    st_clear(data->cert_table);
+    rb_nativethread_lock_unlock(&data->lock);
+    while (entry) {
+        struct ossl_cert_entry *next = entry->next;
+        cert_entry_free(entry);
+        entry = next;
+    }
+
+    return self;
+}
+
+#if !defined(OPENSSL_NO_OCSP)
+/*
+ * call-seq:
+ *    ctx.set_ocsp_response(cert, response) -> time or nil
+ *
+ * Sets the OCSP response to staple when _cert_ is used as the server
+ * certificate, if the client requests the certificate status. _response_ is
+ * an OpenSSL::OCSP::Response or its DER encoding, or +nil+ to stop stapling
+ * for _cert_.
+ *
+ * Returns the nextUpdate of the response as a Time, or +nil+ if it has none.
+ * The response is no longer stapled after this time; set a new one before.
+ *
+ * The response is cached in DER encoding and stapled without calling into
+ * Ruby. Unlike most other attributes, this may be called after the context
+ * is in use, to refresh the response.
+ *
+ *   res = OpenSSL::OCSP::Response.new(http_response_body)
+ *   next_update = ctx.set_ocsp_response(cert, res)
+ */
+static VALUE
+ossl_sslctx_set_ocsp_response(VALUE self, VALUE cert_obj, VALUE response)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    struct ossl_ocsp_staple staple = { 0 }, old = { 0 };
+    struct ossl_ocsp_staple *staples, *old_staples;
+    X509 *cert;
+    long i, num;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    cert = GetX509CertPtr(cert_obj);
+    if (!NIL_P(response)) {
+        VALUE der = ossl_to_der_if_possible(response);
+        const unsigned char *p;
+        OCSP_RESPONSE *res;
+        OCSP_BASICRESP *basic;
+        OCSP_SINGLERESP *single;
+        ASN1_GENERALIZEDTIME *next_update = NULL;
+        int status;
+
+        StringValue(der);
+        p = (unsigned char *)RSTRING_PTR(der);
+        res = d2i_OCSP_RESPONSE(NULL, &p, RSTRING_LEN(der));
+        if (!res)
+            ossl_raise(eSSLError, "d2i_OCSP_RESPONSE");
+        status = OCSP_response_status(res);
+        basic = status == OCSP_RESPONSE_STATUS_SUCCESSFUL ?
+            OCSP_response_get1_basic(res) : NULL;
+        OCSP_RESPONSE_free(res);
+        if (!basic) {
+            ossl_clear_error();
+            rb_raise(rb_eArgError, "OCSP response is not successful");
+        }
+        single = OCSP_resp_get0(basic, 0);
+        if (single)
+            OCSP_single_get0_status(single, NULL, NULL, NULL, &next_update);
+        if (next_update) {
+            staple.next_update = (ASN1_GENERALIZEDTIME *)ASN1_STRING_dup(next_update);
+            if (!staple.next_update) {
+                OCSP_BASICRESP_free(basic);
+                ossl_raise(eSSLError, "ASN1_STRING_dup");
+            }
+        }
+        OCSP_BASICRESP_free(basic);
+
+        staple.len = RSTRING_LEN(der);
+        staple.der = ALLOC_N(unsigned char, staple.len);
+        memcpy(staple.der, RSTRING_PTR(der), staple.len);
+        X509_up_ref(cert);
+        staple.cert = cert;
+    }
+
+    /* Only modified with the GVL held */
+    num = data->num_ocsp_staples;
+    for (i = 0; i < num; i++)
+        if (!X509_cmp(data->ocsp_staples[i].cert, cert))
+            break;
+    staples = ALLOC_N(struct ossl_ocsp_staple, num + 1);
+    MEMCPY(staples, data->ocsp_staples, struct ossl_ocsp_staple, num);
+    if (i < num) {
+        old = staples[i];
+        if (staple.cert)
+            staples[i] = staple;
+        else
+            staples[i] = staples[--num];
+    }
+    else if (staple.cert) {
+        staples[num++] = staple;
+    }
+
+    rb_nativethread_lock_lock(&data->lock);
+    old_staples = data->ocsp_staples;
+    data->ocsp_staples = staples;
+    data->num_ocsp_staples = num;
+    rb_nativethread_lock_unlock(&data->lock);
+    ruby_xfree(old_staples);
+    if (old.cert)
+        ocsp_staple_free(&old);
+
+    SSL_CTX_set_tlsext_status_cb(ctx, ossl_sslctx_status_cb);
+
+    return staple.next_update ? asn1time_to_time(staple.next_update) : Qnil;
+}
+
+/*
+ * call-seq:
+ *    ctx.ocsp_response_next_update(cert) -> time or nil
+ *
+ * Returns the nextUpdate of the OCSP response set for _cert_ by
+ * #set_ocsp_response, or +nil+ if there is none or it has no nextUpdate.
+ */
+static VALUE
+ossl_sslctx_get_ocsp_response_next_update(VALUE self, VALUE cert_obj)
+{
+    SSL_CTX *ctx;
+    struct ossl_sslctx_data *data;
+    X509 *cert;
+    long i;
+
+    GetSSLCTX(self, ctx);
+    data = GetSSLCTXData(ctx);
+    cert = GetX509CertPtr(cert_obj);
+    for (i = 0; i < data->num_ocsp_staples; i++) {
+        struct ossl_ocsp_staple *staple = &data->ocsp_staples[i];
+
+        if (!X509_cmp(staple->cert, cert))
+            return staple->next_update ? asn1time_to_time(staple->next_update) : Qnil;
+    }
+
+    return Qnil;
+}
+#endif
+
+/*
+ *  call-seq:
+ *     ctx.flush_sessions(time) -> self
+ *
+ * Removes sessions in the internal cache that have expired at _time_.
+ */
+static VALUE
+ossl_sslctx_flush_sessions(int argc, VALUE *argv, VALUE self)
+{
+    VALUE arg1;
+    SSL_CTX *ctx;
+    time_t tm = 0;
+
+    rb_scan_args(argc, argv, "01", &arg1);
+
+    GetSSLCTX(self, ctx);
+
+    if (NIL_P(arg1)) {
+        tm = time(0);
+    } else if (rb_obj_is_instance_of(arg1, rb_cTime)) {
+        tm = NUM2LONG(rb_funcall(arg1, rb_intern("to_i"), 0));
+    } else {
+        ossl_raise(rb_eArgError, "arg must be Time or nil");
+    }
+
+    SSL_CTX_flush_sessions(ctx, (long)tm);
+
+    return self;
+}
+
+#ifdef HAVE_OPENSSL_LH_DOALL_ARG
+/*
+ * The format used by SSLContext#export_sessions: the magic, followed by one
+ * record per session consisting of the expiry time in seconds since the Epoch
+ * as a 64-bit big-endian integer, the length of the DER encoding as a 32-bit
+ * big-endian integer, and the DER encoding itself.
+ */
+#define OSSL_SESSIONS_MAGIC "RBOSSLS1"
+#define OSSL_SESSIONS_MAGIC_LEN 8
+#define OSSL_SESSIONS_HEADER_LEN 12
+
+struct sessions_export_args {
+    SSL_CTX *ctx;
+    SSL_SESSION **sessions;
+    size_t num, capa;
+    int exporting;
+};
+
+static void
+sessions_export_i(void *data, void *ptr)
+{
+    SSL_SESSION *sess = data;
+    struct sessions_export_args *args = ptr;
+
+    if (args->num == args->capa || !SSL_SESSION_is_resumable(sess))
+        return;
+    SSL_SESSION_up_ref(sess);
+    args->sessions[args->num++] = sess;
+}
+
+#ifdef OSSL_SSL_NOGVL
+struct sessions_export_wait_args {
+    struct sessions_export_args *args;
+    struct ossl_sslctx_data *data;
+    int interrupted;
+};
+
+/*
+ * Starts the export, see sessions_call_enter(), and waits for the running
+ * calls to finish. Returns when interrupted; args->exporting tells whether the
+ * export has been started.
+ */
+static void *
+sessions_export_wait(void *ptr)
+{
+    struct sessions_export_wait_args *wait = ptr;
+    struct ossl_sslctx_data *data = wait->data;
+
+    rb_nativethread_lock_lock(&data->lock);
+    if (!wait->args->exporting) {
+        while ((data->exporting_sessions || data->waiting_calls) &&
+               !wait->interrupted)
+            rb_native_cond_wait(&data->sessions_cond, &data->lock);
+        if (!wait->interrupted) {
+            data->exporting_sessions = 1;
+            wait->args->exporting = 1;
+        }
+    }
+    while (data->nogvl_calls && !wait->interrupted)
+        rb_native_cond_wait(&data->sessions_cond, &data->lock);
+    rb_nativethread_lock_unlock(&data->lock);
+    return NULL;
+}
+
+static void
+sessions_export_wait_ubf(void *ptr)
+{
+    struct sessions_export_wait_args *wait = ptr;
+
+    wait->interrupted = 1;
+    sessions_call_wakeup(wait->data);
+}
+#endif
+
+/*
+ * OpenSSL modifies the internal session cache under a lock of its own, which
+ * cannot be taken from outside. Stop new SSL_* calls without the GVL, wait for
+ * the running ones to finish, and then walk the cache holding the GVL.
+ */
+static VALUE
+sessions_export_collect(VALUE ptr)
+{
+    struct sessions_export_args *args = (struct sessions_export_args *)ptr;
+    OPENSSL_LHASH *lh;
+#ifdef OSSL_SSL_NOGVL
+    struct sessions_export_wait_args wait = { args, GetSSLCTXData(args->ctx) };
+
+    do {
+        wait.interrupted = 0;
+        rb_thread_call_without_gvl(sessions_export_wait, &wait,
+                                   sessions_export_wait_ubf, &wait);
+        rb_thread_check_ints();
+    } while (wait.interrupted);
+#endif
+
+    lh = (OPENSSL_LHASH *)SSL_CTX_sessions(args->ctx);
+    args->capa = lh ? OPENSSL_LH_num_items(lh) : 0;
+    if (args->capa) {
+        args->sessions = ALLOC_N(SSL_SESSION *, args->capa);
+        OPENSSL_LH_doall_arg(lh, sessions_export_i, args);
+    }
+    return Qnil;
+}
+
+static VALUE
+sessions_export_collect_ensure(VALUE ptr)
+{
+#ifdef OSSL_SSL_NOGVL
+    struct sessions_export_args *args = (struct sessions_export_args *)ptr;
+    struct ossl_sslctx_data *data = GetSSLCTXData(args->ctx);
+
+    if (!args->exporting)
+        return Qnil;
+    rb_nativethread_lock_lock(&data->lock);
+    data->exporting_sessions = 0;
+    rb_native_cond_broadcast(&data->sessions_cond);
+    rb_nativethread_lock_unlock(&data->lock);
+#endif
+    return Qnil;
+}
+
+static void
+sessions_put_be(unsigned char *p, uint64_t v, int len)
+{
+    while (len-- > 0) {
+        p[len] = (unsigned char)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t
+sessions_get_be(const unsigned char *p, int len)
+{
+    uint64_t v = 0;
+
+    while (len-- > 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+/*
+ *  call-seq:
+ *     ctx.export_sessions -> string
+ *
+ * Serializes the sessions in the internal session cache into a binary string,
+ * which #import_sessions can load into another SSLContext, for example after
+ * the server process has been restarted. Expired sessions are not included.
+ *
+ *   File.binwrite("sessions.bin", ctx.export_sessions)
+ *
+ * Only sessions kept in the internal cache are exported. Servers issuing
+ * session tickets need to persist the ticket keys instead, see
+ * #session_ticket_keys=.
+ *
+ * The output contains the master secrets, so it must be stored as carefully
+ * as the private key. Connections using this context are paused while the
+ * cache is being read.
+ */
+static VALUE
+ossl_sslctx_export_sessions(VALUE self)
+{
+    SSL_CTX *ctx;
+    struct sessions_export_args args = { 0 };
+    unsigned char *p;
+    VALUE str;
+    size_t i, total = OSSL_SESSIONS_MAGIC_LEN;
+    int ok = 1;
+    long now = (long)time(NULL);
+
+    GetSSLCTX(self, ctx);
+    args.ctx = ctx;
+#ifdef OSSL_SSL_NOGVL
+    /* The SSL_* call running the callback would never finish */
+    if (ossl_ssl_in_callback)
+        ossl_raise(eSSLError, "export_sessions cannot be called from a callback");
+#endif
+    rb_ensure(sessions_export_collect, (VALUE)&args,
+              sessions_export_collect_ensure, (VALUE)&args);
+
+    for (i = 0; i < args.num; i++) {
+        int len = i2d_SSL_SESSION(args.sessions[i], NULL);
+        if (len <= 0) {
+            ok = 0;
+            break;
+        }
+        total += OSSL_SESSIONS_HEADER_LEN + len;
+    }
+    str = ok ? rb_str_new(NULL, total) : Qnil;
+    if (ok) {
+        p = (unsigned char *)RSTRING_PTR(str);
+        memcpy(p, OSSL_SESSIONS_MAGIC, OSSL_SESSIONS_MAGIC_LEN);
+        p += OSSL_SESSIONS_MAGIC_LEN;
+        for (i = 0; i < args.num; i++) {
+            SSL_SESSION *sess = args.sessions[i];
+            long expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+            unsigned char *q = p + OSSL_SESSIONS_HEADER_LEN;
+            int len;
+
+            if (expires <= now)
+                continue;
+            len = i2d_SSL_SESSION(sess, &q);
+            sessions_put_be(p, (uint64_t)expires, 8);
+            sessions_put_be(p + 8, (uint64_t)len, 4);
+            p = q;
+        }
+        rb_str_set_len(str, (char *)p - RSTRING_PTR(str));
+    }
+    for (i = 0; i < args.num; i++)
+        SSL_SESSION_free(args.sessions[i]);
+    xfree(args.sessions);
+    if (!ok)
+        ossl_raise(eSSLError, "i2d_SSL_SESSION");
+
+    return str;
+}
+
+/*
+ *  call-seq:
+ *     ctx.import_sessions(string) -> Integer
+ *
+ * Adds the sessions serialized by #export_sessions to the internal session
+ * cache. Sessions that have expired or cannot be decoded are skipped. Returns
+ * the number of sessions added.
+ *
+ *   ctx.import_sessions(File.binread("sessions.bin"))
+ *
+ * The sessions are only resumed if #session_id_context is the same as when
+ * they were negotiated.
+ */
+static VALUE
+ossl_sslctx_import_sessions(VALUE self, VALUE str)
+{
+    SSL_CTX *ctx;
+    const unsigned char *p, *end;
+    int count = 0;
+    uint64_t now = (uint64_t)time(NULL);
+
+    GetSSLCTX(self, ctx);
+    StringValue(str);
+    p = (const unsigned char *)RSTRING_PTR(str);
+    end = p + RSTRING_LEN(str);
+    if (RSTRING_LEN(str) < OSSL_SESSIONS_MAGIC_LEN ||
+        memcmp(p, OSSL_SESSIONS_MAGIC, OSSL_SESSIONS_MAGIC_LEN))
+        rb_raise(rb_eArgError, "not exported by SSLContext#export_sessions");
+
+    /* Check the framing first so that nothing is imported on error */
+    for (p += OSSL_SESSIONS_MAGIC_LEN; p < end; ) {
+        uint64_t len;
+
+        if (end - p < OSSL_SESSIONS_HEADER_LEN)
+            rb_raise(rb_eArgError, "truncated session data");
+        len = sessions_get_be(p + 8, 4);
+        p += OSSL_SESSIONS_HEADER_LEN;
+        if ((uint64_t)(end - p) < len)
+            rb_raise(rb_eArgError, "truncated session data");
+        p += len;
+    }
+
+    p = (const unsigned char *)RSTRING_PTR(str) + OSSL_SESSIONS_MAGIC_LEN;
+    while (p < end) {
+        uint64_t expires = sessions_get_be(p, 8);
+        long len = (long)sessions_get_be(p + 8, 4);
+        const unsigned char *q = p + OSSL_SESSIONS_HEADER_LEN;
+        SSL_SESSION *sess;
+
+        p = q + len;
+        if (expires <= now)
+            continue;
+        sess = d2i_SSL_SESSION(NULL, &q, len);
+        if (!sess)
+            continue;
+        if (SSL_CTX_add_session(ctx, sess) == 1)
+            count++;
+        SSL_SESSION_free(sess);
+    }
+    ossl_clear_error();
+
+    return INT2NUM(count);
+}
+#endif
+
+/*
+ * SSLSocket class
+ */
+static inline int
+ssl_started(SSL *ssl)
+{
+    /* BIO is created through ossl_ssl_setup(), called by #connect or #accept */
+    return SSL_get_rbio(ssl) != NULL;
+}
+
+static void
+ossl_ssl_mark(void *ptr)
+{
+    SSL *ssl = ptr;
+    rb_gc_mark((VALUE)SSL_get_ex_data(ssl, ossl_ssl_ex_ptr_idx));
+}
+
+static void
+ossl_ssl_free(void *ptr)
+{
+    SSL *ssl = ptr;
+    struct ossl_ssl_data *data = GetSSLData(ssl);
+
+    if (data)
+        ssl_stats_fold(ssl);
+    SSL_free(ssl);
+    if (data) {
+        rb_nativethread_lock_destroy(&data->lock);
+#if !defined(OPENSSL_NO_DH)
+        EVP_PKEY_free(data->tmp_dh);
+#endif
+        ruby_xfree(data->trace);
+        ruby_xfree(data->wbuf);
+        ruby_xfree(data);
+    }
+}
+
+const rb_data_type_t ossl_ssl_type = {
+    "OpenSSL/SSL",
+    {
+        ossl_ssl_mark, ossl_ssl_free,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+/*
+ * Replaces the ring buffer of SSLSocket#handshake_trace with an empty one
+ * of _size_ entries, or disables the trace if _size_ is 0. Must be called
+ * with the GVL held.
+ */
+static void
+ssl_trace_resize(struct ossl_ssl_data *data, unsigned int size)
+{
+    struct ossl_trace *trace = NULL, *old;
+
+    if (size) {
+        if ((uint64_t)size * sizeof(trace->entries[0]) > SIZE_MAX - sizeof(*trace))
+            rb_raise(rb_eArgError, "handshake_trace size too large");
+        trace = ruby_xmalloc(sizeof(*trace) + sizeof(trace->entries[0]) * size);
+        trace->size = size;
+        trace->count = 0;
+    }
+#ifdef OSSL_SSL_NOGVL
+    old = RUBY_ATOMIC_PTR_EXCHANGE(data->trace, trace);
+    if (old) {
+        /*
+         * A writer may have loaded the old buffer before the exchange. It is
+         * done with it once seq has moved past the odd value.
+         */
+        rb_atomic_t seq = RUBY_ATOMIC_LOAD(data->seq);
+
+        if (seq & 1)
+            while (RUBY_ATOMIC_LOAD(data->seq) == seq)
+                ;
+    }
+#else
+    old = data->trace;
+    data->trace = trace;
+#endif
+    ruby_xfree(old);
+}
+
+VALUE
+ossl_ssl_s_alloc(VALUE klass)
+{
+    return TypedData_Wrap_Struct(klass, &ossl_ssl_type, NULL);
+}
+
+static VALUE
+peer_ip_address(VALUE io)
+{
+    VALUE remote_address = rb_funcall(io, rb_intern("remote_address"), 0);
+
+    return rb_funcall(remote_address, rb_intern("inspect_sockaddr"), 0);
+}
+
+static VALUE
+fallback_peer_ip_address(VALUE self, VALUE exc)
+{
+    return rb_str_new_cstr("(null)");
+}
+
+static VALUE
+peeraddr_ip_str(VALUE io)
+{
+    return rb_rescue2(peer_ip_address, io, fallback_peer_ip_address, Qnil,
+                      rb_eSystemCallError, (VALUE)0);
+}
+
+/*
+ * Creates the SSL object for an SSLSocket or an SSLEngine from the
+ * SSLContext _v_ctx_.
+ */
+SSL *
+ossl_ssl_new(VALUE self, VALUE v_ctx)
+{
+    SSL *ssl;
+    SSL_CTX *ctx;
+    struct ossl_ssl_data *data;
+    VALUE val;
+
+    GetSSLCTX(v_ctx, ctx);
+    rb_ivar_set(self, id_i_context, v_ctx);
+    ossl_sslctx_setup(v_ctx);
+
+    ssl = SSL_new(ctx);
+    if (!ssl)
+        ossl_raise(eSSLError, NULL);
+    RTYPEDDATA_DATA(self) = ssl;
+
+    if (!SSL_set_ex_data(ssl, ossl_ssl_ex_ptr_idx, (void *)self))
+        ossl_raise(eSSLError, "SSL_set_ex_data");
+    data = ZALLOC(struct ossl_ssl_data);
+    rb_nativethread_lock_initialize(&data->lock);
+    data->session_ctx = ctx;
+    if (!SSL_set_ex_data(ssl, ossl_ssl_ex_data_idx, data)) {
+        rb_nativethread_lock_destroy(&data->lock);
+        ruby_xfree(data);
+        ossl_raise(eSSLError, "SSL_set_ex_data");
+    }
+    SSL_set_info_callback(ssl, ssl_info_cb);
+    SSL_set_msg_callback(ssl, ssl_msg_cb);
+
+    val = rb_attr_get(v_ctx, id_i_handshake_trace);
+    if (!NIL_P(val))
+        ssl_trace_resize(data, NUM2UINT(val));
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    {
+        struct ossl_sslctx_data *ctx_data = GetSSLCTXData(ctx);
+        long i;
+
+        if (ctx_data->num_expected_rpks && SSL_dane_enable(ssl, NULL) <= 0)
+            ossl_raise(eSSLError, "SSL_dane_enable");
+        for (i = 0; i < ctx_data->num_expected_rpks; i++)
+            if (!SSL_add_expected_rpk(ssl, ctx_data->expected_rpks[i]))
+                ossl_raise(eSSLError, "SSL_add_expected_rpk");
+    }
+#endif
+#if !defined(OPENSSL_NO_OCSP)
+    if (RTEST(rb_attr_get(v_ctx, id_i_ocsp_status_request)))
+        SSL_set_tlsext_status_type(ssl, TLSEXT_STATUSTYPE_ocsp);
+#endif
+
+    {
+        struct ossl_sslctx_data *ctx_data = GetSSLCTXData(ctx);
+
+        rb_nativethread_lock_lock(&ctx_data->lock);
+        ctx_data->connections++;
+        rb_nativethread_lock_unlock(&ctx_data->lock);
+    }
+
+    return ssl;
+}
+
+/*
+ * call-seq:
+ *    SSLSocket.new(io) => aSSLSocket
+ *    SSLSocket.new(io, ctx) => aSSLSocket
+ *    SSLSocket.new(io, ctx, sync_close:) => aSSLSocket
+ *
+ * Creates a new SSL socket from _io_ which must be a real IO object (not an
+ * IO-like object that responds to read/write).
+ *
+ * If _ctx_ is provided the SSL Sockets initial params will be taken from
+ * the context.
+ *
+ * The optional _sync_close_ keyword parameter sets the _sync_close_ instance
+ * variable. Setting this to +true+ will cause the underlying socket to be
+ * closed when the SSL/TLS connection is shut down.
+ *
+ * The OpenSSL::Buffering module provides additional IO methods.
+ *
+ * This method will freeze the SSLContext if one is provided;
+ * however, session management is still allowed in the frozen SSLContext.
+ */
+static VALUE
+ossl_ssl_initialize(int argc, VALUE *argv, VALUE self)
+{
+    static ID kw_ids[1];
+    VALUE kw_args[1];
+    VALUE opts;
+
+    VALUE io, v_ctx;
+    SSL *ssl;
+
+    TypedData_Get_Struct(self, SSL, &ossl_ssl_type, ssl);
+    if (ssl)
+        ossl_raise(eSSLError, "SSL already initialized");
+
+    if (rb_scan_args(argc, argv, "11:", &io, &v_ctx, &opts) == 1)
+        v_ctx = rb_funcall(cSSLContext, rb_intern("new"), 0);
+
+    if (!kw_ids[0]) {
+        kw_ids[0] = rb_intern_const("sync_close");
+    }
+
+    rb_get_kwargs(opts, kw_ids, 0, 1, kw_args);
+    if (kw_args[0] != Qundef) {
+        rb_ivar_set(self, id_i_sync_close, kw_args[0]);
+    }
+
+    if (rb_respond_to(io, rb_intern("nonblock=")))
+        rb_funcall(io, rb_intern("nonblock="), 1, Qtrue);
+    Check_Type(io, T_FILE);
+    rb_ivar_set(self, id_i_io, io);
+
+    ossl_ssl_new(self, v_ctx);
+
+    rb_call_super(0, NULL);
+
+    return self;
+}
+
+#ifndef HAVE_RB_IO_DESCRIPTOR
+static int
+io_descriptor_fallback(VALUE io)
+{
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return fptr->fd;
+}
+#define rb_io_descriptor io_descriptor_fallback
+#endif
+
+static VALUE
+ossl_ssl_setup(VALUE self)
+{
+    VALUE io;
+    SSL *ssl;
+    rb_io_t *fptr;
+
+    GetSSL(self, ssl);
+    if (ssl_started(ssl))
+        return Qtrue;
+
+    io = rb_attr_get(self, id_i_io);
+    GetOpenFile(io, fptr);
+    rb_io_check_readable(fptr);
+    rb_io_check_writable(fptr);
+    if (!SSL_set_fd(ssl, TO_SOCKET(rb_io_descriptor(io))))
+        ossl_raise(eSSLError, "SSL_set_fd");
+
+    return Qtrue;
+}
+
+/*
+ * Resumes a session from SSLContext#client_session_cache, if any, before the
+ * first ClientHello is sent.
+ */
+static void
+ossl_ssl_client_session_lookup(VALUE self)
+{
+    SSL *ssl;
+    VALUE ctx_obj;
+
+    GetSSL(self, ssl);
+    if (!SSL_in_before(ssl) || SSL_get_session(ssl))
+        return;
+    ctx_obj = rb_attr_get(self, id_i_context);
+    if (RTEST(rb_attr_get(ctx_obj, id_i_client_session_cache)))
+        rb_funcall(self, rb_intern("session_cache_lookup"), 0);
+}
+
+static int
+errno_mapped(void)
+{
+#ifdef _WIN32
+    return rb_w32_map_errno(WSAGetLastError());
+#else
+    return errno;
+#endif
+}
+
+struct ossl_ssl_call_args {
     SSL *ssl;
+    int (*func)(struct ossl_ssl_call_args *);
+    void *buf;
+    int num;
+    /* For SSL_sendfile() */
+    int fd;
+    off_t offset;
+    /* For SSL_read_early_data() and SSL_write_early_data() */
+    size_t nbytes;
+    int ret;
+    int code;
+    int saved_errno;
+    int called;
+    int interrupted;
+    /* The time on ossl_clock_ns() to give up waiting at, or 0 */
+    uint64_t deadline;
+};
+
+static int
+ssl_call_read(struct ossl_ssl_call_args *args)
+{
+    return SSL_read(args->ssl, args->buf, args->num);
+}
+
+static int
+ssl_call_write(struct ossl_ssl_call_args *args)
+{
+    int num = ossl_ssl_dyn_record_begin(args->ssl, args->num), ret;
+
+    ret = SSL_write(args->ssl, args->buf, num);
+    ossl_ssl_dyn_record_end(args->ssl, num, ret);
+    return ret;
+}
+
+static int
+ssl_call_shutdown(struct ossl_ssl_call_args *args)
+{
+    return SSL_shutdown(args->ssl);
+}
+
+static int
+ssl_call_connect(struct ossl_ssl_call_args *args)
+{
+    return SSL_connect(args->ssl);
+}
+
+static int
+ssl_call_accept(struct ossl_ssl_call_args *args)
+{
+    return SSL_accept(args->ssl);
+}
+
+#ifdef HAVE_SSL_READ_EARLY_DATA
+static int
+ssl_call_write_early_data(struct ossl_ssl_call_args *args)
+{
+    if (!SSL_write_early_data(args->ssl, args->buf, args->num, &args->nbytes))
+        return 0;
+    return (int)args->nbytes;
+}
+
+static int
+ssl_call_read_early_data(struct ossl_ssl_call_args *args)
+{
+    args->nbytes = 0;
+    return SSL_read_early_data(args->ssl, args->buf, args->num, &args->nbytes);
+}
+#endif
+
+#ifdef HAVE_SSL_SENDFILE
+static int
+ssl_call_sendfile(struct ossl_ssl_call_args *args)
+{
+    return (int)SSL_sendfile(args->ssl, args->fd, args->offset, args->num, 0);
+}
+#endif
+
+/* Same as ossl_ssl_call(), but keeps the GVL. */
+static void
+ossl_ssl_call_with_gvl(struct ossl_ssl_call_args *args)
+{
+    long nread = 0, nwritten = 0;
+
+    args->ret = args->func(args);
+    args->saved_errno = errno_mapped();
+    args->code = SSL_get_error(args->ssl, args->ret);
+    args->called = 1;
+
+    if (args->ret > 0) {
+        if (args->func == ssl_call_read)
+            nread = args->ret;
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        else if (args->func == ssl_call_read_early_data)
+            nread = (long)args->nbytes;
+        else if (args->func == ssl_call_write_early_data)
+            nwritten = args->ret;
+#endif
+#ifdef HAVE_SSL_SENDFILE
+        else if (args->func == ssl_call_sendfile)
+            nwritten = args->ret;
+#endif
+        else if (args->func == ssl_call_write)
+            nwritten = args->ret;
+    }
+    ossl_ssl_stats_update(args->ssl, nread, nwritten, args->code);
+}
+
+static void *
+ossl_ssl_call_i(void *ptr)
+{
+    struct ossl_ssl_call_args *args = ptr;
+#ifdef OSSL_SSL_NOGVL
+    struct ossl_ssl_data *data = GetSSLData(args->ssl);
+    struct ossl_sslctx_data *ctx_data = GetSSLCTXData(data->session_ctx);
+
+    /* The internal session cache may be modified, see export_sessions */
+    if (!sessions_call_enter(ctx_data, &args->interrupted))
+        return NULL;
+    rb_nativethread_lock_lock(&data->lock);
+    if (args->interrupted) {
+        rb_nativethread_lock_unlock(&data->lock);
+        sessions_call_leave(ctx_data);
+        return NULL;
+    }
+    ossl_ssl_gvl_released = data;
+#endif
+    ossl_ssl_call_with_gvl(args);
+#ifdef OSSL_SSL_NOGVL
+    ossl_ssl_gvl_released = NULL;
+    rb_nativethread_lock_unlock(&data->lock);
+    sessions_call_leave(ctx_data);
+#endif
+    return NULL;
+}
+
+#ifdef OSSL_SSL_NOGVL
+/*
+ * The socket is in non-blocking mode, so the SSL_* functions themselves never
+ * sleep. The only waits are for another thread using the same SSL object to
+ * finish and for SSLContext#export_sessions; make the call skipped so that the
+ * interrupt can be checked.
+ */
+static void
+ossl_ssl_call_ubf(void *ptr)
+{
+    struct ossl_ssl_call_args *args = ptr;
+
+    args->interrupted = 1;
+    sessions_call_wakeup(GetSSLCTXData(GetSSLData(args->ssl)->session_ctx));
+}
+#endif
+
+/*
+ * Calls args->func, which is a thin wrapper of SSL_read(), SSL_write(), etc.,
+ * without the GVL. The result is stored in args->ret, and SSL_get_error() and
+ * errno right after the call in args->code and args->saved_errno.
+ *
+ * The call is skipped if an interrupt is pending, in which case args->called
+ * is left 0. The caller must release any resource it holds and then call
+ * rb_thread_check_ints() before retrying.
+ *
+ * OpenSSL callbacks invoked during the call re-acquire the GVL with
+ * ossl_ssl_with_gvl(). The buffer must be pinned with rb_str_locktmp() or be
+ * frozen, and referenced from the stack.
+ */
+static void
+ossl_ssl_call(struct ossl_ssl_call_args *args)
+{
+    args->called = 0;
+    args->interrupted = 0;
+#ifdef OSSL_SSL_NOGVL
+    rb_thread_call_without_gvl2(ossl_ssl_call_i, args, ossl_ssl_call_ubf, args);
+#else
+    ossl_ssl_call_i(args);
+#endif
+}
+
+static void
+write_would_block(int nonblock)
+{
+    if (nonblock)
+        ossl_raise(eSSLErrorWaitWritable, "write would block");
+}
+
+static void
+read_would_block(int nonblock)
+{
+    if (nonblock)
+        ossl_raise(eSSLErrorWaitReadable, "read would block");
+}
+
+static int
+no_exception_p(VALUE opts)
+{
+    if (RB_TYPE_P(opts, T_HASH) &&
+          rb_hash_lookup2(opts, sym_exception, Qundef) == Qfalse)
+        return 1;
+    return 0;
+}
+
+// Provided by Ruby 3.2.0 and later in order to support the default IO#timeout.
+#ifndef RUBY_IO_TIMEOUT_DEFAULT
+#define RUBY_IO_TIMEOUT_DEFAULT Qnil
+#endif
+
+#ifdef HAVE_RB_IO_TIMEOUT
+#define IO_TIMEOUT_ERROR rb_eIOTimeoutError
+#else
+#define IO_TIMEOUT_ERROR rb_eIOError
+#endif
+
+
+/*
+ * Waits for _io_ until _deadline_, a time on ossl_clock_ns(), and raises
+ * SSLTimeoutError if it passes. Without a deadline, IO#timeout applies.
+ */
+static int
+io_wait_deadline(VALUE io, int events, uint64_t deadline)
+{
+    uint64_t now = ossl_clock_ns();
+
+    if (now >= deadline)
+        return 0;
+#ifdef HAVE_RB_IO_MAYBE_WAIT
+    return RTEST(rb_io_wait(io, INT2NUM(events),
+                            DBL2NUM((double)(deadline - now) / 1e9)));
+#else
+    rb_io_t *fptr;
+    struct timeval tv;
+
+    tv.tv_sec = (time_t)((deadline - now) / 1000000000);
+    tv.tv_usec = (long)((deadline - now) % 1000000000 / 1000);
+    GetOpenFile(io, fptr);
+    return rb_wait_for_single_fd(fptr->fd, events, &tv) > 0;
+#endif
+}
+
+static void
+io_wait_writable(VALUE io, uint64_t deadline)
+{
+    if (deadline) {
+        if (!io_wait_deadline(io, RB_WAITFD_OUT, deadline))
+            rb_raise(eSSLTimeoutError, "Timed out while waiting to become writable!");
+        return;
+    }
+#ifdef HAVE_RB_IO_MAYBE_WAIT
+    if (!rb_io_wait(io, INT2NUM(RUBY_IO_WRITABLE), RUBY_IO_TIMEOUT_DEFAULT)) {
+        rb_raise(IO_TIMEOUT_ERROR, "Timed out while waiting to become writable!");
+    }
+#else
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    rb_thread_fd_writable(fptr->fd);
+#endif
+}
+
+static void
+io_wait_readable(VALUE io, uint64_t deadline)
+{
+    if (deadline) {
+        if (!io_wait_deadline(io, RB_WAITFD_IN, deadline))
+            rb_raise(eSSLTimeoutError, "Timed out while waiting to become readable!");
+        return;
+    }
+#ifdef HAVE_RB_IO_MAYBE_WAIT
+    if (!rb_io_wait(io, INT2NUM(RUBY_IO_READABLE), RUBY_IO_TIMEOUT_DEFAULT)) {
+        rb_raise(IO_TIMEOUT_ERROR, "Timed out while waiting to become readable!");
+    }
+#else
     rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    rb_thread_wait_fd(fptr->fd);
+#endif
+}
+
+/*
+ * Converts the timeout: and deadline: keyword arguments in _opts_ into a
+ * time on ossl_clock_ns(), or 0 if neither is given. timeout: is in seconds
+ * from now, and deadline: is an absolute time in seconds on
+ * Process::CLOCK_MONOTONIC. The earlier of the two applies.
+ */
+static uint64_t
+ossl_ssl_get_deadline(VALUE opts)
+{
+    static ID kw_ids[2];
+    VALUE kw_args[2];
+    uint64_t deadline = 0, t;
+    double d;
+
+    if (NIL_P(opts))
+        return 0;
+    if (!kw_ids[0]) {
+        kw_ids[0] = rb_intern_const("timeout");
+        kw_ids[1] = rb_intern_const("deadline");
+    }
+    rb_get_kwargs(opts, kw_ids, 0, 2, kw_args);
+    if (kw_args[0] != Qundef && !NIL_P(kw_args[0])) {
+        d = NUM2DBL(kw_args[0]);
+        deadline = ossl_clock_ns() + (d > 0 ? (uint64_t)(d * 1e9) : 0);
+    }
+    if (kw_args[1] != Qundef && !NIL_P(kw_args[1])) {
+        d = NUM2DBL(kw_args[1]);
+        t = d > 0 ? (uint64_t)(d * 1e9) : 1;
+        if (!deadline || t < deadline)
+            deadline = t;
+    }
+    return deadline;
+}
+
+static VALUE
+ossl_start_ssl(VALUE self, int (*func)(struct ossl_ssl_call_args *),
+               const char *funcname, VALUE opts, uint64_t deadline)
+{
+    SSL *ssl;
+    VALUE cb_state;
+    int nonblock = opts != Qfalse;
+    struct ossl_ssl_call_args args = { 0 };
+
+    rb_ivar_set(self, ID_callback_state, Qnil);
 
     GetSSL(self, ssl);
-    if (ssl_started(ssl))
-        return Qtrue;
 
-    io = rb_attr_get(self, id_i_io);
-    GetOpenFile(io, fptr);
-    rb_io_check_readable(fptr);
-    rb_io_check_writable(fptr);
-    if (!SSL_set_fd(ssl, TO_SOCKET(rb_io_descriptor(io))))
-        ossl_raise(eSSLError, "SSL_set_fd");
+    VALUE io = rb_attr_get(self, id_i_io);
+    VALUE sslctx_obj = rb_attr_get(self, id_i_context);
+    int nogvl = RTEST(rb_attr_get(sslctx_obj, id_i_handshake_without_gvl));
 
-    return Qtrue;
+    args.ssl = ssl;
+    args.func = func;
+    args.deadline = deadline;
+    for (;;) {
+        if (nogvl)
+            ossl_ssl_call(&args);
+        else
+            ossl_ssl_call_with_gvl(&args);
+        if (!args.called) {
+            rb_thread_check_ints();
+            continue;
+        }
+        int ret = args.ret;
+        int saved_errno = args.saved_errno;
+
+        cb_state = rb_attr_get(self, ID_callback_state);
+        if (!NIL_P(cb_state)) {
+            /* must cleanup OpenSSL error stack before re-raising */
+            ossl_clear_error();
+            rb_jump_tag(NUM2INT(cb_state));
+        }
+
+        if (ret > 0)
+            break;
+
+        int code = args.code;
+        switch (code) {
+          case SSL_ERROR_WANT_WRITE:
+            if (no_exception_p(opts)) { return sym_wait_writable; }
+            write_would_block(nonblock);
+            io_wait_writable(io, args.deadline);
+            continue;
+          case SSL_ERROR_WANT_READ:
+            if (no_exception_p(opts)) { return sym_wait_readable; }
+            read_would_block(nonblock);
+            io_wait_readable(io, args.deadline);
+            continue;
+          case SSL_ERROR_SYSCALL:
+#ifdef __APPLE__
+            /* See ossl_ssl_write_internal() */
+            if (saved_errno == EPROTOTYPE)
+                continue;
+#endif
+            if (saved_errno)
+                rb_exc_raise(rb_syserr_new(saved_errno, funcname));
+            /* fallthrough */
+          default: {
+              VALUE error_append = Qnil;
+#if defined(SSL_R_CERTIFICATE_VERIFY_FAILED)
+              unsigned long err = ERR_peek_last_error();
+              if (ERR_GET_LIB(err) == ERR_LIB_SSL &&
+                  ERR_GET_REASON(err) == SSL_R_CERTIFICATE_VERIFY_FAILED) {
+                  const char *err_msg = ERR_reason_error_string(err),
+                        *verify_msg = X509_verify_cert_error_string(SSL_get_verify_result(ssl));
+                  if (!err_msg)
+                      err_msg = "(null)";
+                  if (!verify_msg)
+                      verify_msg = "(null)";
+                  ossl_clear_error(); /* let ossl_raise() not append message */
+                  error_append = rb_sprintf(": %s (%s)", err_msg, verify_msg);
+              }
+#endif
+              ossl_raise(eSSLError,
+                         "%s%s returned=%d errno=%d peeraddr=%"PRIsVALUE" state=%s%"PRIsVALUE,
+                         funcname,
+                         code == SSL_ERROR_SYSCALL ? " SYSCALL" : "",
+                         code,
+                         saved_errno,
+                         peeraddr_ip_str(io),
+                         SSL_state_string_long(ssl),
+                         error_append);
+          }
+        }
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *    ssl.connect => self
+ *    ssl.connect(timeout: seconds) => self
+ *    ssl.connect(deadline: time) => self
+ *
+ * Initiates an SSL/TLS handshake with a server.
+ *
+ * With _timeout_, raises SSLTimeoutError if the handshake does not complete
+ * within that many seconds. _deadline_ is the same as an absolute time on
+ * Process::CLOCK_MONOTONIC, which allows sharing one deadline among several
+ * calls. The waiting is done without Timeout or additional threads.
+ *
+ *   deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 5
+ *   ssl.connect(deadline: deadline)
+ *   ssl.syswrite(request, deadline: deadline)
+ */
+static VALUE
+ossl_ssl_connect(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    uint64_t deadline;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    deadline = ossl_ssl_get_deadline(opts);
+    ossl_ssl_setup(self);
+    ossl_ssl_client_session_lookup(self);
+
+    return ossl_start_ssl(self, ssl_call_connect, "SSL_connect", Qfalse, deadline);
+}
+
+/*
+ * call-seq:
+ *    ssl.connect_nonblock([options]) => self
+ *
+ * Initiates the SSL/TLS handshake as a client in non-blocking manner.
+ *
+ *   # emulates blocking connect
+ *   begin
+ *     ssl.connect_nonblock
+ *   rescue IO::WaitReadable
+ *     IO.select([s2])
+ *     retry
+ *   rescue IO::WaitWritable
+ *     IO.select(nil, [s2])
+ *     retry
+ *   end
+ *
+ * By specifying a keyword argument _exception_ to +false+, you can indicate
+ * that connect_nonblock should not raise an IO::WaitReadable or
+ * IO::WaitWritable exception, but return the symbol +:wait_readable+ or
+ * +:wait_writable+ instead.
+ */
+static VALUE
+ossl_ssl_connect_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    ossl_ssl_setup(self);
+    ossl_ssl_client_session_lookup(self);
+
+    return ossl_start_ssl(self, ssl_call_connect, "SSL_connect", opts, 0);
+}
+
+/*
+ * call-seq:
+ *    ssl.accept => self
+ *    ssl.accept(timeout: seconds) => self
+ *    ssl.accept(deadline: time) => self
+ *
+ * Waits for a SSL/TLS client to initiate a handshake. See #connect for
+ * _timeout_ and _deadline_.
+ */
+static VALUE
+ossl_ssl_accept(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    uint64_t deadline;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    deadline = ossl_ssl_get_deadline(opts);
+    ossl_ssl_setup(self);
+
+    return ossl_start_ssl(self, ssl_call_accept, "SSL_accept", Qfalse, deadline);
+}
+
+/*
+ * call-seq:
+ *    ssl.accept_nonblock([options]) => self
+ *
+ * Initiates the SSL/TLS handshake as a server in non-blocking manner.
+ *
+ *   # emulates blocking accept
+ *   begin
+ *     ssl.accept_nonblock
+ *   rescue IO::WaitReadable
+ *     IO.select([s2])
+ *     retry
+ *   rescue IO::WaitWritable
+ *     IO.select(nil, [s2])
+ *     retry
+ *   end
+ *
+ * By specifying a keyword argument _exception_ to +false+, you can indicate
+ * that accept_nonblock should not raise an IO::WaitReadable or
+ * IO::WaitWritable exception, but return the symbol +:wait_readable+ or
+ * +:wait_writable+ instead.
+ */
+static VALUE
+ossl_ssl_accept_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    ossl_ssl_setup(self);
+
+    return ossl_start_ssl(self, ssl_call_accept, "SSL_accept", opts, 0);
 }
 
+/*
+ * Reads up to _len_ bytes from the SSL connection into _ptr_, or into _str_
+ * if _ptr_ is NULL. Returns the number of bytes read. If _exception_ is 0,
+ * returns 0 and sets *_ret_ to nil on EOF, or to :wait_readable or
+ * :wait_writable if _nonblock_ is set and the operation would block.
+ */
 static int
-errno_mapped(void)
+ossl_ssl_read_loop(VALUE self, SSL *ssl, VALUE str, char *ptr, int len,
+                   int nonblock, int exception, VALUE *ret, uint64_t deadline)
 {
-#ifdef _WIN32
-    return rb_w32_map_errno(WSAGetLastError());
-#else
-    return errno;
-#endif
+    VALUE cb_state;
+    struct ossl_ssl_call_args args = { 0 };
+    VALUE io = rb_attr_get(self, id_i_io);
+
+    args.ssl = ssl;
+    args.func = ssl_call_read;
+    args.num = len;
+    args.deadline = deadline;
+    for (;;) {
+        if (ptr) {
+            args.buf = ptr;
+            ossl_ssl_call(&args);
+        }
+        else {
+            rb_str_locktmp(str);
+            args.buf = RSTRING_PTR(str);
+            ossl_ssl_call(&args);
+            rb_str_unlocktmp(str);
+            RB_GC_GUARD(str);
+        }
+        if (!args.called) {
+            rb_thread_check_ints();
+            continue;
+        }
+        int nread = args.ret;
+        int saved_errno = args.saved_errno;
+
+        cb_state = rb_attr_get(self, ID_callback_state);
+        if (!NIL_P(cb_state)) {
+            rb_ivar_set(self, ID_callback_state, Qnil);
+            ossl_clear_error();
+            rb_jump_tag(NUM2INT(cb_state));
+        }
+
+        switch (args.code) {
+          case SSL_ERROR_NONE:
+            return nread;
+          case SSL_ERROR_ZERO_RETURN:
+            if (!exception) { *ret = Qnil; return 0; }
+            rb_eof_error();
+          case SSL_ERROR_WANT_WRITE:
+            if (nonblock) {
+                if (!exception) { *ret = sym_wait_writable; return 0; }
+                write_would_block(nonblock);
+            }
+            io_wait_writable(io, deadline);
+            break;
+          case SSL_ERROR_WANT_READ:
+            if (nonblock) {
+                if (!exception) { *ret = sym_wait_readable; return 0; }
+                read_would_block(nonblock);
+            }
+            io_wait_readable(io, deadline);
+            break;
+          case SSL_ERROR_SYSCALL:
+            if (!ERR_peek_error()) {
+                if (saved_errno)
+                    rb_exc_raise(rb_syserr_new(saved_errno, "SSL_read"));
+                else {
+                    /*
+                     * The underlying BIO returned 0. This is actually a
+                     * protocol error. But unfortunately, not all
+                     * implementations cleanly shutdown the TLS connection
+                     * but just shutdown/close the TCP connection. So report
+                     * EOF for now...
+                     */
+                    if (!exception) { *ret = Qnil; return 0; }
+                    rb_eof_error();
+                }
+            }
+            /* fall through */
+          default:
+            ossl_raise(eSSLError, "SSL_read");
+        }
+
+        if (!ptr) {
+            // Ensure the buffer is not modified during io_wait_*able()
+            rb_str_modify(str);
+            if (rb_str_capacity(str) < (size_t)len)
+                rb_raise(eSSLError, "read buffer was modified");
+        }
+    }
 }
 
-static void
-write_would_block(int nonblock)
-{
-    if (nonblock)
-        ossl_raise(eSSLErrorWaitWritable, "write would block");
+static VALUE
+ossl_ssl_read_internal(int argc, VALUE *argv, VALUE self, int nonblock)
+{
+    SSL *ssl;
+    int ilen, nread;
+    VALUE len, str, ret;
+    VALUE opts = Qnil;
+    uint64_t deadline = 0;
+
+    rb_scan_args(argc, argv, "11:", &len, &str, &opts);
+    if (!nonblock) {
+        deadline = ossl_ssl_get_deadline(opts);
+        opts = Qnil;
+    }
+    GetSSL(self, ssl);
+    if (!ssl_started(ssl))
+        rb_raise(eSSLError, "SSL session is not started yet");
+
+    ilen = NUM2INT(len);
+    if (NIL_P(str))
+        str = rb_str_new(0, ilen);
+    else {
+        StringValue(str);
+        if (RSTRING_LEN(str) >= ilen)
+            rb_str_modify(str);
+        else
+            rb_str_modify_expand(str, ilen - RSTRING_LEN(str));
+    }
+
+    if (ilen == 0) {
+        rb_str_set_len(str, 0);
+        return str;
+    }
+
+    nread = ossl_ssl_read_loop(self, ssl, str, NULL, ilen, nonblock,
+                               !no_exception_p(opts), &ret, deadline);
+    if (!nread)
+        return ret;
+    rb_str_set_len(str, nread);
+    return str;
 }
 
-static void
-read_would_block(int nonblock)
+/*
+ * call-seq:
+ *    ssl.sysread(length) => string
+ *    ssl.sysread(length, buffer) => buffer
+ *    ssl.sysread(length, buffer, timeout: seconds) => buffer
+ *
+ * Reads _length_ bytes from the SSL connection.  If a pre-allocated _buffer_
+ * is provided the data will be written into it.
+ *
+ * With _timeout_ or _deadline_, raises SSLTimeoutError if no data arrives in
+ * time. See #connect.
+ */
+static VALUE
+ossl_ssl_read(int argc, VALUE *argv, VALUE self)
 {
-    if (nonblock)
-        ossl_raise(eSSLErrorWaitReadable, "read would block");
+    return ossl_ssl_read_internal(argc, argv, self, 0);
 }
 
-static int
-no_exception_p(VALUE opts)
+/*
+ * call-seq:
+ *    ssl.sysread_nonblock(length) => string
+ *    ssl.sysread_nonblock(length, buffer) => buffer
+ *    ssl.sysread_nonblock(length[, buffer [, opts]) => buffer
+ *
+ * A non-blocking version of #sysread.  Raises an SSLError if reading would
+ * block.  If "exception: false" is passed, this method returns a symbol of
+ * :wait_readable, :wait_writable, or nil, rather than raising an exception.
+ *
+ * Reads _length_ bytes from the SSL connection.  If a pre-allocated _buffer_
+ * is provided the data will be written into it.
+ */
+static VALUE
+ossl_ssl_read_nonblock(int argc, VALUE *argv, VALUE self)
 {
-    if (RB_TYPE_P(opts, T_HASH) &&
-          rb_hash_lookup2(opts, sym_exception, Qundef) == Qfalse)
-        return 1;
-    return 0;
+    return ossl_ssl_read_internal(argc, argv, self, 1);
 }
 
-// Provided by Ruby 3.2.0 and later in order to support the default IO#timeout.
-#ifndef RUBY_IO_TIMEOUT_DEFAULT
-#define RUBY_IO_TIMEOUT_DEFAULT Qnil
-#endif
-
-#ifdef HAVE_RB_IO_TIMEOUT
-#define IO_TIMEOUT_ERROR rb_eIOTimeoutError
-#else
-#define IO_TIMEOUT_ERROR rb_eIOError
-#endif
+/* Same as OpenSSL::Buffering::BLOCK_SIZE */
+#define FILL_RBUFF_SIZE (16 * 1024)
 
+struct fill_rbuff_args {
+    VALUE self;
+    struct ossl_read_buffer *rb;
+};
 
-static void
-io_wait_writable(VALUE io)
+static VALUE
+ossl_ssl_fill_rbuff_i(VALUE arg)
 {
-#ifdef HAVE_RB_IO_MAYBE_WAIT
-    if (!rb_io_wait(io, INT2NUM(RUBY_IO_WRITABLE), RUBY_IO_TIMEOUT_DEFAULT)) {
-        rb_raise(IO_TIMEOUT_ERROR, "Timed out while waiting to become writable!");
-    }
-#else
-    rb_io_t *fptr;
-    GetOpenFile(io, fptr);
-    rb_thread_fd_writable(fptr->fd);
-#endif
+    struct fill_rbuff_args *args = (struct fill_rbuff_args *)arg;
+    struct ossl_read_buffer *rb = args->rb;
+    VALUE self = args->self, ret;
+    SSL *ssl;
+    int nread;
+
+    GetSSL(self, ssl);
+    if (!ssl_started(ssl))
+        rb_raise(eSSLError, "SSL session is not started yet");
+
+    nread = ossl_ssl_read_loop(self, ssl, Qnil, rb->ptr + rb->off + rb->len,
+                               FILL_RBUFF_SIZE, 0, 0, &ret, 0);
+    if (nread)
+        rb->len += nread;
+    else
+        rb_ivar_set(self, id_i_eof, Qtrue);
+    return Qnil;
 }
 
-static void
-io_wait_readable(VALUE io)
+static VALUE
+ossl_ssl_fill_rbuff_ensure(VALUE arg)
 {
-#ifdef HAVE_RB_IO_MAYBE_WAIT
-    if (!rb_io_wait(io, INT2NUM(RUBY_IO_READABLE), RUBY_IO_TIMEOUT_DEFAULT)) {
-        rb_raise(IO_TIMEOUT_ERROR, "Timed out while waiting to become readable!");
-    }
-#else
-    rb_io_t *fptr;
-    GetOpenFile(io, fptr);
-    rb_thread_wait_fd(fptr->fd);
-#endif
+    ((struct fill_rbuff_args *)arg)->rb->busy = 0;
+    return Qnil;
 }
 
+/*
+ * call-seq:
+ *    ssl.fill_rbuff => nil
+ *
+ * Reads from the SSL connection directly into the read buffer of
+ * OpenSSL::Buffering, overriding OpenSSL::Buffering#fill_rbuff. Sets @eof
+ * at the end of the stream.
+ */
 static VALUE
-ossl_start_ssl(VALUE self, int (*func)(SSL *), const char *funcname, VALUE opts)
+ossl_ssl_fill_rbuff(VALUE self)
 {
-    SSL *ssl;
-    VALUE cb_state;
-    int nonblock = opts != Qfalse;
-
-    rb_ivar_set(self, ID_callback_state, Qnil);
-
-    GetSSL(self, ssl);
+    VALUE rbuffer = rb_attr_get(self, id_i_rbuffer), ret;
+    struct fill_rbuff_args args;
+
+    args.self = self;
+    args.rb = ossl_read_buffer_get(rbuffer, 1);
+    ossl_read_buffer_reserve(args.rb, FILL_RBUFF_SIZE);
+    args.rb->busy = 1;
+    ret = rb_ensure(ossl_ssl_fill_rbuff_i, (VALUE)&args,
+                    ossl_ssl_fill_rbuff_ensure, (VALUE)&args);
+    RB_GC_GUARD(rbuffer);
+    return ret;
+}
 
+/*
+ * Calls call_args->func, such as SSL_write() or SSL_sendfile(), until it
+ * succeeds. Returns the positive value it returned, which is the number of
+ * bytes written for SSL_write(). If _exception_ is 0 and _nonblock_ is set,
+ * returns 0 and sets *_ret_ to :wait_readable or :wait_writable if the
+ * operation would block.
+ */
+static int
+ossl_ssl_write_call(VALUE self, struct ossl_ssl_call_args *call_args,
+                    const char *funcname, int nonblock, int exception, VALUE *ret)
+{
+    VALUE cb_state;
     VALUE io = rb_attr_get(self, id_i_io);
+
     for (;;) {
-        int ret = func(ssl);
-        int saved_errno = errno_mapped();
+        ossl_ssl_call(call_args);
+        if (!call_args->called) {
+            rb_thread_check_ints();
+            continue;
+        }
+        int nwritten = call_args->ret;
+        int saved_errno = call_args->saved_errno;
 
         cb_state = rb_attr_get(self, ID_callback_state);
         if (!NIL_P(cb_state)) {
-            /* must cleanup OpenSSL error stack before re-raising */
+            rb_ivar_set(self, ID_callback_state, Qnil);
             ossl_clear_error();
             rb_jump_tag(NUM2INT(cb_state));
         }
+#ifdef HAVE_SSL_SENDFILE
+        /*
+         * SSL_sendfile() returns 0 at the end of the file, which
+         * SSL_get_error() would report as SSL_ERROR_SYSCALL.
+         */
+        if (call_args->func == ssl_call_sendfile && nwritten == 0)
+            return 0;
+#endif
 
-        if (ret > 0)
-            break;
-
-        int code = SSL_get_error(ssl, ret);
-        switch (code) {
+        switch (call_args->code) {
+          case SSL_ERROR_NONE:
+            return nwritten;
           case SSL_ERROR_WANT_WRITE:
-            if (no_exception_p(opts)) { return sym_wait_writable; }
+            if (!exception) { *ret = sym_wait_writable; return 0; }
             write_would_block(nonblock);
-            io_wait_writable(io);
+            io_wait_writable(io, call_args->deadline);
             continue;
           case SSL_ERROR_WANT_READ:
-            if (no_exception_p(opts)) { return sym_wait_readable; }
+            if (!exception) { *ret = sym_wait_readable; return 0; }
             read_would_block(nonblock);
-            io_wait_readable(io);
+            io_wait_readable(io, call_args->deadline);
             continue;
           case SSL_ERROR_SYSCALL:
 #ifdef __APPLE__
-            /* See ossl_ssl_write_internal() */
+            /*
+             * It appears that send syscall can return EPROTOTYPE if the
+             * socket is being torn down. Retry to get a proper errno to
+             * make the error handling in line with the socket library.
+             * [Bug #14713] https://bugs.ruby-lang.org/issues/14713
+             */
             if (saved_errno == EPROTOTYPE)
                 continue;
 #endif
             if (saved_errno)
                 rb_exc_raise(rb_syserr_new(saved_errno, funcname));
             /* fallthrough */
-          default: {
-              VALUE error_append = Qnil;
-#if defined(SSL_R_CERTIFICATE_VERIFY_FAILED)
-              unsigned long err = ERR_peek_last_error();
-              if (ERR_GET_LIB(err) == ERR_LIB_SSL &&
-                  ERR_GET_REASON(err) == SSL_R_CERTIFICATE_VERIFY_FAILED) {
-                  const char *err_msg = ERR_reason_error_string(err),
-                        *verify_msg = X509_verify_cert_error_string(SSL_get_verify_result(ssl));
-                  if (!err_msg)
-                      err_msg = "(null)";
-                  if (!verify_msg)
-                      verify_msg = "(null)";
-                  ossl_clear_error(); /* let ossl_raise() not append message */
-                  error_append = rb_sprintf(": %s (%s)", err_msg, verify_msg);
-              }
-#endif
-              ossl_raise(eSSLError,
-                         "%s%s returned=%d errno=%d peeraddr=%"PRIsVALUE" state=%s%"PRIsVALUE,
-                         funcname,
-                         code == SSL_ERROR_SYSCALL ? " SYSCALL" : "",
-                         code,
-                         saved_errno,
-                         peeraddr_ip_str(io),
-                         SSL_state_string_long(ssl),
-                         error_append);
-          }
+          default:
+            ossl_raise(eSSLError, "%s", funcname);
         }
     }
-
-    return self;
 }
 
 /*
- * call-seq:
- *    ssl.connect => self
- *
- * Initiates an SSL/TLS handshake with a server.
+ * Writes up to _len_ bytes from _ptr_ to the SSL connection. Returns the
+ * number of bytes written, which is less than _len_ if the record boundary
+ * came first. See ossl_ssl_write_call() for the other arguments.
  */
+static int
+ossl_ssl_write_loop(VALUE self, SSL *ssl, const char *ptr, int len,
+                    int nonblock, int exception, VALUE *ret, uint64_t deadline)
+{
+    struct ossl_ssl_call_args call_args = { 0 };
+
+    call_args.ssl = ssl;
+    call_args.func = ssl_call_write;
+    call_args.buf = (void *)ptr;
+    call_args.num = len;
+    call_args.deadline = deadline;
+    return ossl_ssl_write_call(self, &call_args, "SSL_write", nonblock,
+                               exception, ret);
+}
+
+struct ossl_ssl_write_args {
+    VALUE self;
+    VALUE str;
+    VALUE opts;
+    uint64_t deadline;
+};
+
 static VALUE
-ossl_ssl_connect(VALUE self)
+ossl_ssl_write_internal_safe(VALUE _args)
 {
-    ossl_ssl_setup(self);
+    struct ossl_ssl_write_args *args = (struct ossl_ssl_write_args *)_args;
+    VALUE self = args->self;
+    VALUE str = args->str;
+    VALUE opts = args->opts;
+
+    SSL *ssl;
+    rb_io_t *fptr;
+    int num, nwritten, nonblock = opts != Qfalse;
+    VALUE ret = Qnil;
+
+    GetSSL(self, ssl);
+    if (!ssl_started(ssl))
+        rb_raise(eSSLError, "SSL session is not started yet");
+
+    VALUE io = rb_attr_get(self, id_i_io);
+    GetOpenFile(io, fptr);
+
+    /* SSL_write(3ssl) manpage states num == 0 is undefined */
+    num = RSTRING_LENINT(str);
+    if (num == 0)
+        return INT2FIX(0);
+
+    nwritten = ossl_ssl_write_loop(self, ssl, RSTRING_PTR(str), num, nonblock,
+                                   !no_exception_p(opts), &ret, args->deadline);
+    return nwritten ? INT2NUM(nwritten) : ret;
+}
+
+static VALUE
+ossl_ssl_write_internal(VALUE self, VALUE str, VALUE opts, uint64_t deadline)
+{
+    StringValue(str);
+    int frozen = RB_OBJ_FROZEN(str);
+    if (!frozen) {
+        rb_str_locktmp(str);
+    }
+    int state;
+    struct ossl_ssl_write_args args = { self, str, opts, deadline };
+    VALUE result = rb_protect(ossl_ssl_write_internal_safe, (VALUE)&args, &state);
+    if (!frozen) {
+        rb_str_unlocktmp(str);
+    }
 
-    return ossl_start_ssl(self, SSL_connect, "SSL_connect", Qfalse);
+    if (state) {
+        rb_jump_tag(state);
+    }
+    return result;
 }
 
 /*
  * call-seq:
- *    ssl.connect_nonblock([options]) => self
- *
- * Initiates the SSL/TLS handshake as a client in non-blocking manner.
+ *    ssl.syswrite(string) => Integer
+ *    ssl.syswrite(string, timeout: seconds) => Integer
  *
- *   # emulates blocking connect
- *   begin
- *     ssl.connect_nonblock
- *   rescue IO::WaitReadable
- *     IO.select([s2])
- *     retry
- *   rescue IO::WaitWritable
- *     IO.select(nil, [s2])
- *     retry
- *   end
+ * Writes _string_ to the SSL connection.
  *
- * By specifying a keyword argument _exception_ to +false+, you can indicate
- * that connect_nonblock should not raise an IO::WaitReadable or
- * IO::WaitWritable exception, but return the symbol +:wait_readable+ or
- * +:wait_writable+ instead.
+ * With _timeout_ or _deadline_, raises SSLTimeoutError if the connection does
+ * not become writable in time. See #connect.
  */
 static VALUE
-ossl_ssl_connect_nonblock(int argc, VALUE *argv, VALUE self)
+ossl_ssl_write(int argc, VALUE *argv, VALUE self)
 {
-    VALUE opts;
-    rb_scan_args(argc, argv, "0:", &opts);
+    VALUE str, opts;
 
-    ossl_ssl_setup(self);
+    rb_scan_args(argc, argv, "1:", &str, &opts);
 
-    return ossl_start_ssl(self, SSL_connect, "SSL_connect", opts);
+    return ossl_ssl_write_internal(self, str, Qfalse,
+                                   ossl_ssl_get_deadline(opts));
 }
 
 /*
  * call-seq:
- *    ssl.accept => self
+ *    ssl.syswrite_nonblock(string) => Integer
+ *    ssl.syswrite_nonblock(string, opts) => Integer
  *
- * Waits for a SSL/TLS client to initiate a handshake.
+ * Writes _string_ to the SSL connection in a non-blocking manner.  Raises an
+ * SSLError if writing would block.  If "exception: false" is passed, this
+ * method returns a symbol of :wait_readable or :wait_writable, rather than
+ * raising an exception.
  */
 static VALUE
-ossl_ssl_accept(VALUE self)
+ossl_ssl_write_nonblock(int argc, VALUE *argv, VALUE self)
 {
-    ossl_ssl_setup(self);
+    VALUE str, opts;
+
+    rb_scan_args(argc, argv, "1:", &str, &opts);
 
-    return ossl_start_ssl(self, SSL_accept, "SSL_accept", Qfalse);
+    return ossl_ssl_write_internal(self, str, opts, 0);
 }
 
-/*
- * call-seq:
- *    ssl.accept_nonblock([options]) => self
- *
- * Initiates the SSL/TLS handshake as a server in non-blocking manner.
- *
- *   # emulates blocking accept
- *   begin
- *     ssl.accept_nonblock
- *   rescue IO::WaitReadable
- *     IO.select([s2])
- *     retry
- *   rescue IO::WaitWritable
- *     IO.select(nil, [s2])
- *     retry
- *   end
+#ifdef HAVE_SSL_READ_EARLY_DATA
+static VALUE
+ossl_ssl_early_data_call_i(VALUE arg)
+{
+    struct ossl_ssl_call_args *call_args = (struct ossl_ssl_call_args *)arg;
+    VALUE self = (VALUE)SSL_get_ex_data(call_args->ssl, ossl_ssl_ex_ptr_idx);
+    VALUE ret = Qnil;
+    const char *funcname = call_args->func == ssl_call_write_early_data ?
+        "SSL_write_early_data" : "SSL_read_early_data";
+
+    return INT2NUM(ossl_ssl_write_call(self, call_args, funcname, 0, 1, &ret));
+}
+
+/*
+ * call-seq:
+ *    ssl.write_early_data(string) => Integer
  *
- * By specifying a keyword argument _exception_ to +false+, you can indicate
- * that accept_nonblock should not raise an IO::WaitReadable or
- * IO::WaitWritable exception, but return the symbol +:wait_readable+ or
- * +:wait_writable+ instead.
+ * Sends _string_ as TLS 1.3 early data (0-RTT data) along with the
+ * ClientHello, before #connect. This is only possible when resuming a
+ * session whose Session#max_early_data is not 0, and the amount of data is
+ * limited by it. Returns the number of bytes written.
+ *
+ * After #connect, #early_data_status tells whether the server accepted the
+ * data. If it did not, the data must be sent again with #syswrite.
+ *
+ * Early data may be replayed by an attacker, so it must only be used for
+ * requests that are safe to process more than once.
  */
 static VALUE
-ossl_ssl_accept_nonblock(int argc, VALUE *argv, VALUE self)
+ossl_ssl_write_early_data(VALUE self, VALUE str)
 {
-    VALUE opts;
+    SSL *ssl;
+    struct ossl_ssl_call_args call_args = { 0 };
+    int state;
+    VALUE ret;
 
-    rb_scan_args(argc, argv, "0:", &opts);
+    GetSSL(self, ssl);
+    StringValue(str);
     ossl_ssl_setup(self);
+    ossl_ssl_client_session_lookup(self);
+    if (SSL_in_before(ssl))
+        SSL_set_connect_state(ssl);
+    if (RSTRING_LEN(str) == 0)
+        return INT2FIX(0);
 
-    return ossl_start_ssl(self, SSL_accept, "SSL_accept", opts);
+    str = rb_str_new_frozen(str);
+    call_args.ssl = ssl;
+    call_args.func = ssl_call_write_early_data;
+    call_args.buf = RSTRING_PTR(str);
+    call_args.num = RSTRING_LENINT(str);
+    ret = rb_protect(ossl_ssl_early_data_call_i, (VALUE)&call_args, &state);
+    RB_GC_GUARD(str);
+    if (state)
+        rb_jump_tag(state);
+    return ret;
 }
 
+/*
+ * call-seq:
+ *    ssl.read_early_data(maxlen) => string or nil
+ *    ssl.read_early_data(maxlen, buffer) => buffer or nil
+ *
+ * Reads up to _maxlen_ bytes of TLS 1.3 early data sent by the client, before
+ * #accept. Returns +nil+ once all the early data has been read, or if the
+ * client did not send any; #accept must then be called to complete the
+ * handshake. The server accepts early data only if SSLContext#max_early_data
+ * is set.
+ *
+ * Early data may be replayed by an attacker, so it must only be used for
+ * requests that are safe to process more than once.
+ */
 static VALUE
-ossl_ssl_read_internal(int argc, VALUE *argv, VALUE self, int nonblock)
+ossl_ssl_read_early_data(int argc, VALUE *argv, VALUE self)
 {
     SSL *ssl;
-    int ilen;
-    VALUE len, str, cb_state;
-    VALUE opts = Qnil;
+    struct ossl_ssl_call_args call_args = { 0 };
+    VALUE len, str, ret = Qnil;
+    int ilen, state;
 
-    if (nonblock) {
-        rb_scan_args(argc, argv, "11:", &len, &str, &opts);
-    } else {
-        rb_scan_args(argc, argv, "11", &len, &str);
-    }
+    rb_scan_args(argc, argv, "11", &len, &str);
     GetSSL(self, ssl);
-    if (!ssl_started(ssl))
-        rb_raise(eSSLError, "SSL session is not started yet");
-
     ilen = NUM2INT(len);
     if (NIL_P(str))
         str = rb_str_new(0, ilen);
@@ -1987,262 +5757,547 @@ ossl_ssl_read_internal(int argc, VALUE *argv, VALUE self, int nonblock)
         else
             rb_str_modify_expand(str, ilen - RSTRING_LEN(str));
     }
+    ossl_ssl_setup(self);
+    if (SSL_in_before(ssl))
+        SSL_set_accept_state(ssl);
+
+    call_args.ssl = ssl;
+    call_args.func = ssl_call_read_early_data;
+    call_args.num = ilen;
+    rb_str_locktmp(str);
+    call_args.buf = RSTRING_PTR(str);
+    ret = rb_protect(ossl_ssl_early_data_call_i, (VALUE)&call_args, &state);
+    rb_str_unlocktmp(str);
+    if (state)
+        rb_jump_tag(state);
 
-    if (ilen == 0) {
-        rb_str_set_len(str, 0);
-        return str;
+    if (NUM2INT(ret) != SSL_READ_EARLY_DATA_SUCCESS)
+        return Qnil;
+    rb_str_set_len(str, (long)call_args.nbytes);
+    return str;
+}
+
+/*
+ * call-seq:
+ *    ssl.early_data_status => :not_sent, :rejected, or :accepted
+ *
+ * Returns whether TLS 1.3 early data was sent by the client and whether the
+ * server accepted it.
+ */
+static VALUE
+ossl_ssl_get_early_data_status(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    switch (SSL_get_early_data_status(ssl)) {
+      case SSL_EARLY_DATA_ACCEPTED:
+        return ID2SYM(rb_intern("accepted"));
+      case SSL_EARLY_DATA_REJECTED:
+        return ID2SYM(rb_intern("rejected"));
+      default:
+        return ID2SYM(rb_intern("not_sent"));
     }
+}
+#endif
 
-    VALUE io = rb_attr_get(self, id_i_io);
+/*
+ * The maximum size of the records SSLSocket#syswritev fills. It gathers
+ * records of SSLContext#max_send_fragment bytes if that is smaller.
+ */
+#define SYSWRITEV_RECORD_SIZE SSL3_RT_MAX_PLAIN_LENGTH
 
-    for (;;) {
-        rb_str_locktmp(str);
-        int nread = SSL_read(ssl, RSTRING_PTR(str), ilen);
-        int saved_errno = errno_mapped();
-        rb_str_unlocktmp(str);
+static void
+ossl_ssl_write_all(VALUE self, SSL *ssl, const char *ptr, long len)
+{
+    VALUE ret = Qnil;
+
+    while (len > 0) {
+        int n = ossl_ssl_write_loop(self, ssl, ptr, len > INT_MAX ? INT_MAX : (int)len,
+                                    0, 1, &ret, 0);
+        ptr += n;
+        len -= n;
+        /* Reports the progress to SSLSocket#syswritev's block */
+        if (rb_block_given_p())
+            rb_yield(INT2NUM(n));
+    }
+}
 
-        cb_state = rb_attr_get(self, ID_callback_state);
-        if (!NIL_P(cb_state)) {
-            rb_ivar_set(self, ID_callback_state, Qnil);
-            ossl_clear_error();
-            rb_jump_tag(NUM2INT(cb_state));
-        }
+struct ossl_ssl_syswritev_args {
+    VALUE self;
+    SSL *ssl;
+    VALUE strings;
+    char *buf;
+    int buf_owned;
+    long record_size;
+    long total;
+    /* Used by ossl_ssl_write_str_i() */
+    VALUE str;
+    long off, len;
+};
 
-        switch (SSL_get_error(ssl, nread)) {
-          case SSL_ERROR_NONE:
-            rb_str_set_len(str, nread);
-            return str;
-          case SSL_ERROR_ZERO_RETURN:
-            if (no_exception_p(opts)) { return Qnil; }
-            rb_eof_error();
-          case SSL_ERROR_WANT_WRITE:
-            if (nonblock) {
-                if (no_exception_p(opts)) { return sym_wait_writable; }
-                write_would_block(nonblock);
-            }
-            io_wait_writable(io);
-            break;
-          case SSL_ERROR_WANT_READ:
-            if (nonblock) {
-                if (no_exception_p(opts)) { return sym_wait_readable; }
-                read_would_block(nonblock);
-            }
-            io_wait_readable(io);
-            break;
-          case SSL_ERROR_SYSCALL:
-            if (!ERR_peek_error()) {
-                if (saved_errno)
-                    rb_exc_raise(rb_syserr_new(saved_errno, "SSL_read"));
+static VALUE
+ossl_ssl_write_str_i(VALUE arg)
+{
+    struct ossl_ssl_syswritev_args *args = (void *)arg;
+
+    ossl_ssl_write_all(args->self, args->ssl, RSTRING_PTR(args->str) + args->off,
+                       args->len);
+    return Qnil;
+}
+
+static VALUE
+ossl_ssl_write_str_ensure(VALUE str)
+{
+    rb_str_unlocktmp(str);
+    return Qnil;
+}
+
+static VALUE
+ossl_ssl_syswritev_i(VALUE arg)
+{
+    struct ossl_ssl_syswritev_args *args = (void *)arg;
+    long i, filled = 0;
+
+    for (i = 0; i < RARRAY_LEN(args->strings); i++) {
+        VALUE str = RARRAY_AREF(args->strings, i);
+        int last = i == RARRAY_LEN(args->strings) - 1;
+        long off = 0, len, n;
+
+        StringValue(str);
+        len = RSTRING_LEN(str);
+        args->total += len;
+        while (off < len) {
+            n = len - off;
+            if (!filled && (last || n >= args->record_size)) {
+                /* Whole records can be written straight from the String */
+                if (!last)
+                    n -= n % args->record_size;
+                args->str = str;
+                args->off = off;
+                args->len = n;
+                if (RB_OBJ_FROZEN(str))
+                    ossl_ssl_write_str_i((VALUE)args);
                 else {
-                    /*
-                     * The underlying BIO returned 0. This is actually a
-                     * protocol error. But unfortunately, not all
-                     * implementations cleanly shutdown the TLS connection
-                     * but just shutdown/close the TCP connection. So report
-                     * EOF for now...
-                     */
-                    if (no_exception_p(opts)) { return Qnil; }
-                    rb_eof_error();
+                    rb_str_locktmp(str);
+                    rb_ensure(ossl_ssl_write_str_i, (VALUE)args,
+                              ossl_ssl_write_str_ensure, str);
                 }
+                off += n;
+                continue;
+            }
+            if (n > args->record_size - filled)
+                n = args->record_size - filled;
+            memcpy(args->buf + filled, RSTRING_PTR(str) + off, n);
+            filled += n;
+            off += n;
+            if (filled == args->record_size) {
+                ossl_ssl_write_all(args->self, args->ssl, args->buf, filled);
+                filled = 0;
             }
-            /* fall through */
-          default:
-            ossl_raise(eSSLError, "SSL_read");
         }
-
-        // Ensure the buffer is not modified during io_wait_*able()
-        rb_str_modify(str);
-        if (rb_str_capacity(str) < (size_t)ilen)
-            rb_raise(eSSLError, "read buffer was modified");
+        RB_GC_GUARD(str);
     }
+    if (filled)
+        ossl_ssl_write_all(args->self, args->ssl, args->buf, filled);
+    return Qnil;
 }
 
-/*
- * call-seq:
- *    ssl.sysread(length) => string
- *    ssl.sysread(length, buffer) => buffer
- *
- * Reads _length_ bytes from the SSL connection.  If a pre-allocated _buffer_
- * is provided the data will be written into it.
- */
 static VALUE
-ossl_ssl_read(int argc, VALUE *argv, VALUE self)
+ossl_ssl_syswritev_ensure(VALUE arg)
 {
-    return ossl_ssl_read_internal(argc, argv, self, 0);
+    struct ossl_ssl_syswritev_args *args = (void *)arg;
+
+    if (args->buf_owned)
+        GetSSLData(args->ssl)->wbuf_busy = 0;
+    return Qnil;
 }
 
 /*
  * call-seq:
- *    ssl.sysread_nonblock(length) => string
- *    ssl.sysread_nonblock(length, buffer) => buffer
- *    ssl.sysread_nonblock(length[, buffer [, opts]) => buffer
+ *    ssl.syswritev(strings) => integer
+ *    ssl.syswritev(strings) { |n| ... } => integer
  *
- * A non-blocking version of #sysread.  Raises an SSLError if reading would
- * block.  If "exception: false" is passed, this method returns a symbol of
- * :wait_readable, :wait_writable, or nil, rather than raising an exception.
+ * Writes all of _strings_, an Array of Strings, to the SSL connection and
+ * returns the number of bytes written. Adjacent short Strings are gathered
+ * into full-sized TLS records without concatenating them in Ruby, and long
+ * Strings are encrypted in place. Used by OpenSSL::Buffering.
  *
- * Reads _length_ bytes from the SSL connection.  If a pre-allocated _buffer_
- * is provided the data will be written into it.
+ * If a block is given, it is called with the number of bytes each time some
+ * are written, so that the caller knows what has been sent when an exception
+ * is raised partway.
  */
 static VALUE
-ossl_ssl_read_nonblock(int argc, VALUE *argv, VALUE self)
+ossl_ssl_syswritev(VALUE self, VALUE strings)
 {
-    return ossl_ssl_read_internal(argc, argv, self, 1);
+    SSL *ssl;
+    rb_io_t *fptr;
+    struct ossl_ssl_data *data;
+    struct ossl_ssl_syswritev_args args = { 0 };
+    VALUE tmp = Qnil;
+
+    Check_Type(strings, T_ARRAY);
+    GetSSL(self, ssl);
+    if (!ssl_started(ssl))
+        rb_raise(eSSLError, "SSL session is not started yet");
+    GetOpenFile(rb_attr_get(self, id_i_io), fptr);
+
+    args.self = self;
+    args.ssl = ssl;
+    args.strings = strings;
+    data = GetSSLData(ssl);
+    args.record_size = GetSSLCTXData(data->session_ctx)->max_send_fragment;
+    if (!args.record_size)
+        args.record_size = SYSWRITEV_RECORD_SIZE;
+    if (data->wbuf_busy) {
+        /* Another thread is writing to the same SSLSocket */
+        tmp = rb_str_buf_new(SYSWRITEV_RECORD_SIZE);
+        args.buf = RSTRING_PTR(tmp);
+    }
+    else {
+        if (!data->wbuf)
+            data->wbuf = ALLOC_N(char, SYSWRITEV_RECORD_SIZE);
+        data->wbuf_busy = 1;
+        args.buf = data->wbuf;
+        args.buf_owned = 1;
+    }
+    rb_ensure(ossl_ssl_syswritev_i, (VALUE)&args,
+              ossl_ssl_syswritev_ensure, (VALUE)&args);
+    RB_GC_GUARD(tmp);
+    return LONG2NUM(args.total);
 }
 
+#ifdef HAVE_SSL_SENDFILE
+/*
+ * call-seq:
+ *    ssl.syssendfile(io, offset, length) => integer
+ *
+ * Sends _length_ bytes of the file _io_ starting at _offset_ with
+ * SSL_sendfile(). The connection must be using kernel TLS for sending; see
+ * #ktls_send?. Returns the number of bytes sent, which is less than _length_
+ * only if the end of the file was reached. Used by #sendfile.
+ */
 static VALUE
-ossl_ssl_write_internal_safe(VALUE _args)
+ossl_ssl_syssendfile(VALUE self, VALUE io, VALUE offset, VALUE length)
 {
-    VALUE *args = (VALUE*)_args;
-    VALUE self = args[0];
-    VALUE str = args[1];
-    VALUE opts = args[2];
-
     SSL *ssl;
     rb_io_t *fptr;
-    int num, nonblock = opts != Qfalse;
-    VALUE cb_state;
+    struct ossl_ssl_call_args call_args = { 0 };
+    off_t off = NUM2OFFT(offset);
+    long len = NUM2LONG(length), total = 0;
+    VALUE ret = Qnil;
 
     GetSSL(self, ssl);
     if (!ssl_started(ssl))
         rb_raise(eSSLError, "SSL session is not started yet");
+    GetOpenFile(rb_attr_get(self, id_i_io), fptr);
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        rb_raise(eSSLError, "kernel TLS is not enabled for sending");
+    io = rb_io_get_io(io);
+
+    call_args.ssl = ssl;
+    call_args.func = ssl_call_sendfile;
+    call_args.fd = rb_io_descriptor(io);
+    while (total < len) {
+        int n;
+
+        call_args.offset = off + total;
+        call_args.num = len - total > INT_MAX ? INT_MAX : (int)(len - total);
+        n = ossl_ssl_write_call(self, &call_args, "SSL_sendfile", 0, 1, &ret);
+        if (n == 0)
+            break;
+        total += n;
+    }
+    RB_GC_GUARD(io);
+    return LONG2NUM(total);
+}
+#endif
 
-    VALUE io = rb_attr_get(self, id_i_io);
-    GetOpenFile(io, fptr);
-
-    /* SSL_write(3ssl) manpage states num == 0 is undefined */
-    num = RSTRING_LENINT(str);
-    if (num == 0)
-        return INT2FIX(0);
+/*
+ * call-seq:
+ *    ssl.ktls_send? => true or false
+ *
+ * Returns +true+ if the kernel TLS offload is in use for sending records on
+ * this connection. It can only be enabled after the handshake if
+ * OpenSSL::SSL::OP_ENABLE_KTLS is set and the kernel supports the
+ * negotiated cipher suite.
+ */
+static VALUE
+ossl_ssl_ktls_send_p(VALUE self)
+{
+#ifdef BIO_get_ktls_send
+    SSL *ssl;
 
-    for (;;) {
-        int nwritten = SSL_write(ssl, RSTRING_PTR(str), num);
-        int saved_errno = errno_mapped();
+    GetSSL(self, ssl);
+    return SSL_get_wbio(ssl) && BIO_get_ktls_send(SSL_get_wbio(ssl)) ? Qtrue : Qfalse;
+#else
+    return Qfalse;
+#endif
+}
 
-        cb_state = rb_attr_get(self, ID_callback_state);
-        if (!NIL_P(cb_state)) {
-            rb_ivar_set(self, ID_callback_state, Qnil);
-            ossl_clear_error();
-            rb_jump_tag(NUM2INT(cb_state));
-        }
+/*
+ * call-seq:
+ *    ssl.ktls_recv? => true or false
+ *
+ * Returns +true+ if the kernel TLS offload is in use for receiving records on
+ * this connection. See also #ktls_send?.
+ */
+static VALUE
+ossl_ssl_ktls_recv_p(VALUE self)
+{
+#ifdef BIO_get_ktls_recv
+    SSL *ssl;
 
-        switch (SSL_get_error(ssl, nwritten)) {
-          case SSL_ERROR_NONE:
-            return INT2NUM(nwritten);
-          case SSL_ERROR_WANT_WRITE:
-            if (no_exception_p(opts)) { return sym_wait_writable; }
-            write_would_block(nonblock);
-            io_wait_writable(io);
-            continue;
-          case SSL_ERROR_WANT_READ:
-            if (no_exception_p(opts)) { return sym_wait_readable; }
-            read_would_block(nonblock);
-            io_wait_readable(io);
-            continue;
-          case SSL_ERROR_SYSCALL:
-#ifdef __APPLE__
-            /*
-             * It appears that send syscall can return EPROTOTYPE if the
-             * socket is being torn down. Retry to get a proper errno to
-             * make the error handling in line with the socket library.
-             * [Bug #14713] https://bugs.ruby-lang.org/issues/14713
-             */
-            if (saved_errno == EPROTOTYPE)
-                continue;
+    GetSSL(self, ssl);
+    return SSL_get_rbio(ssl) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? Qtrue : Qfalse;
+#else
+    return Qfalse;
 #endif
-            if (saved_errno)
-                rb_exc_raise(rb_syserr_new(saved_errno, "SSL_write"));
-            /* fallthrough */
-          default:
-            ossl_raise(eSSLError, "SSL_write");
-        }
-    }
 }
 
+/*
+ * call-seq:
+ *    ssl.stop => nil
+ *
+ * Sends "close notify" to the peer and tries to shut down the SSL connection
+ * gracefully.
+ */
+static VALUE
+ossl_ssl_stop(VALUE self)
+{
+    SSL *ssl;
+    int ret;
+    struct ossl_ssl_call_args args = { 0 };
+
+    GetSSL(self, ssl);
+    /* Write out the secrets of a failed handshake */
+    ssl_keylog_flush(ssl);
+    if (!ssl_started(ssl))
+        return Qnil;
+    args.ssl = ssl;
+    args.func = ssl_call_shutdown;
+    do {
+        ossl_ssl_call(&args);
+        if (!args.called)
+            rb_thread_check_ints();
+    } while (!args.called);
+    ssl_stats_fold(ssl);
+    ret = args.ret;
+    if (ret == 1) /* Have already received close_notify */
+        return Qnil;
+    if (ret == 0) /* Sent close_notify, but we don't wait for reply */
+        return Qnil;
+
+    /*
+     * XXX: Something happened. Possibly it failed because the underlying socket
+     * is not writable/readable, since it is in non-blocking mode. We should do
+     * some proper error handling using SSL_get_error() and maybe retry, but we
+     * can't block here. Give up for now.
+     */
+    ossl_clear_error();
+    return Qnil;
+}
 
+#if !defined(OPENSSL_NO_OCSP)
+/*
+ * call-seq:
+ *    ssl.ocsp_response => OpenSSL::OCSP::Response or nil
+ *
+ * Returns the OCSP response stapled by the server, or +nil+ if none was
+ * received. The response is not verified; it is requested only if
+ * SSLContext#ocsp_status_request is set.
+ */
 static VALUE
-ossl_ssl_write_internal(VALUE self, VALUE str, VALUE opts)
+ossl_ssl_get_ocsp_response(VALUE self)
 {
-    StringValue(str);
-    int frozen = RB_OBJ_FROZEN(str);
-    if (!frozen) {
-        rb_str_locktmp(str);
-    }
-    int state;
-    VALUE args[3] = {self, str, opts};
-    VALUE result = rb_protect(ossl_ssl_write_internal_safe, (VALUE)args, &state);
-    if (!frozen) {
-        rb_str_unlocktmp(str);
-    }
+    SSL *ssl;
+    const unsigned char *p;
+    long len;
 
-    if (state) {
-        rb_jump_tag(state);
-    }
-    return result;
+    GetSSL(self, ssl);
+    len = SSL_get_tlsext_status_ocsp_resp(ssl, &p);
+    if (!p || len <= 0)
+        return Qnil;
+
+    return rb_funcall(rb_path2class("OpenSSL::OCSP::Response"), rb_intern("new"),
+                      1, rb_str_new((const char *)p, len));
 }
+#endif
 
 /*
  * call-seq:
- *    ssl.syswrite(string) => Integer
+ *    ssl.stats => hash
  *
- * Writes _string_ to the SSL connection.
+ * Returns the statistics of the connection, as a Hash with the following
+ * keys:
+ *
+ * :handshake_time:: Duration of the first handshake in seconds, or +nil+ if
+ *                   it is not completed
+ * :resumed:: Whether the handshake resumed a session
+ * :bytes_read:: Number of bytes of application data read
+ * :bytes_written:: Number of bytes of application data written
+ * :raw_bytes_read:: Number of bytes read from the underlying socket
+ * :raw_bytes_written:: Number of bytes written to the underlying socket
+ * :records_read:: Number of TLS records received
+ * :records_written:: Number of TLS records sent
+ * :wait_readable:: Number of times an operation had to wait for the socket
+ *                  to become readable
+ * :wait_writable:: Number of times an operation had to wait for the socket
+ *                  to become writable
+ *
+ * The counters are maintained without allocating objects; the Hash is only
+ * built by this method. See also SSLContext#stats.
  */
 static VALUE
-ossl_ssl_write(VALUE self, VALUE str)
+ossl_ssl_get_stats(VALUE self)
+{
+    SSL *ssl;
+    struct ossl_ssl_data *data;
+    struct ossl_ssl_stats stats;
+    uint64_t handshake_time;
+    int handshake_done;
+    rb_atomic_t seq;
+    VALUE hash;
+
+    GetSSL(self, ssl);
+    data = GetSSLData(ssl);
+    ssl_stats_get(ssl, &stats);
+    do {
+        seq = ssl_data_read_begin(data);
+        handshake_done = data->handshake_done;
+        handshake_time = data->handshake_time;
+    } while (ssl_data_read_retry(data, seq));
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("handshake_time")),
+                 handshake_done ? DBL2NUM(handshake_time / 1e9) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("resumed")),
+                 handshake_done && SSL_session_reused(ssl) ? Qtrue : Qfalse);
+    ssl_stats_to_hash(hash, &stats);
+
+    return hash;
+}
+
+static VALUE
+ssl_trace_msg_name(const struct ossl_trace_entry *entry)
 {
-    return ossl_ssl_write_internal(self, str, Qfalse);
+    static const struct {
+        unsigned char type;
+        const char *name;
+    } names[] = {
+        { 0, "hello_request" },
+        { 1, "client_hello" },
+        { 2, "server_hello" },
+        { 4, "new_session_ticket" },
+        { 5, "end_of_early_data" },
+        { 8, "encrypted_extensions" },
+        { 11, "certificate" },
+        { 12, "server_key_exchange" },
+        { 13, "certificate_request" },
+        { 14, "server_hello_done" },
+        { 15, "certificate_verify" },
+        { 16, "client_key_exchange" },
+        { 20, "finished" },
+        { 22, "certificate_status" },
+        { 24, "key_update" },
+        { 25, "compressed_certificate" },
+    };
+    size_t i;
+
+    if (entry->content_type == SSL3_RT_CHANGE_CIPHER_SPEC)
+        return ID2SYM(rb_intern("change_cipher_spec"));
+    if (entry->content_type == SSL3_RT_ALERT)
+        return ID2SYM(rb_intern("alert"));
+    for (i = 0; i < numberof(names); i++)
+        if (names[i].type == entry->msg_type)
+            return ID2SYM(rb_intern(names[i].name));
+    return INT2FIX(entry->msg_type);
 }
 
 /*
  * call-seq:
- *    ssl.syswrite_nonblock(string) => Integer
- *    ssl.syswrite_nonblock(string, opts) => Integer
+ *    ssl.handshake_trace => array or nil
  *
- * Writes _string_ to the SSL connection in a non-blocking manner.  Raises an
- * SSLError if writing would block.  If "exception: false" is passed, this
- * method returns a symbol of :wait_readable or :wait_writable, rather than
- * raising an exception.
+ * Returns the protocol messages recorded while SSLContext#handshake_trace
+ * or #handshake_trace= is enabled, oldest first, or +nil+ if it is not
+ * enabled. Each element is an Array of:
+ *
+ * 1. The time in seconds since the start of the handshake
+ * 2. +:sent+ or +:received+
+ * 3. The handshake message type as a Symbol, such as +:client_hello+, or
+ *    +:change_cipher_spec+ or +:alert+. Unknown handshake message types are
+ *    returned as an Integer.
+ * 4. The length of the message in bytes
+ *
+ * Only the most recent messages are kept if there are more than the size
+ * of the trace.
+ *
+ *   ssl.handshake_trace
+ *   #=> [[0.0000041, :sent, :client_hello, 250],
+ *   #    [0.0012133, :received, :server_hello, 122], ...]
  */
 static VALUE
-ossl_ssl_write_nonblock(int argc, VALUE *argv, VALUE self)
+ossl_ssl_get_handshake_trace(VALUE self)
 {
-    VALUE str, opts;
+    SSL *ssl;
+    struct ossl_ssl_data *data;
+    struct ossl_trace *trace;
+    struct ossl_trace_entry *entries;
+    unsigned long count, n, i;
+    uint64_t base;
+    rb_atomic_t seq;
+    VALUE ary, tmp;
 
-    rb_scan_args(argc, argv, "1:", &str, &opts);
+    GetSSL(self, ssl);
+    data = GetSSLData(ssl);
+    /* The buffer is only replaced with the GVL held */
+    if (!(trace = data->trace))
+        return Qnil;
+
+    /* Copy so that no Ruby object is allocated while reading the buffer */
+    entries = ALLOCV_N(struct ossl_trace_entry, tmp, trace->size);
+    do {
+        seq = ssl_data_read_begin(data);
+        count = trace->count;
+        n = count < trace->size ? count : trace->size;
+        for (i = 0; i < n; i++)
+            entries[i] = trace->entries[(count - n + i) % trace->size];
+        base = data->handshake_start;
+    } while (ssl_data_read_retry(data, seq));
+
+    ary = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++) {
+        uint64_t t = entries[i].time > base ? entries[i].time - base : 0;
+
+        rb_ary_push(ary, rb_ary_new_from_args(4,
+                                              DBL2NUM(t / 1e9),
+                                              entries[i].write_p ? sym_sent : sym_received,
+                                              ssl_trace_msg_name(&entries[i]),
+                                              UINT2NUM(entries[i].len)));
+    }
+    ALLOCV_END(tmp);
 
-    return ossl_ssl_write_internal(self, str, opts);
+    return ary;
 }
 
 /*
  * call-seq:
- *    ssl.stop => nil
+ *    ssl.handshake_trace = size or nil
  *
- * Sends "close notify" to the peer and tries to shut down the SSL connection
- * gracefully.
+ * Enables recording of the protocol messages into a buffer of _size_
+ * entries for this connection, overriding SSLContext#handshake_trace, or
+ * disables it if +nil+. Must be set before the handshake. The recorded
+ * messages are discarded.
  */
 static VALUE
-ossl_ssl_stop(VALUE self)
+ossl_ssl_set_handshake_trace(VALUE self, VALUE size)
 {
     SSL *ssl;
-    int ret;
 
     GetSSL(self, ssl);
-    if (!ssl_started(ssl))
-        return Qnil;
-    ret = SSL_shutdown(ssl);
-    if (ret == 1) /* Have already received close_notify */
-        return Qnil;
-    if (ret == 0) /* Sent close_notify, but we don't wait for reply */
-        return Qnil;
+    ssl_trace_resize(GetSSLData(ssl), NIL_P(size) ? 0 : NUM2UINT(size));
 
-    /*
-     * XXX: Something happened. Possibly it failed because the underlying socket
-     * is not writable/readable, since it is in non-blocking mode. We should do
-     * some proper error handling using SSL_get_error() and maybe retry, but we
-     * can't block here. Give up for now.
-     */
-    ossl_clear_error();
-    return Qnil;
+    return size;
 }
 
 /*
@@ -2458,6 +6513,17 @@ ossl_ssl_set_hostname(VALUE self, VALUE arg)
     if (!SSL_set_tlsext_host_name(ssl, hostname))
         ossl_raise(eSSLError, NULL);
 
+    if (GetSSLCTXData(SSL_get_SSL_CTX(ssl))->verify_hostname_native) {
+        X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+
+        /* An IP address is matched against iPAddress in subjectAltName */
+        if (!hostname || !X509_VERIFY_PARAM_set1_ip_asc(param, hostname)) {
+            if (!X509_VERIFY_PARAM_set1_ip(param, NULL, 0) ||
+                !X509_VERIFY_PARAM_set1_host(param, hostname, 0))
+                ossl_raise(eSSLError, "X509_VERIFY_PARAM_set1_host");
+        }
+    }
+
     /* for SSLSocket#hostname */
     rb_ivar_set(self, id_i_hostname, arg);
 
@@ -2727,6 +6793,131 @@ ossl_ssl_get_group(VALUE self)
 }
 #endif
 
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+/*
+ * call-seq:
+ *    ssl.cert_compression => String or nil
+ *
+ * Returns the name of the algorithm the server's certificate chain was
+ * compressed with in the current TLS session, or +nil+ if it was sent
+ * uncompressed. See SSLContext#cert_compression.
+ */
+static VALUE
+ossl_ssl_get_cert_compression(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    return cert_comp_alg_name(SSL_get_negotiated_server_cert_comp(ssl));
+}
+#endif
+
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+/*
+ * call-seq:
+ *    ssl.server_cert_type => String or nil
+ *
+ * Returns the type of the server's credential negotiated in the current
+ * TLS session, "x509" or "rpk". See SSLContext#server_cert_type.
+ */
+static VALUE
+ossl_ssl_get_server_cert_type(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    return cert_type_name(SSL_get_negotiated_server_cert_type(ssl));
+}
+
+/*
+ * call-seq:
+ *    ssl.client_cert_type => String or nil
+ *
+ * Returns the type of the client's credential negotiated in the current
+ * TLS session, "x509" or "rpk". See SSLContext#client_cert_type.
+ */
+static VALUE
+ossl_ssl_get_client_cert_type(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    return cert_type_name(SSL_get_negotiated_client_cert_type(ssl));
+}
+
+/*
+ * call-seq:
+ *    ssl.peer_rpk => PKey or nil
+ *
+ * Returns the raw public key sent by the peer, or +nil+ if the peer sent
+ * a certificate or nothing.
+ */
+static VALUE
+ossl_ssl_get_peer_rpk(VALUE self)
+{
+    SSL *ssl;
+    EVP_PKEY *pkey;
+
+    GetSSL(self, ssl);
+    pkey = SSL_get0_peer_rpk(ssl);
+    if (!pkey)
+        return Qnil;
+    EVP_PKEY_up_ref(pkey);
+    return ossl_pkey_wrap(pkey);
+}
+#endif
+
+/*
+ * Defines the methods that SSLSocket and SSLEngine share on _klass_.
+ */
+void
+ossl_ssl_define_common_methods(VALUE klass)
+{
+    rb_define_method(klass, "stats",      ossl_ssl_get_stats, 0);
+#if !defined(OPENSSL_NO_OCSP)
+    rb_define_method(klass, "ocsp_response", ossl_ssl_get_ocsp_response, 0);
+#endif
+    rb_define_method(klass, "handshake_trace", ossl_ssl_get_handshake_trace, 0);
+    rb_define_method(klass, "handshake_trace=", ossl_ssl_set_handshake_trace, 1);
+    rb_define_method(klass, "cert",       ossl_ssl_get_cert, 0);
+    rb_define_method(klass, "peer_cert",  ossl_ssl_get_peer_cert, 0);
+    rb_define_method(klass, "peer_cert_chain", ossl_ssl_get_peer_cert_chain, 0);
+    rb_define_method(klass, "ssl_version",    ossl_ssl_get_version, 0);
+    rb_define_method(klass, "cipher",     ossl_ssl_get_cipher, 0);
+    rb_define_method(klass, "state",      ossl_ssl_get_state, 0);
+    rb_define_method(klass, "pending",    ossl_ssl_pending, 0);
+    rb_define_method(klass, "session_reused?",    ossl_ssl_session_reused, 0);
+    /* implementation of #session is in lib/openssl/ssl.rb */
+    rb_define_method(klass, "session=",    ossl_ssl_set_session, 1);
+    rb_define_method(klass, "verify_result", ossl_ssl_get_verify_result, 0);
+    rb_define_method(klass, "client_ca", ossl_ssl_get_client_ca_list, 0);
+    /* #hostname is defined in lib/openssl/ssl.rb */
+    rb_define_method(klass, "hostname=", ossl_ssl_set_hostname, 1);
+    rb_define_method(klass, "finished_message", ossl_ssl_get_finished, 0);
+    rb_define_method(klass, "peer_finished_message", ossl_ssl_get_peer_finished, 0);
+    rb_define_method(klass, "tmp_key", ossl_ssl_tmp_key, 0);
+    rb_define_method(klass, "alpn_protocol", ossl_ssl_alpn_protocol, 0);
+    rb_define_method(klass, "export_keying_material", ossl_ssl_export_keying_material, -1);
+# ifdef OSSL_USE_NEXTPROTONEG
+    rb_define_method(klass, "npn_protocol", ossl_ssl_npn_protocol, 0);
+# endif
+#ifdef HAVE_SSL_GET0_PEER_SIGNATURE_NAME
+    rb_define_method(klass, "sigalg", ossl_ssl_get_sigalg, 0);
+    rb_define_method(klass, "peer_sigalg", ossl_ssl_get_peer_sigalg, 0);
+#endif
+#ifdef HAVE_SSL_GET0_GROUP_NAME
+    rb_define_method(klass, "group", ossl_ssl_get_group, 0);
+#endif
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    rb_define_method(klass, "cert_compression", ossl_ssl_get_cert_compression, 0);
+#endif
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    rb_define_method(klass, "server_cert_type", ossl_ssl_get_server_cert_type, 0);
+    rb_define_method(klass, "client_cert_type", ossl_ssl_get_client_cert_type, 0);
+    rb_define_method(klass, "peer_rpk", ossl_ssl_get_peer_rpk, 0);
+#endif
+}
+
 #endif /* !defined(OPENSSL_NO_SOCK) */
 
 void
@@ -2744,9 +6935,15 @@ Init_ossl_ssl(void)
     ossl_ssl_ex_ptr_idx = SSL_get_ex_new_index(0, (void *)"ossl_ssl_ex_ptr_idx", 0, 0, 0);
     if (ossl_ssl_ex_ptr_idx < 0)
         ossl_raise(rb_eRuntimeError, "SSL_get_ex_new_index");
+    ossl_ssl_ex_data_idx = SSL_get_ex_new_index(0, (void *)"ossl_ssl_ex_data_idx", 0, 0, 0);
+    if (ossl_ssl_ex_data_idx < 0)
+        ossl_raise(rb_eRuntimeError, "SSL_get_ex_new_index");
     ossl_sslctx_ex_ptr_idx = SSL_CTX_get_ex_new_index(0, (void *)"ossl_sslctx_ex_ptr_idx", 0, 0, 0);
     if (ossl_sslctx_ex_ptr_idx < 0)
         ossl_raise(rb_eRuntimeError, "SSL_CTX_get_ex_new_index");
+    ossl_sslctx_ex_data_idx = SSL_CTX_get_ex_new_index(0, (void *)"ossl_sslctx_ex_data_idx", 0, 0, ossl_sslctx_data_free);
+    if (ossl_sslctx_ex_data_idx < 0)
+        ossl_raise(rb_eRuntimeError, "SSL_CTX_get_ex_new_index");
 
     /* Document-module: OpenSSL::SSL
      *
@@ -2767,7 +6964,15 @@ Init_ossl_ssl(void)
     eSSLErrorWaitWritable = rb_define_class_under(mSSL, "SSLErrorWaitWritable", eSSLError);
     rb_include_module(eSSLErrorWaitWritable, rb_mWaitWritable);
 
+    /* Document-class: OpenSSL::SSL::SSLTimeoutError
+     *
+     * Raised when the _timeout_ or _deadline_ given to SSLSocket#connect,
+     * SSLSocket#accept, SSLSocket#sysread or SSLSocket#syswrite expires.
+     */
+    eSSLTimeoutError = rb_define_class_under(mSSL, "SSLTimeoutError", eSSLError);
+
     Init_ossl_ssl_session();
+    Init_ossl_ssl_session_cache();
 
     /* Document-class: OpenSSL::SSL::SSLContext
      *
@@ -2857,6 +7062,11 @@ Init_ossl_ssl(void)
      *
      * In order to make this work, verify_mode must be set to VERIFY_PEER and
      * the server hostname must be given by OpenSSL::SSL::SSLSocket#hostname=.
+     *
+     * If +true+, the certificate is checked with
+     * OpenSSL::SSL.verify_certificate_identity during the handshake. If
+     * +:native+, OpenSSL checks it instead, without calling into Ruby, using
+     * the same rules as OpenSSL::X509::Certificate#matches_host?.
      */
     rb_attr(cSSLContext, rb_intern_const("verify_hostname"), 1, 1, Qfalse);
 
@@ -2936,6 +7146,135 @@ Init_ossl_ssl(void)
      */
     rb_attr(cSSLContext, rb_intern_const("session_remove_cb"), 1, 1, Qfalse);
 
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    /*
+     * An Array of the certificate compression algorithms (RFC 8879) to use,
+     * in order of preference. The supported names are "zlib", "brotli" and
+     * "zstd", of which only those the OpenSSL library was built with take
+     * effect. An empty Array disables certificate compression. If +nil+, the
+     * default of the OpenSSL library is used.
+     *
+     * The certificate chain of the context is compressed once when the
+     * context is set up. See also SSLSocket#cert_compression and
+     * #cert_compression_stats.
+     */
+    rb_attr(cSSLContext, rb_intern_const("cert_compression"), 1, 1, Qfalse);
+#endif
+
+#ifdef HAVE_SSL_CTX_SET1_SERVER_CERT_TYPE
+    /*
+     * An Array of the types of credential the server may send (RFC 7250),
+     * "x509" or "rpk", in order of preference. On a server, these are the
+     * types it can send; on a client, the types it accepts. With "rpk", only
+     * the SubjectPublicKeyInfo is sent instead of the certificate chain, and
+     * #key suffices as the credential without #cert. If +nil+, only X.509
+     * certificates are used.
+     *
+     * A raw public key is verified against #expected_rpks.
+     *
+     * === Example
+     *
+     *   ctx.server_cert_type = ["rpk", "x509"]
+     */
+    rb_attr(cSSLContext, rb_intern_const("server_cert_type"), 1, 1, Qfalse);
+
+    /*
+     * Same as #server_cert_type, but for the credential of the client.
+     */
+    rb_attr(cSSLContext, rb_intern_const("client_cert_type"), 1, 1, Qfalse);
+
+    /*
+     * An Array of the public keys (PKey objects) the peer's credential is
+     * pinned to. A raw public key, or the key of a certificate, matching one
+     * of them is accepted without building or verifying a chain; the check
+     * is done by OpenSSL with DANE-EE records. #verify_mode must include
+     * VERIFY_PEER for a mismatch to fail the handshake.
+     */
+    rb_attr(cSSLContext, rb_intern_const("expected_rpks"), 1, 1, Qfalse);
+#endif
+
+    /*
+     * If set to an Integer, every connection created from the context
+     * records the time of each handshake message sent or received into a
+     * buffer of that many entries, without calling into Ruby. Retrieve it
+     * with SSLSocket#handshake_trace. To trace only some connections, set
+     * SSLSocket#handshake_trace= instead.
+     */
+    rb_attr(cSSLContext, rb_intern_const("handshake_trace"), 1, 1, Qfalse);
+
+#if !defined(OPENSSL_NO_OCSP)
+    /*
+     * If true, the client requests the server to staple an OCSP response
+     * for its certificate (the status_request extension). Retrieve it with
+     * SSLSocket#ocsp_response.
+     *
+     * See also #set_ocsp_response for the server side.
+     */
+    rb_attr(cSSLContext, rb_intern_const("ocsp_status_request"), 1, 1, Qfalse);
+#endif
+
+    /*
+     * Loads the server certificate for the host name sent by the client
+     * (SNI) on demand, instead of setting up every certificate in advance.
+     * Either a String or an object responding to #call.
+     *
+     * A String is a file name template containing "%s", which is replaced by
+     * the host name in lowercase. The file must contain the certificate in
+     * PEM format, followed by the intermediate certificates and the private
+     * key. Host names containing characters other than alphanumerics, '-',
+     * '_' and '.' are not looked up.
+     *
+     * An object responding to #call is called with the host name and returns
+     * either a String in the same format as the file, an Array of
+     * [certificate, private_key, [intermediate, ...]], or +nil+.
+     *
+     * If there is no file or the loader returns +nil+, the certificate of
+     * the context is used. The result is cached, see #cert_cache_size,
+     * #cert_cache_stats and #flush_cert_cache. A handshake for a cached host
+     * name does not call into Ruby.
+     *
+     *   ctx.cert_loader = "/etc/ssl/sites/%s.pem"
+     *   ctx.cert_loader = ->(hostname) { Tenant.find_by_domain(hostname)&.pem }
+     */
+    rb_attr(cSSLContext, rb_intern_const("cert_loader"), 1, 1, Qfalse);
+
+    /*
+     * The maximum number of host names whose certificates loaded by
+     * #cert_loader are cached. The least recently used one is removed when
+     * it is exceeded. Defaults to 1024.
+     */
+    rb_attr(cSSLContext, rb_intern_const("cert_cache_size"), 1, 1, Qfalse);
+
+#ifdef HAVE_SSL_READ_EARLY_DATA
+    /*
+     * A callback invoked on a server when a client sends TLS 1.3 early data,
+     * to decide whether to accept it, for example to implement an
+     * application-specific replay protection.
+     *
+     * The callback is invoked with the SSLSocket, on which #hostname and
+     * #session can be inspected. The early data is accepted if it returns a
+     * truthy value.
+     */
+    rb_attr(cSSLContext, rb_intern_const("allow_early_data_cb"), 1, 1, Qfalse);
+#endif
+
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+    /*
+     * An OpenSSL::SSL::SharedSessionCache to store the server-side sessions
+     * in, instead of the internal session cache. Cannot be combined with
+     * #session_get_cb, #session_new_cb and #session_remove_cb.
+     */
+    rb_attr(cSSLContext, rb_intern_const("shared_session_cache"), 1, 1, Qfalse);
+#endif
+
+    /*
+     * An OpenSSL::SSL::ClientSessionCache to store the client-side sessions
+     * in. When set, SSLSocket#connect resumes the most recent session
+     * negotiated with the same server, and sessions issued by the server are
+     * stored automatically. #session_new_cb is still called.
+     */
+    rb_attr(cSSLContext, rb_intern_const("client_session_cache"), 1, 1, Qfalse);
+
     /*
      * A callback invoked whenever a new handshake is initiated on an
      * established connection. May be used to disable renegotiation entirely.
@@ -3017,6 +7356,73 @@ Init_ossl_ssl(void)
      *   end
      */
     rb_attr(cSSLContext, rb_intern_const("alpn_select_cb"), 1, 1, Qfalse);
+    /*
+     * An Enumerable of Strings, the protocols supported by the server for
+     * Application-Layer Protocol Negotiation in the order of preference.
+     * The first one also offered by the client is selected without calling
+     * into Ruby. If there is none, #alpn_select_cb is called if it is set,
+     * otherwise the handshake fails with a no_application_protocol alert.
+     *
+     * === Example
+     *
+     *   ctx.alpn_preference = ["h2", "http/1.1"]
+     */
+    rb_attr(cSSLContext, rb_intern_const("alpn_preference"), 1, 1, Qfalse);
+
+    /*
+     * The maximum number of plaintext bytes in a record sent, between 512
+     * and 16384 (the default). Smaller records let the peer start
+     * decrypting earlier at the cost of more overhead.
+     */
+    rb_attr(cSSLContext, rb_intern_const("max_send_fragment"), 1, 1, Qfalse);
+
+#ifdef HAVE_SSL_CTX_SET_SPLIT_SEND_FRAGMENT
+    /*
+     * The size at which the data is split into records sent in parallel
+     * when #max_pipelines is larger than 1. Must not exceed
+     * #max_send_fragment.
+     */
+    rb_attr(cSSLContext, rb_intern_const("split_send_fragment"), 1, 1, Qfalse);
+#endif
+
+#ifdef HAVE_SSL_CTX_SET_MAX_PIPELINES
+    /*
+     * The maximum number of records encrypted or decrypted in parallel.
+     * Pipelining requires a cipher implementation that supports it, such as
+     * some engines; it is ignored otherwise.
+     */
+    rb_attr(cSSLContext, rb_intern_const("max_pipelines"), 1, 1, Qfalse);
+#endif
+
+#ifdef HAVE_SSL_CTX_SET_DEFAULT_READ_BUFFER_LEN
+    /*
+     * The initial size of the buffer for reading records, in bytes. A
+     * larger buffer reads more records with a single system call, which is
+     * mostly useful together with #max_pipelines.
+     */
+    rb_attr(cSSLContext, rb_intern_const("read_buffer_len"), 1, 1, Qfalse);
+#endif
+
+    /*
+     * Enables dynamic record sizing. Each burst of writes starts with small
+     * records that fit in a single TCP segment, which lowers the latency of
+     * the first bytes, and switches to records of #max_send_fragment bytes
+     * after the given number of bytes (64 KiB if +true+) for throughput. A
+     * burst ends after one second without writes.
+     *
+     * === Example
+     *
+     *   ctx.dynamic_record_sizing = 128 * 1024
+     */
+    rb_attr(cSSLContext, rb_intern_const("dynamic_record_sizing"), 1, 1, Qfalse);
+
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    /*
+     * The identity of the external PSK a client offers, one of the keys of
+     * #psk_keys=.
+     */
+    rb_attr(cSSLContext, rb_intern_const("psk_identity"), 1, 1, Qfalse);
+#endif
 
     /*
      * A callback invoked when TLS key material is generated or received, in
@@ -3041,6 +7447,36 @@ Init_ossl_ssl(void)
      */
     rb_attr(cSSLContext, rb_intern_const("keylog_cb"), 1, 1, Qfalse);
 
+    /*
+     * A file to append TLS key material to, in the format used by NSS for its
+     * SSLKEYLOGFILE debugging output. Either a path, which is created if
+     * necessary, or an IO or a file descriptor, which is duplicated.
+     *
+     * Unlike #keylog_cb, the lines are written from C without calling into
+     * Ruby. They are buffered and written out when a handshake completes or
+     * the connection is closed.
+     *
+     * Both may be set; then the lines are passed to both.
+     *
+     * === Example
+     *
+     *   context.keylog_file = ENV["SSLKEYLOGFILE"]
+     */
+    rb_attr(cSSLContext, rb_intern_const("keylog_file"), 1, 1, Qfalse);
+
+    /*
+     * Whether to perform the handshake in SSLSocket#connect, #accept and
+     * their non-blocking variants without holding the GVL, so that other
+     * Ruby threads can run while the CPU-heavy key exchange and signature
+     * operations are in progress. The default is +false+.
+     *
+     * The callbacks set on the SSLContext, such as #verify_callback,
+     * #servername_cb, and #alpn_select_cb, still work; the GVL is
+     * re-acquired only when one of them has to be called. They must not
+     * switch Fibers, which rules out using them with a Fiber scheduler.
+     */
+    rb_attr(cSSLContext, rb_intern_const("handshake_without_gvl"), 1, 1, Qfalse);
+
     rb_define_alias(cSSLContext, "ssl_timeout", "timeout");
     rb_define_alias(cSSLContext, "ssl_timeout=", "timeout=");
     rb_define_method(cSSLContext, "min_version=", ossl_sslctx_set_min_version, 1);
@@ -3061,6 +7497,10 @@ Init_ossl_ssl(void)
     rb_define_alias(cSSLContext, "ecdh_curves=", "groups=");
     rb_define_method(cSSLContext, "security_level", ossl_sslctx_get_security_level, 0);
     rb_define_method(cSSLContext, "security_level=", ossl_sslctx_set_security_level, 1);
+#ifdef HAVE_SSL_READ_EARLY_DATA
+    rb_define_method(cSSLContext, "max_early_data", ossl_sslctx_get_max_early_data, 0);
+    rb_define_method(cSSLContext, "max_early_data=", ossl_sslctx_set_max_early_data, 1);
+#endif
 #ifdef SSL_MODE_SEND_FALLBACK_SCSV
     rb_define_method(cSSLContext, "enable_fallback_scsv", ossl_sslctx_enable_fallback_scsv, 0);
 #endif
@@ -3124,6 +7564,27 @@ Init_ossl_ssl(void)
     rb_define_method(cSSLContext, "session_cache_size=",     ossl_sslctx_set_session_cache_size, 1);
     rb_define_method(cSSLContext, "session_cache_stats",     ossl_sslctx_get_session_cache_stats, 0);
     rb_define_method(cSSLContext, "flush_sessions",     ossl_sslctx_flush_sessions, -1);
+#ifdef HAVE_OPENSSL_LH_DOALL_ARG
+    rb_define_method(cSSLContext, "export_sessions", ossl_sslctx_export_sessions, 0);
+    rb_define_method(cSSLContext, "import_sessions", ossl_sslctx_import_sessions, 1);
+#endif
+    rb_define_method(cSSLContext, "session_ticket_keys=", ossl_sslctx_set_session_ticket_keys, 1);
+    rb_define_method(cSSLContext, "stats", ossl_sslctx_get_stats, 0);
+#if !defined(OPENSSL_NO_OCSP)
+    rb_define_method(cSSLContext, "set_ocsp_response", ossl_sslctx_set_ocsp_response, 2);
+    rb_define_method(cSSLContext, "ocsp_response_next_update", ossl_sslctx_get_ocsp_response_next_update, 1);
+#endif
+    rb_define_method(cSSLContext, "cert_cache_stats", ossl_sslctx_get_cert_cache_stats, 0);
+    rb_define_method(cSSLContext, "flush_cert_cache", ossl_sslctx_flush_cert_cache, 0);
+    rb_define_method(cSSLContext, "servername_contexts", ossl_sslctx_get_servername_contexts, 0);
+    rb_define_method(cSSLContext, "servername_contexts=", ossl_sslctx_set_servername_contexts, 1);
+#ifdef HAVE_SSL_CTX_SET_PSK_FIND_SESSION_CALLBACK
+    rb_define_method(cSSLContext, "psk_keys=", ossl_sslctx_set_psk_keys, 1);
+#endif
+    rb_define_method(cSSLContext, "session_ticket_key_stats", ossl_sslctx_get_session_ticket_key_stats, 0);
+#ifdef HAVE_SSL_CTX_COMPRESS_CERTS
+    rb_define_method(cSSLContext, "cert_compression_stats", ossl_sslctx_get_cert_compression_stats, 0);
+#endif
     rb_define_method(cSSLContext, "options",     ossl_sslctx_get_options, 0);
     rb_define_method(cSSLContext, "options=",     ossl_sslctx_set_options, 1);
 
@@ -3134,44 +7595,30 @@ Init_ossl_ssl(void)
     rb_define_alloc_func(cSSLSocket, ossl_ssl_s_alloc);
     rb_define_method(cSSLSocket, "initialize", ossl_ssl_initialize, -1);
     rb_undef_method(cSSLSocket, "initialize_copy");
-    rb_define_method(cSSLSocket, "connect",    ossl_ssl_connect, 0);
+    rb_define_method(cSSLSocket, "connect",    ossl_ssl_connect, -1);
     rb_define_method(cSSLSocket, "connect_nonblock",    ossl_ssl_connect_nonblock, -1);
-    rb_define_method(cSSLSocket, "accept",     ossl_ssl_accept, 0);
+    rb_define_method(cSSLSocket, "accept",     ossl_ssl_accept, -1);
     rb_define_method(cSSLSocket, "accept_nonblock", ossl_ssl_accept_nonblock, -1);
     rb_define_method(cSSLSocket, "sysread",    ossl_ssl_read, -1);
     rb_define_private_method(cSSLSocket, "sysread_nonblock",    ossl_ssl_read_nonblock, -1);
-    rb_define_method(cSSLSocket, "syswrite",   ossl_ssl_write, 1);
+    rb_define_private_method(cSSLSocket, "fill_rbuff",    ossl_ssl_fill_rbuff, 0);
+    rb_define_method(cSSLSocket, "syswrite",   ossl_ssl_write, -1);
     rb_define_private_method(cSSLSocket, "syswrite_nonblock",    ossl_ssl_write_nonblock, -1);
-    rb_define_private_method(cSSLSocket, "stop",   ossl_ssl_stop, 0);
-    rb_define_method(cSSLSocket, "cert",       ossl_ssl_get_cert, 0);
-    rb_define_method(cSSLSocket, "peer_cert",  ossl_ssl_get_peer_cert, 0);
-    rb_define_method(cSSLSocket, "peer_cert_chain", ossl_ssl_get_peer_cert_chain, 0);
-    rb_define_method(cSSLSocket, "ssl_version",    ossl_ssl_get_version, 0);
-    rb_define_method(cSSLSocket, "cipher",     ossl_ssl_get_cipher, 0);
-    rb_define_method(cSSLSocket, "state",      ossl_ssl_get_state, 0);
-    rb_define_method(cSSLSocket, "pending",    ossl_ssl_pending, 0);
-    rb_define_method(cSSLSocket, "session_reused?",    ossl_ssl_session_reused, 0);
-    /* implementation of OpenSSL::SSL::SSLSocket#session is in lib/openssl/ssl.rb */
-    rb_define_method(cSSLSocket, "session=",    ossl_ssl_set_session, 1);
-    rb_define_method(cSSLSocket, "verify_result", ossl_ssl_get_verify_result, 0);
-    rb_define_method(cSSLSocket, "client_ca", ossl_ssl_get_client_ca_list, 0);
-    /* #hostname is defined in lib/openssl/ssl.rb */
-    rb_define_method(cSSLSocket, "hostname=", ossl_ssl_set_hostname, 1);
-    rb_define_method(cSSLSocket, "finished_message", ossl_ssl_get_finished, 0);
-    rb_define_method(cSSLSocket, "peer_finished_message", ossl_ssl_get_peer_finished, 0);
-    rb_define_method(cSSLSocket, "tmp_key", ossl_ssl_tmp_key, 0);
-    rb_define_method(cSSLSocket, "alpn_protocol", ossl_ssl_alpn_protocol, 0);
-    rb_define_method(cSSLSocket, "export_keying_material", ossl_ssl_export_keying_material, -1);
-# ifdef OSSL_USE_NEXTPROTONEG
-    rb_define_method(cSSLSocket, "npn_protocol", ossl_ssl_npn_protocol, 0);
-# endif
-#ifdef HAVE_SSL_GET0_PEER_SIGNATURE_NAME
-    rb_define_method(cSSLSocket, "sigalg", ossl_ssl_get_sigalg, 0);
-    rb_define_method(cSSLSocket, "peer_sigalg", ossl_ssl_get_peer_sigalg, 0);
+    rb_define_private_method(cSSLSocket, "syswritev",    ossl_ssl_syswritev, 1);
+#ifdef HAVE_SSL_SENDFILE
+    rb_define_private_method(cSSLSocket, "syssendfile",    ossl_ssl_syssendfile, 3);
 #endif
-#ifdef HAVE_SSL_GET0_GROUP_NAME
-    rb_define_method(cSSLSocket, "group", ossl_ssl_get_group, 0);
+#ifdef HAVE_SSL_READ_EARLY_DATA
+    rb_define_method(cSSLSocket, "write_early_data", ossl_ssl_write_early_data, 1);
+    rb_define_method(cSSLSocket, "read_early_data", ossl_ssl_read_early_data, -1);
+    rb_define_method(cSSLSocket, "early_data_status", ossl_ssl_get_early_data_status, 0);
 #endif
+    rb_define_method(cSSLSocket, "ktls_send?", ossl_ssl_ktls_send_p, 0);
+    rb_define_method(cSSLSocket, "ktls_recv?", ossl_ssl_ktls_recv_p, 0);
+    rb_define_private_method(cSSLSocket, "stop",   ossl_ssl_stop, 0);
+    ossl_ssl_define_common_methods(cSSLSocket);
+
+    Init_ossl_ssl_engine();
 
     rb_define_const(mSSL, "VERIFY_NONE", INT2NUM(SSL_VERIFY_NONE));
     rb_define_const(mSSL, "VERIFY_PEER", INT2NUM(SSL_VERIFY_PEER));
@@ -3199,6 +7646,9 @@ Init_ossl_ssl(void)
 #endif
 #ifdef SSL_OP_ALLOW_NO_DHE_KEX /* OpenSSL 1.1.1, missing in LibreSSL */
     rb_define_const(mSSL, "OP_ALLOW_NO_DHE_KEX", ULONG2NUM(SSL_OP_ALLOW_NO_DHE_KEX));
+#endif
+#ifdef SSL_OP_PREFER_NO_DHE_KEX /* OpenSSL 3.3 */
+    rb_define_const(mSSL, "OP_PREFER_NO_DHE_KEX", ULONG2NUM(SSL_OP_PREFER_NO_DHE_KEX));
 #endif
     rb_define_const(mSSL, "OP_DONT_INSERT_EMPTY_FRAGMENTS", ULONG2NUM(SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS));
     rb_define_const(mSSL, "OP_NO_TICKET", ULONG2NUM(SSL_OP_NO_TICKET));
@@ -3216,6 +7666,10 @@ Init_ossl_ssl(void)
 #endif
 #ifdef SSL_OP_NO_ANTI_REPLAY /* OpenSSL 1.1.1, missing in LibreSSL */
     rb_define_const(mSSL, "OP_NO_ANTI_REPLAY", ULONG2NUM(SSL_OP_NO_ANTI_REPLAY));
+#endif
+#ifdef SSL_OP_NO_TX_CERTIFICATE_COMPRESSION /* OpenSSL 3.2 */
+    rb_define_const(mSSL, "OP_NO_TX_CERTIFICATE_COMPRESSION", ULONG2NUM(SSL_OP_NO_TX_CERTIFICATE_COMPRESSION));
+    rb_define_const(mSSL, "OP_NO_RX_CERTIFICATE_COMPRESSION", ULONG2NUM(SSL_OP_NO_RX_CERTIFICATE_COMPRESSION));
 #endif
     rb_define_const(mSSL, "OP_NO_SSLv3", ULONG2NUM(SSL_OP_NO_SSLv3));
     rb_define_const(mSSL, "OP_NO_TLSv1", ULONG2NUM(SSL_OP_NO_TLSv1));
@@ -3293,6 +7747,9 @@ Init_ossl_ssl(void)
     sym_exception = ID2SYM(rb_intern_const("exception"));
     sym_wait_readable = ID2SYM(rb_intern_const("wait_readable"));
     sym_wait_writable = ID2SYM(rb_intern_const("wait_writable"));
+    sym_native = ID2SYM(rb_intern_const("native"));
+    sym_sent = ID2SYM(rb_intern_const("sent"));
+    sym_received = ID2SYM(rb_intern_const("received"));
 
     id_npn_protocols_encoded = rb_intern_const("npn_protocols_encoded");
     id_each = rb_intern_const("each");
@@ -3315,18 +7772,40 @@ Init_ossl_ssl(void)
     DefIVarID(timeout);
     DefIVarID(session_id_context);
     DefIVarID(session_get_cb);
+    DefIVarID(shared_session_cache);
+    DefIVarID(client_session_cache);
+    DefIVarID(allow_early_data_cb);
+    DefIVarID(cert_compression);
+    DefIVarID(cert_loader);
+    DefIVarID(cert_cache_size);
     DefIVarID(session_new_cb);
     DefIVarID(session_remove_cb);
     DefIVarID(npn_select_cb);
     DefIVarID(npn_protocols);
     DefIVarID(alpn_protocols);
     DefIVarID(alpn_select_cb);
+    DefIVarID(alpn_preference);
+    DefIVarID(max_send_fragment);
+    DefIVarID(split_send_fragment);
+    DefIVarID(max_pipelines);
+    DefIVarID(read_buffer_len);
+    DefIVarID(dynamic_record_sizing);
+    DefIVarID(psk_identity);
+    DefIVarID(server_cert_type);
+    DefIVarID(client_cert_type);
+    DefIVarID(expected_rpks);
+    DefIVarID(handshake_trace);
+    DefIVarID(ocsp_status_request);
     DefIVarID(servername_cb);
     DefIVarID(verify_hostname);
     DefIVarID(keylog_cb);
+    DefIVarID(keylog_file);
     DefIVarID(tmp_dh_callback);
+    DefIVarID(handshake_without_gvl);
 
     DefIVarID(io);
+    DefIVarID(rbuffer);
+    DefIVarID(eof);
     DefIVarID(context);
     DefIVarID(hostname);
     DefIVarID(sync_close);
@@ -27,10 +27,36 @@
 extern const rb_data_type_t ossl_ssl_type;
 extern const rb_data_type_t ossl_ssl_session_type;
 extern VALUE mSSL;
+extern VALUE eSSLError;
+extern VALUE cSSLContext;
 extern VALUE cSSLSocket;
+extern VALUE cSSLEngine;
 extern VALUE cSSLSession;
 
+#if !defined(OPENSSL_NO_SOCK) && defined(HAVE_SYS_MMAN_H) && \
+    defined(HAVE_RUBY_ATOMIC_H)
+# define OSSL_USE_SHARED_SESSION_CACHE
+struct ossl_scache;
+extern VALUE cSSLSharedSessionCache;
+struct ossl_scache *ossl_scache_ref(VALUE obj);
+void ossl_scache_release(struct ossl_scache *cache);
+void ossl_scache_store(struct ossl_scache *cache, SSL_SESSION *sess);
+SSL_SESSION *ossl_scache_lookup(struct ossl_scache *cache, const unsigned char *id, int id_len);
+void ossl_scache_remove(struct ossl_scache *cache, SSL_SESSION *sess);
+#endif
+
+#ifndef OPENSSL_NO_SOCK
+SSL *ossl_ssl_new(VALUE self, VALUE v_ctx);
+VALUE ossl_ssl_s_alloc(VALUE klass);
+void ossl_ssl_define_common_methods(VALUE klass);
+int ossl_ssl_dyn_record_begin(SSL *ssl, int num);
+void ossl_ssl_dyn_record_end(SSL *ssl, int num, int ret);
+void ossl_ssl_stats_update(const SSL *ssl, long nread, long nwritten, int code);
+#endif
+
 void Init_ossl_ssl(void);
 void Init_ossl_ssl_session(void);
+void Init_ossl_ssl_session_cache(void);
+void Init_ossl_ssl_engine(void);
 
 #endif /* _OSSL_SSL_H_ */
@@ -0,0 +1,362 @@
+/*
+ * This program is licensed under the same licence as Ruby.
+ * (See the file 'COPYING'.)
+ */
+#include "ossl.h"
+
+#ifndef OPENSSL_NO_SOCK
+VALUE cSSLEngine;
+
+static ID ID_callback_state;
+static VALUE sym_wait_readable, sym_wait_writable;
+
+/*
+ * call-seq:
+ *    SSLEngine.new(ctx = SSLContext.new, server: false) => engine
+ *
+ * Creates a new TLS engine. If _server_ is true, the engine acts as the
+ * server side of the connection, otherwise as the client side.
+ *
+ * The SSLContext _ctx_ is frozen like SSLSocket.new does.
+ */
+static VALUE
+ossl_ssl_engine_initialize(int argc, VALUE *argv, VALUE self)
+{
+    static ID kw_ids[1];
+    VALUE kw_args[1];
+    VALUE opts, v_ctx;
+    SSL *ssl;
+    BIO *rbio, *wbio;
+
+    TypedData_Get_Struct(self, SSL, &ossl_ssl_type, ssl);
+    if (ssl)
+        ossl_raise(eSSLError, "SSL already initialized");
+
+    if (rb_scan_args(argc, argv, "01:", &v_ctx, &opts) == 0)
+        v_ctx = rb_funcall(cSSLContext, rb_intern("new"), 0);
+
+    if (!kw_ids[0]) {
+        kw_ids[0] = rb_intern_const("server");
+    }
+    rb_get_kwargs(opts, kw_ids, 0, 1, kw_args);
+
+    ssl = ossl_ssl_new(self, v_ctx);
+
+    rbio = BIO_new(BIO_s_mem());
+    wbio = BIO_new(BIO_s_mem());
+    if (!rbio || !wbio) {
+        BIO_free(rbio);
+        BIO_free(wbio);
+        ossl_raise(eSSLError, "BIO_new");
+    }
+    SSL_set_bio(ssl, rbio, wbio);
+    if (kw_args[0] != Qundef && RTEST(kw_args[0]))
+        SSL_set_accept_state(ssl);
+    else
+        SSL_set_connect_state(ssl);
+
+    return self;
+}
+
+/*
+ * Checks the result of an SSL_* call made by SSLEngine. Returns Qundef if
+ * the call succeeded, :wait_readable or :wait_writable if more data has to be
+ * fed or drained, and nil if the peer has closed the connection.
+ */
+static VALUE
+ossl_ssl_engine_check(VALUE self, SSL *ssl, int ret, const char *funcname)
+{
+    VALUE cb_state;
+    int code = SSL_get_error(ssl, ret);
+
+    ossl_ssl_stats_update(ssl, 0, 0, code);
+    cb_state = rb_attr_get(self, ID_callback_state);
+    if (!NIL_P(cb_state)) {
+        rb_ivar_set(self, ID_callback_state, Qnil);
+        ossl_clear_error();
+        rb_jump_tag(NUM2INT(cb_state));
+    }
+
+    switch (code) {
+      case SSL_ERROR_NONE:
+        return Qundef;
+      case SSL_ERROR_WANT_READ:
+        return sym_wait_readable;
+      case SSL_ERROR_WANT_WRITE:
+        return sym_wait_writable;
+      case SSL_ERROR_ZERO_RETURN:
+        return Qnil;
+      default:
+        ossl_raise(eSSLError, "%s", funcname);
+    }
+}
+
+/*
+ * call-seq:
+ *    engine.feed(string) => integer
+ *
+ * Passes ciphertext received from the peer to the engine. Returns the number
+ * of bytes consumed, which is always the size of _string_.
+ */
+static VALUE
+ossl_ssl_engine_feed(VALUE self, VALUE str)
+{
+    SSL *ssl;
+    int len;
+
+    GetSSL(self, ssl);
+    StringValue(str);
+    len = RSTRING_LENINT(str);
+    if (len == 0)
+        return INT2FIX(0);
+    if (BIO_write(SSL_get_rbio(ssl), RSTRING_PTR(str), len) != len)
+        ossl_raise(eSSLError, "BIO_write");
+    return INT2NUM(len);
+}
+
+/*
+ * call-seq:
+ *    engine.drain(maxlen = nil, buffer = nil) => string or nil
+ *
+ * Takes at most _maxlen_ bytes, or everything if _maxlen_ is +nil+, of the
+ * ciphertext that is to be sent to the peer. If a _buffer_ String is given,
+ * the data is written into it. Returns +nil+ if there is nothing to send.
+ */
+static VALUE
+ossl_ssl_engine_drain(int argc, VALUE *argv, VALUE self)
+{
+    SSL *ssl;
+    BIO *wbio;
+    VALUE maxlen, str;
+    long len;
+    int nread;
+
+    rb_scan_args(argc, argv, "02", &maxlen, &str);
+    GetSSL(self, ssl);
+    wbio = SSL_get_wbio(ssl);
+    len = (long)BIO_ctrl_pending(wbio);
+    if (!NIL_P(maxlen) && NUM2LONG(maxlen) < len)
+        len = NUM2LONG(maxlen);
+    if (len <= 0)
+        return Qnil;
+    if (len > INT_MAX)
+        len = INT_MAX;
+
+    if (NIL_P(str))
+        str = rb_str_new(0, len);
+    else {
+        StringValue(str);
+        rb_str_resize(str, len);
+    }
+    nread = BIO_read(wbio, RSTRING_PTR(str), (int)len);
+    if (nread <= 0)
+        ossl_raise(eSSLError, "BIO_read");
+    rb_str_set_len(str, nread);
+    return str;
+}
+
+/*
+ * call-seq:
+ *    engine.pending_output => integer
+ *
+ * Returns the number of bytes of ciphertext waiting to be drained.
+ */
+static VALUE
+ossl_ssl_engine_pending_output(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    return SIZET2NUM(BIO_ctrl_pending(SSL_get_wbio(ssl)));
+}
+
+/*
+ * call-seq:
+ *    engine.handshake => true, :wait_readable, or :wait_writable
+ *
+ * Advances the TLS handshake with the data fed so far. Returns +true+ when
+ * the handshake has completed, or :wait_readable if more data from the peer
+ * is needed. In either case, the ciphertext produced must be sent to the
+ * peer with #drain.
+ */
+static VALUE
+ossl_ssl_engine_handshake(VALUE self)
+{
+    SSL *ssl;
+    VALUE ret;
+
+    GetSSL(self, ssl);
+    rb_ivar_set(self, ID_callback_state, Qnil);
+    ret = ossl_ssl_engine_check(self, ssl, SSL_do_handshake(ssl), "SSL_do_handshake");
+    if (ret == Qundef)
+        return Qtrue;
+    if (NIL_P(ret))
+        ossl_raise(eSSLError, "SSL_do_handshake: connection closed by the peer");
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    engine.handshake_completed? => true or false
+ */
+static VALUE
+ossl_ssl_engine_handshake_completed_p(VALUE self)
+{
+    SSL *ssl;
+
+    GetSSL(self, ssl);
+    return SSL_is_init_finished(ssl) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    engine.read(maxlen, buffer = nil) => string, :wait_readable, or nil
+ *
+ * Reads at most _maxlen_ bytes of plaintext decrypted from the data fed so
+ * far. If a _buffer_ String is given, the data is written into it. Returns
+ * :wait_readable if a full record is not available yet, and +nil+ if the
+ * peer has sent close_notify.
+ *
+ * The handshake is performed implicitly if it is not completed yet.
+ */
+static VALUE
+ossl_ssl_engine_read(int argc, VALUE *argv, VALUE self)
+{
+    SSL *ssl;
+    VALUE len, str, ret;
+    int ilen, nread;
+
+    rb_scan_args(argc, argv, "11", &len, &str);
+    GetSSL(self, ssl);
+    ilen = NUM2INT(len);
+    if (NIL_P(str))
+        str = rb_str_new(0, ilen);
+    else {
+        StringValue(str);
+        if (RSTRING_LEN(str) >= ilen)
+            rb_str_modify(str);
+        else
+            rb_str_modify_expand(str, ilen - RSTRING_LEN(str));
+    }
+    if (ilen == 0) {
+        rb_str_set_len(str, 0);
+        return str;
+    }
+
+    rb_ivar_set(self, ID_callback_state, Qnil);
+    nread = SSL_read(ssl, RSTRING_PTR(str), ilen);
+    ret = ossl_ssl_engine_check(self, ssl, nread, "SSL_read");
+    if (ret != Qundef)
+        return ret;
+    ossl_ssl_stats_update(ssl, nread, 0, SSL_ERROR_NONE);
+    rb_str_set_len(str, nread);
+    return str;
+}
+
+/*
+ * call-seq:
+ *    engine.write(string) => integer or :wait_readable
+ *
+ * Encrypts _string_. Returns the number of bytes consumed, which is always
+ * the size of _string_ once the handshake has completed. The resulting
+ * ciphertext must be sent to the peer with #drain.
+ */
+static VALUE
+ossl_ssl_engine_write(VALUE self, VALUE str)
+{
+    SSL *ssl;
+    VALUE ret;
+    int len, nwritten, total = 0;
+
+    GetSSL(self, ssl);
+    StringValue(str);
+    len = RSTRING_LENINT(str);
+
+    rb_ivar_set(self, ID_callback_state, Qnil);
+    while (total < len) {
+        int num = ossl_ssl_dyn_record_begin(ssl, len - total);
+
+        nwritten = SSL_write(ssl, RSTRING_PTR(str) + total, num);
+        ossl_ssl_dyn_record_end(ssl, num, nwritten);
+        ret = ossl_ssl_engine_check(self, ssl, nwritten, "SSL_write");
+        if (ret != Qundef) {
+            if (total)
+                break;
+            if (NIL_P(ret))
+                ossl_raise(eSSLError, "SSL_write: connection closed by the peer");
+            return ret;
+        }
+        ossl_ssl_stats_update(ssl, 0, nwritten, SSL_ERROR_NONE);
+        total += nwritten;
+    }
+    return INT2NUM(total);
+}
+
+/*
+ * call-seq:
+ *    engine.shutdown => true or false
+ *
+ * Sends close_notify to the peer. Returns +true+ if the peer's close_notify
+ * has also been received, or +false+ otherwise. The alert must be sent to
+ * the peer with #drain.
+ */
+static VALUE
+ossl_ssl_engine_shutdown(VALUE self)
+{
+    SSL *ssl;
+    int ret;
+
+    GetSSL(self, ssl);
+    if (!SSL_is_init_finished(ssl))
+        return Qfalse;
+    rb_ivar_set(self, ID_callback_state, Qnil);
+    ret = SSL_shutdown(ssl);
+    if (ret < 0 && ossl_ssl_engine_check(self, ssl, ret, "SSL_shutdown") != sym_wait_readable)
+        return Qfalse;
+    return ret == 1 ? Qtrue : Qfalse;
+}
+
+#endif /* !defined(OPENSSL_NO_SOCK) */
+
+void
+Init_ossl_ssl_engine(void)
+{
+#ifndef OPENSSL_NO_SOCK
+    ID_callback_state = rb_intern_const("callback_state");
+    sym_wait_readable = ID2SYM(rb_intern_const("wait_readable"));
+    sym_wait_writable = ID2SYM(rb_intern_const("wait_writable"));
+
+    /*
+     * Document-class: OpenSSL::SSL::SSLEngine
+     *
+     * A TLS connection that is not bound to a socket. The engine reads and
+     * writes ciphertext through memory buffers: the caller passes bytes
+     * received from the peer to #feed, and sends the bytes taken with #drain.
+     * No method blocks or waits for I/O, so an event loop can drive many
+     * connections over any transport.
+     *
+     *   engine = OpenSSL::SSL::SSLEngine.new(ctx)
+     *   engine.hostname = "example.com"
+     *   until engine.handshake == true
+     *     transport.send(engine.drain) if engine.pending_output > 0
+     *     engine.feed(transport.receive)
+     *   end
+     *   transport.send(engine.drain) if engine.pending_output > 0
+     *   engine.write("GET / HTTP/1.0\r\n\r\n")
+     *   transport.send(engine.drain)
+     */
+    cSSLEngine = rb_define_class_under(mSSL, "SSLEngine", rb_cObject);
+    rb_define_alloc_func(cSSLEngine, ossl_ssl_s_alloc);
+    rb_define_method(cSSLEngine, "initialize", ossl_ssl_engine_initialize, -1);
+    rb_undef_method(cSSLEngine, "initialize_copy");
+    rb_define_method(cSSLEngine, "feed", ossl_ssl_engine_feed, 1);
+    rb_define_method(cSSLEngine, "drain", ossl_ssl_engine_drain, -1);
+    rb_define_method(cSSLEngine, "pending_output", ossl_ssl_engine_pending_output, 0);
+    rb_define_method(cSSLEngine, "handshake", ossl_ssl_engine_handshake, 0);
+    rb_define_method(cSSLEngine, "handshake_completed?", ossl_ssl_engine_handshake_completed_p, 0);
+    rb_define_method(cSSLEngine, "read", ossl_ssl_engine_read, -1);
+    rb_define_method(cSSLEngine, "write", ossl_ssl_engine_write, 1);
+    rb_define_method(cSSLEngine, "shutdown", ossl_ssl_engine_shutdown, 0);
+    ossl_ssl_define_common_methods(cSSLEngine);
+#endif
+}
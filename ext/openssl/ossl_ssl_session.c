@@ -43,7 +43,7 @@ ossl_ssl_session_initialize(VALUE self, VALUE arg1)
     if (RTYPEDDATA_DATA(self))
         ossl_raise(eSSLSession, "SSL Session already initialized");
 
-    if (rb_obj_is_instance_of(arg1, cSSLSocket)) {
+    if (rb_typeddata_is_kind_of(arg1, &ossl_ssl_type)) {
         SSL *ssl;
 
         GetSSL(arg1, ssl);
@@ -223,6 +223,26 @@ static VALUE ossl_ssl_session_get_id(VALUE self)
     return rb_str_new((const char *) p, i);
 }
 
+#ifdef HAVE_SSL_READ_EARLY_DATA
+/*
+ * call-seq:
+ *    session.max_early_data -> Integer
+ *
+ * Returns the maximum number of bytes of TLS 1.3 early data the server
+ * accepts when resuming the session, or 0 if early data is not allowed. See
+ * SSLSocket#write_early_data.
+ */
+static VALUE
+ossl_ssl_session_get_max_early_data(VALUE self)
+{
+    SSL_SESSION *ctx;
+
+    GetSSLSession(self, ctx);
+
+    return UINT2NUM(SSL_SESSION_get_max_early_data(ctx));
+}
+#endif
+
 /*
  * call-seq:
  *    session.to_der -> String
@@ -320,6 +340,9 @@ void Init_ossl_ssl_session(void)
     rb_define_method(cSSLSession, "timeout", ossl_ssl_session_get_timeout, 0);
     rb_define_method(cSSLSession, "timeout=", ossl_ssl_session_set_timeout, 1);
     rb_define_method(cSSLSession, "id", ossl_ssl_session_get_id, 0);
+#ifdef HAVE_SSL_READ_EARLY_DATA
+    rb_define_method(cSSLSession, "max_early_data", ossl_ssl_session_get_max_early_data, 0);
+#endif
     rb_define_method(cSSLSession, "to_der", ossl_ssl_session_to_der, 0);
     rb_define_method(cSSLSession, "to_pem", ossl_ssl_session_to_pem, 0);
     rb_define_method(cSSLSession, "to_text", ossl_ssl_session_to_text, 0);
@@ -0,0 +1,603 @@
+/*
+ * This program is licensed under the same licence as Ruby.
+ * (See the file 'COPYING'.)
+ */
+#include "ossl.h"
+
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+#include <ruby/atomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef RUBY_ATOMIC_LOAD
+# define RUBY_ATOMIC_LOAD(var) RUBY_ATOMIC_FETCH_ADD((var), 0)
+#endif
+
+/*
+ * The cache file consists of a header, the clock hands of each set, and the
+ * slots. Sessions are stored in a set chosen by the hash of the session ID,
+ * in one of SCACHE_WAYS slots.
+ *
+ * Each slot is protected by a sequence counter which is odd while the slot is
+ * being written. Readers never block: they copy the slot and retry if the
+ * counter has changed meanwhile. A writer that finds the slot locked by
+ * another writer gives up instead of waiting.
+ *
+ * A writer that dies while holding the lock would leave the slot locked
+ * forever, also across restarts when the cache is backed by a file. The time
+ * the lock was taken is therefore recorded, and a lock held for longer than
+ * SCACHE_LOCK_TIMEOUT seconds is taken over by the next writer. If the
+ * original writer was only slow, it may still write to the slot after that;
+ * it then finds that it can no longer unlock the slot and discards the entry.
+ * Readers check the session ID of the decoded session so that such a mixed
+ * entry is never used for another session.
+ */
+#define SCACHE_MAGIC 0x53534352 /* "RSSS" */
+#define SCACHE_VERSION 2
+#define SCACHE_WAYS 8
+#define SCACHE_ALIGN 64
+#define SCACHE_READ_RETRIES 4
+#define SCACHE_LOCK_TIMEOUT 2
+
+struct scache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nsets;
+    uint32_t slot_size;
+    rb_atomic_t hits;
+    rb_atomic_t misses;
+    rb_atomic_t stores;
+    rb_atomic_t evictions;
+};
+
+struct scache_slot {
+    rb_atomic_t seq;
+    rb_atomic_t ref; /* reference bit for the clock eviction */
+    rb_atomic_t locked_at; /* time(NULL) when seq was last made odd */
+    uint32_t id_len;
+    uint32_t der_len;
+    int64_t expires;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[1];
+};
+
+#define SCACHE_SLOT_HEADER_SIZE offsetof(struct scache_slot, der)
+
+struct ossl_scache {
+    char *map;
+    size_t map_size;
+    struct scache_header *hdr;
+    rb_atomic_t *hands;
+    char *slots;
+    uint32_t nsets;
+    uint32_t slot_size;
+    int refcnt;
+};
+
+#define SCACHE_SLOT(c, i) \
+    ((struct scache_slot *)((c)->slots + (size_t)(i) * (c)->slot_size))
+#define SCACHE_CAPACITY(c) ((c)->slot_size - SCACHE_SLOT_HEADER_SIZE)
+
+VALUE cSSLSharedSessionCache;
+
+static size_t
+scache_align(size_t n)
+{
+    return (n + SCACHE_ALIGN - 1) & ~(size_t)(SCACHE_ALIGN - 1);
+}
+
+static uint32_t
+scache_hash(const unsigned char *id, unsigned int len)
+{
+    uint32_t h = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ id[i]) * 16777619U;
+    return h;
+}
+
+static rb_atomic_t
+scache_slot_lock(struct scache_slot *slot)
+{
+    rb_atomic_t seq = RUBY_ATOMIC_LOAD(slot->seq), next = seq + 1;
+    rb_atomic_t now = (rb_atomic_t)time(NULL);
+
+    if (seq & 1) {
+        /* Locked by another writer; take the lock over if it is stale */
+        if ((int32_t)(now - RUBY_ATOMIC_LOAD(slot->locked_at)) < SCACHE_LOCK_TIMEOUT)
+            return 0;
+        next = seq + 2;
+    }
+    /*
+     * Recorded before taking the lock, so that the lock never appears older
+     * than it is to a writer seeing the new sequence number.
+     */
+    RUBY_ATOMIC_SET(slot->locked_at, now);
+    if (RUBY_ATOMIC_CAS(slot->seq, seq, next) != seq)
+        return 0;
+    if (seq & 1)
+        slot->id_len = 0; /* may have been left half-written */
+    return next;
+}
+
+/*
+ * Returns 0 if the lock has been taken over in the meantime.
+ */
+static int
+scache_slot_unlock(struct scache_slot *slot, rb_atomic_t seq)
+{
+    return RUBY_ATOMIC_CAS(slot->seq, seq, seq + 1) == seq;
+}
+
+void
+ossl_scache_release(struct ossl_scache *c)
+{
+    if (--c->refcnt > 0)
+        return;
+    if (c->map)
+        munmap(c->map, c->map_size);
+    ruby_xfree(c);
+}
+
+/*
+ * Stores _sess_ in the cache, replacing an entry for the same session ID, an
+ * expired entry, or the least recently used one in the set. Called by the
+ * SSL_CTX's new session callback, possibly without the GVL.
+ */
+void
+ossl_scache_store(struct ossl_scache *c, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned int id_len;
+    struct scache_slot *slot, *victim = NULL, *unused = NULL;
+    unsigned char *p;
+    rb_atomic_t seq;
+    uint32_t set;
+    int64_t now = (int64_t)time(NULL);
+    int len, i, evict = 0;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
+    len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0 || (size_t)len > SCACHE_CAPACITY(c))
+        return;
+
+    set = scache_hash(id, id_len) % c->nsets;
+    for (i = 0; i < SCACHE_WAYS; i++) {
+        slot = SCACHE_SLOT(c, set * SCACHE_WAYS + i);
+        if (slot->id_len == id_len && !memcmp(slot->id, id, id_len)) {
+            victim = slot;
+            break;
+        }
+        if (!unused && (slot->id_len == 0 || slot->expires <= now))
+            unused = slot;
+    }
+    if (!victim)
+        victim = unused;
+    if (!victim) {
+        /* Second chance: skip the slots read since the hand last passed */
+        for (i = 0; i < 2 * SCACHE_WAYS; i++) {
+            rb_atomic_t hand = RUBY_ATOMIC_FETCH_ADD(c->hands[set], 1);
+
+            victim = SCACHE_SLOT(c, set * SCACHE_WAYS + hand % SCACHE_WAYS);
+            if (!RUBY_ATOMIC_EXCHANGE(victim->ref, 0))
+                break;
+        }
+        evict = 1;
+    }
+
+    if (!(seq = scache_slot_lock(victim)))
+        return;
+    victim->id_len = id_len;
+    memcpy(victim->id, id, id_len);
+    victim->der_len = (uint32_t)len;
+    victim->expires = (int64_t)SSL_SESSION_get_time(sess) +
+        SSL_SESSION_get_timeout(sess);
+    p = victim->der;
+    i2d_SSL_SESSION(sess, &p);
+    RUBY_ATOMIC_SET(victim->ref, 1);
+    if (!scache_slot_unlock(victim, seq)) {
+        /* The entry of the writer that took over may be partly overwritten */
+        if ((seq = scache_slot_lock(victim))) {
+            victim->id_len = 0;
+            scache_slot_unlock(victim, seq);
+        }
+        return;
+    }
+
+    RUBY_ATOMIC_INC(c->hdr->stores);
+    if (evict)
+        RUBY_ATOMIC_INC(c->hdr->evictions);
+}
+
+/*
+ * Looks up the session with the ID _id_. Returns a new SSL_SESSION, or NULL if
+ * it is not found or has expired. Called by the SSL_CTX's get session
+ * callback, possibly without the GVL.
+ */
+SSL_SESSION *
+ossl_scache_lookup(struct ossl_scache *c, const unsigned char *id, int id_len)
+{
+    struct scache_slot *slot;
+    unsigned char *buf;
+    const unsigned char *p;
+    SSL_SESSION *sess = NULL;
+    uint32_t set, der_len = 0;
+    int64_t expires = 0;
+    rb_atomic_t seq;
+    int i, tries, found = 0;
+
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        goto miss;
+    if (!(buf = OPENSSL_malloc(SCACHE_CAPACITY(c))))
+        goto miss;
+
+    set = scache_hash(id, (unsigned int)id_len) % c->nsets;
+    for (i = 0; i < SCACHE_WAYS && !found; i++) {
+        slot = SCACHE_SLOT(c, set * SCACHE_WAYS + i);
+        for (tries = 0; tries < SCACHE_READ_RETRIES; tries++) {
+            seq = RUBY_ATOMIC_LOAD(slot->seq);
+            if (seq & 1)
+                continue;
+            if (slot->id_len != (uint32_t)id_len || memcmp(slot->id, id, id_len))
+                break;
+            der_len = slot->der_len;
+            if (der_len > SCACHE_CAPACITY(c))
+                continue;
+            memcpy(buf, slot->der, der_len);
+            expires = slot->expires;
+            if (RUBY_ATOMIC_LOAD(slot->seq) == seq) {
+                RUBY_ATOMIC_SET(slot->ref, 1);
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (found && expires > (int64_t)time(NULL)) {
+        const unsigned char *sess_id;
+        unsigned int sess_id_len;
+
+        p = buf;
+        sess = d2i_SSL_SESSION(NULL, &p, der_len);
+        if (sess) {
+            sess_id = SSL_SESSION_get_id(sess, &sess_id_len);
+            if (sess_id_len != (unsigned int)id_len || memcmp(sess_id, id, id_len)) {
+                SSL_SESSION_free(sess);
+                sess = NULL;
+            }
+        }
+    }
+    OPENSSL_free(buf);
+    if (sess) {
+        RUBY_ATOMIC_INC(c->hdr->hits);
+        return sess;
+    }
+
+  miss:
+    RUBY_ATOMIC_INC(c->hdr->misses);
+    return NULL;
+}
+
+/*
+ * Removes the entry for _sess_ from the cache. Called by the SSL_CTX's remove
+ * session callback.
+ */
+void
+ossl_scache_remove(struct ossl_scache *c, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned int id_len;
+    struct scache_slot *slot;
+    rb_atomic_t seq;
+    uint32_t set;
+    int i;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
+    set = scache_hash(id, id_len) % c->nsets;
+    for (i = 0; i < SCACHE_WAYS; i++) {
+        slot = SCACHE_SLOT(c, set * SCACHE_WAYS + i);
+        if (slot->id_len != id_len || memcmp(slot->id, id, id_len))
+            continue;
+        if (!(seq = scache_slot_lock(slot)))
+            continue;
+        if (slot->id_len == id_len && !memcmp(slot->id, id, id_len))
+            slot->id_len = 0;
+        scache_slot_unlock(slot, seq);
+    }
+}
+
+static void
+ossl_scache_free(void *ptr)
+{
+    ossl_scache_release(ptr);
+}
+
+static size_t
+ossl_scache_memsize(const void *ptr)
+{
+    return sizeof(struct ossl_scache);
+}
+
+static const rb_data_type_t ossl_scache_type = {
+    "OpenSSL/SSL/SharedSessionCache",
+    {
+        0, ossl_scache_free, ossl_scache_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+#define GetSharedSessionCache(obj, c) do { \
+    TypedData_Get_Struct((obj), struct ossl_scache, &ossl_scache_type, (c)); \
+    if (!(c)->map) \
+        ossl_raise(rb_eRuntimeError, "SharedSessionCache is not initialized"); \
+} while (0)
+
+/*
+ * Returns the cache wrapped by _obj_, with its reference count incremented.
+ * The caller must release it with ossl_scache_release().
+ */
+struct ossl_scache *
+ossl_scache_ref(VALUE obj)
+{
+    struct ossl_scache *c;
+
+    GetSharedSessionCache(obj, c);
+    c->refcnt++;
+    return c;
+}
+
+static VALUE
+ossl_scache_alloc(VALUE klass)
+{
+    struct ossl_scache *c;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct ossl_scache, &ossl_scache_type, c);
+    c->refcnt = 1;
+    return obj;
+}
+
+/*
+ * call-seq:
+ *    SharedSessionCache.new(path = nil, size: 4096, slot_size: 2048) -> cache
+ *
+ * Creates a session cache in shared memory, for use with
+ * SSLContext#shared_session_cache=.
+ *
+ * If _path_ is given, the cache is backed by the file, which is created if it
+ * does not exist. Processes opening the same file share the cache, and must
+ * pass the same _size_ and _slot_size_. If _path_ is +nil+, an anonymous
+ * mapping is used, which is shared with the child processes forked
+ * afterwards.
+ *
+ * _size_ is the number of sessions the cache can hold. _slot_size_ is the
+ * number of bytes allocated to each session, including a small header;
+ * sessions that do not fit, for example because they contain a large client
+ * certificate chain, are not stored.
+ */
+static VALUE
+ossl_scache_initialize(int argc, VALUE *argv, VALUE self)
+{
+    static ID kw_ids[2];
+    VALUE path, opts, kw_args[2];
+    struct ossl_scache *c;
+    struct scache_header *hdr;
+    size_t hands_off, slots_off, map_size;
+    long size = 4096, slot_size = 2048, nsets;
+    int fd = -1, init = 1;
+    void *map;
+
+    TypedData_Get_Struct(self, struct ossl_scache, &ossl_scache_type, c);
+    if (c->map)
+        rb_raise(rb_eRuntimeError, "SharedSessionCache already initialized");
+
+    rb_scan_args(argc, argv, "01:", &path, &opts);
+    if (!kw_ids[0]) {
+        kw_ids[0] = rb_intern_const("size");
+        kw_ids[1] = rb_intern_const("slot_size");
+    }
+    rb_get_kwargs(opts, kw_ids, 0, 2, kw_args);
+    if (kw_args[0] != Qundef)
+        size = NUM2LONG(kw_args[0]);
+    if (kw_args[1] != Qundef)
+        slot_size = NUM2LONG(kw_args[1]);
+    if (size <= 0 || size > INT_MAX)
+        rb_raise(rb_eArgError, "invalid size");
+    if (slot_size < (long)SCACHE_SLOT_HEADER_SIZE + 256 || slot_size > 1024 * 1024)
+        rb_raise(rb_eArgError, "invalid slot_size");
+
+    nsets = (size + SCACHE_WAYS - 1) / SCACHE_WAYS;
+    slot_size = (long)scache_align((size_t)slot_size);
+    hands_off = scache_align(sizeof(struct scache_header));
+    slots_off = hands_off + scache_align(sizeof(rb_atomic_t) * nsets);
+    map_size = slots_off + (size_t)nsets * SCACHE_WAYS * slot_size;
+
+    if (NIL_P(path)) {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            rb_sys_fail("mmap");
+    }
+    else {
+        struct stat st;
+
+        FilePathValue(path);
+        fd = rb_cloexec_open(RSTRING_PTR(path), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            rb_sys_fail_str(path);
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            rb_sys_fail_str(path);
+        }
+        if (st.st_size == 0) {
+            if (ftruncate(fd, (off_t)map_size) < 0) {
+                close(fd);
+                rb_sys_fail_str(path);
+            }
+        }
+        else if ((size_t)st.st_size != map_size) {
+            close(fd);
+            rb_raise(rb_eArgError, "%"PRIsVALUE" was created with a different " \
+                     "size or slot_size", path);
+        }
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            rb_sys_fail_str(path);
+
+        hdr = map;
+        if (hdr->magic == SCACHE_MAGIC && hdr->version != SCACHE_VERSION) {
+            /* Written by an older version; the sessions are not kept */
+            memset(map, 0, map_size);
+        }
+        else if (hdr->magic == SCACHE_MAGIC) {
+            if (hdr->nsets != (uint32_t)nsets ||
+                hdr->slot_size != (uint32_t)slot_size) {
+                munmap(map, map_size);
+                rb_raise(rb_eArgError, "%"PRIsVALUE" was created with a " \
+                         "different size or slot_size", path);
+            }
+            init = 0;
+        }
+    }
+
+    hdr = map;
+    if (init) {
+        /* A zero-filled slot is empty, so only the header needs to be set */
+        hdr->version = SCACHE_VERSION;
+        hdr->nsets = (uint32_t)nsets;
+        hdr->slot_size = (uint32_t)slot_size;
+        hdr->magic = SCACHE_MAGIC;
+    }
+
+    c->map = map;
+    c->map_size = map_size;
+    c->hdr = hdr;
+    c->hands = (rb_atomic_t *)((char *)map + hands_off);
+    c->slots = (char *)map + slots_off;
+    c->nsets = (uint32_t)nsets;
+    c->slot_size = (uint32_t)slot_size;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *    cache.size -> integer
+ *
+ * Returns the number of sessions the cache can hold.
+ */
+static VALUE
+ossl_scache_get_size(VALUE self)
+{
+    struct ossl_scache *c;
+
+    GetSharedSessionCache(self, c);
+    return LONG2NUM((long)c->nsets * SCACHE_WAYS);
+}
+
+/*
+ * call-seq:
+ *    cache.slot_size -> integer
+ *
+ * Returns the number of bytes allocated to each session.
+ */
+static VALUE
+ossl_scache_get_slot_size(VALUE self)
+{
+    struct ossl_scache *c;
+
+    GetSharedSessionCache(self, c);
+    return LONG2NUM(c->slot_size);
+}
+
+/*
+ * call-seq:
+ *    cache.stats -> hash
+ *
+ * Returns the statistics of the cache, shared by all the processes using it,
+ * as a Hash with the following keys:
+ *
+ * :hits:: Number of sessions found in the cache
+ * :misses:: Number of sessions proposed by clients that were not found in
+ *           the cache, or had expired
+ * :stores:: Number of sessions stored in the cache
+ * :evictions:: Number of sessions removed from the cache to make room for a
+ *              new one before they expired
+ */
+static VALUE
+ossl_scache_get_stats(VALUE self)
+{
+    struct ossl_scache *c;
+    VALUE hash;
+
+    GetSharedSessionCache(self, c);
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), UINT2NUM(RUBY_ATOMIC_LOAD(c->hdr->hits)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), UINT2NUM(RUBY_ATOMIC_LOAD(c->hdr->misses)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stores")), UINT2NUM(RUBY_ATOMIC_LOAD(c->hdr->stores)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), UINT2NUM(RUBY_ATOMIC_LOAD(c->hdr->evictions)));
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *    cache.clear -> self
+ *
+ * Removes all sessions from the cache.
+ */
+static VALUE
+ossl_scache_clear(VALUE self)
+{
+    struct ossl_scache *c;
+    struct scache_slot *slot;
+    rb_atomic_t seq;
+    long i;
+
+    GetSharedSessionCache(self, c);
+    for (i = 0; i < (long)c->nsets * SCACHE_WAYS; i++) {
+        slot = SCACHE_SLOT(c, i);
+        if (!(seq = scache_slot_lock(slot)))
+            continue;
+        slot->id_len = 0;
+        scache_slot_unlock(slot, seq);
+    }
+
+    return self;
+}
+#endif /* OSSL_USE_SHARED_SESSION_CACHE */
+
+void
+Init_ossl_ssl_session_cache(void)
+{
+#ifdef OSSL_USE_SHARED_SESSION_CACHE
+    /*
+     * Document-class: OpenSSL::SSL::SharedSessionCache
+     *
+     * A server-side session cache kept in shared memory, so that the
+     * processes of a preforking server can resume sessions established by
+     * one another. Sessions are stored and looked up natively, without
+     * calling into Ruby.
+     *
+     *   cache = OpenSSL::SSL::SharedSessionCache.new("/run/app/ssl_sessions")
+     *   ctx = OpenSSL::SSL::SSLContext.new
+     *   ctx.session_id_context = "app"
+     *   ctx.shared_session_cache = cache
+     */
+    cSSLSharedSessionCache = rb_define_class_under(mSSL, "SharedSessionCache", rb_cObject);
+    rb_define_alloc_func(cSSLSharedSessionCache, ossl_scache_alloc);
+    rb_define_method(cSSLSharedSessionCache, "initialize", ossl_scache_initialize, -1);
+    rb_undef_method(cSSLSharedSessionCache, "initialize_copy");
+    rb_define_method(cSSLSharedSessionCache, "size", ossl_scache_get_size, 0);
+    rb_define_method(cSSLSharedSessionCache, "slot_size", ossl_scache_get_slot_size, 0);
+    rb_define_method(cSSLSharedSessionCache, "stats", ossl_scache_get_stats, 0);
+    rb_define_method(cSSLSharedSessionCache, "clear", ossl_scache_clear, 0);
+#endif
+}
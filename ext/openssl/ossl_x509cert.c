@@ -597,6 +597,37 @@ ossl_x509_check_private_key(VALUE self, VALUE key)
     return Qtrue;
 }
 
+/*
+ * call-seq:
+ *    cert.matches_host?(name) -> true | false
+ *
+ * Returns +true+ if the certificate is valid for the host name or IP address
+ * _name_, following RFC 6125. A host name is compared against the dNSName
+ * entries of the subjectAltName extension, or the commonName of the subject
+ * if there is none, allowing a wildcard in the leftmost label. An IP address
+ * is compared against the iPAddress entries.
+ */
+static VALUE
+ossl_x509_matches_host_p(VALUE self, VALUE name)
+{
+    X509 *x509;
+    const char *str;
+    int ret;
+
+    GetX509(self, x509);
+    StringValue(name);
+    if (memchr(RSTRING_PTR(name), '\0', RSTRING_LEN(name)))
+        return Qfalse;
+    str = StringValueCStr(name);
+    ret = X509_check_ip_asc(x509, str, 0);
+    if (ret == -2) /* not an IP address */
+        ret = X509_check_host(x509, str, RSTRING_LEN(name), 0, NULL);
+    if (ret == -1)
+        ossl_raise(eX509CertError, "X509_check_host");
+
+    return ret == 1 ? Qtrue : Qfalse;
+}
+
 /*
  * call-seq:
  *    cert.extensions => [extension...]
@@ -1004,6 +1035,7 @@ Init_ossl_x509cert(void)
     rb_define_method(cX509Cert, "sign", ossl_x509_sign, 2);
     rb_define_method(cX509Cert, "verify", ossl_x509_verify, 1);
     rb_define_method(cX509Cert, "check_private_key", ossl_x509_check_private_key, 1);
+    rb_define_method(cX509Cert, "matches_host?", ossl_x509_matches_host_p, 1);
     rb_define_method(cX509Cert, "extensions", ossl_x509_get_extensions, 0);
     rb_define_method(cX509Cert, "extensions=", ossl_x509_set_extensions, 1);
     rb_define_method(cX509Cert, "add_extension", ossl_x509_add_extension, 1);
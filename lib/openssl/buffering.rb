@@ -59,7 +59,7 @@ module OpenSSL::Buffering
   def initialize(*)
     super
     @eof = false
-    @rbuffer = Buffer.new
+    @rbuffer = ReadBuffer.new
     @sync = @io.sync
   end
 
@@ -70,10 +70,13 @@ module OpenSSL::Buffering
 
   ##
   # Fills the buffer from the underlying SSLSocket
+  #
+  # OpenSSL::SSL::SSLSocket overrides this to decrypt directly into the
+  # buffer.
 
   def fill_rbuff
     begin
-      @rbuffer.append_as_bytes(self.sysread(BLOCK_SIZE))
+      @rbuffer.append(self.sysread(BLOCK_SIZE))
     rescue Errno::EAGAIN
       retry
     rescue EOFError
@@ -82,15 +85,11 @@ module OpenSSL::Buffering
   end
 
   ##
-  # Consumes _size_ bytes from the buffer
+  # Consumes _size_ bytes from the buffer. If _buf_ is given, the bytes are
+  # written into it.
 
-  def consume_rbuff(size=nil)
-    if @rbuffer.empty?
-      nil
-    else
-      size = @rbuffer.size unless size
-      @rbuffer.slice!(0, size)
-    end
+  def consume_rbuff(size=nil, buf=nil)
+    @rbuffer.consume(size, buf)
   end
 
   public
@@ -100,7 +99,8 @@ module OpenSSL::Buffering
   #
   # Get the next 8bit byte from `ssl`.  Returns `nil` on EOF
   def getbyte
-    read(1)&.ord
+    fill_rbuff until @eof || !@rbuffer.empty?
+    @rbuffer.getbyte
   end
 
   # Get the next 8bit byte. Raises EOFError on EOF
@@ -128,10 +128,9 @@ module OpenSSL::Buffering
       break if size && size <= @rbuffer.size
       fill_rbuff
     end
-    ret = consume_rbuff(size) || ""
-    if buf
-      buf.replace(ret)
-      ret = buf
+    ret = consume_rbuff(size, buf)
+    unless ret
+      ret = buf ? buf.clear : ""
     end
     (size && ret.empty?) ? nil : ret
   end
@@ -158,12 +157,7 @@ module OpenSSL::Buffering
         retry
       end
     end
-    ret = consume_rbuff(maxlen)
-    if buf
-      buf.replace(ret)
-      ret = buf
-    end
-    ret
+    consume_rbuff(maxlen, buf)
   end
 
   ##
@@ -212,12 +206,7 @@ module OpenSSL::Buffering
     if @rbuffer.empty?
       return sysread_nonblock(maxlen, buf, exception: exception)
     end
-    ret = consume_rbuff(maxlen)
-    if buf
-      buf.replace(ret)
-      ret = buf
-    end
-    ret
+    consume_rbuff(maxlen, buf)
   end
 
   ##
@@ -232,16 +221,24 @@ module OpenSSL::Buffering
   # Unlike IO#gets the separator must be provided if a limit is provided.
 
   def gets(eol=$/, limit=nil, chomp: false)
-    idx = @rbuffer.index(eol)
-    until @eof
-      break if idx
-      fill_rbuff
-      idx = @rbuffer.index(eol)
-    end
     if eol.is_a?(Regexp)
-      size = idx ? idx+$&.size : nil
+      idx = @rbuffer.to_s.index(eol)
+      until @eof
+        break if idx
+        fill_rbuff
+        idx = @rbuffer.to_s.index(eol)
+      end
+      size = idx ? idx+$&.bytesize : nil
     else
-      size = idx ? idx+eol.size : nil
+      idx = @rbuffer.index(eol)
+      until @eof
+        break if idx
+        # Only the newly read bytes and a partial separator need searching
+        from = @rbuffer.size - eol.bytesize + 1
+        fill_rbuff
+        idx = @rbuffer.index(eol, from > 0 ? from : 0)
+      end
+      size = idx ? idx+eol.bytesize : nil
     end
     if size && limit && limit >= 0
       size = [size, limit].min
@@ -301,8 +298,8 @@ module OpenSSL::Buffering
   # Calls the given block once for each byte in the stream.
 
   def each_byte # :yields: byte
-    while c = getc
-      yield(c.ord)
+    while b = getbyte
+      yield(b)
     end
   end
 
@@ -324,7 +321,7 @@ module OpenSSL::Buffering
   # Has no effect on unbuffered reads (such as #sysread).
 
   def ungetc(c)
-    @rbuffer[0,0] = c.chr
+    @rbuffer.unshift(c.chr)
   end
 
   ##
@@ -342,9 +339,71 @@ module OpenSSL::Buffering
   #
   private
 
+  ##
+  # Writes all of _strings_ to the underlying socket. If a block is given,
+  # it is called with the number of bytes each time some are written.
+  #
+  # OpenSSL::SSL::SSLSocket overrides this to pack short Strings into
+  # full-sized records without concatenating them first.
+
+  def syswritev(strings)
+    strings.sum do |str|
+      nwrote = 0
+      while nwrote < str.bytesize
+        begin
+          n = syswrite(nwrote > 0 ? str.byteslice(nwrote..) : str)
+        rescue Errno::EAGAIN
+          retry
+        end
+        nwrote += n
+        yield n if block_given?
+      end
+      nwrote
+    end
+  end
+
+  ##
+  # Sends the first _size_ bytes of the buffer to the underlying socket.
+
+  def flush_wbuff(size = @wbuffer.bytesize)
+    return if size == 0
+    nwrote = 0
+    begin
+      syswritev([size == @wbuffer.bytesize ? @wbuffer : @wbuffer.byteslice(0, size)]) { |n|
+        nwrote += n
+      }
+    ensure
+      consume_wbuff(nwrote)
+    end
+  end
+
+  ##
+  # Removes the first _nwrote_ bytes sent by #syswritev from the buffer
+  # followed by _strings_, and keeps the rest in the buffer, so that nothing
+  # is lost when #syswritev raises partway, for example on IO#timeout.
+
+  def consume_wbuff(nwrote, strings = nil)
+    if nwrote >= @wbuffer.bytesize
+      nwrote -= @wbuffer.bytesize
+      @wbuffer.clear
+    else
+      @wbuffer[0, nwrote] = ""
+      nwrote = 0
+    end
+    strings&.each do |str|
+      if nwrote >= str.bytesize
+        nwrote -= str.bytesize
+      else
+        @wbuffer.append_as_bytes(nwrote > 0 ? str.byteslice(nwrote..) : str)
+        nwrote = 0
+      end
+    end
+  end
+
   ##
   # Writes _s_ to the buffer.  When the buffer is full or #sync is true the
-  # buffer is flushed to the underlying socket.
+  # buffer is flushed to the underlying socket.  While the stream is corked,
+  # only whole BLOCK_SIZE chunks are flushed.
 
   def do_write(s)
     @wbuffer = Buffer.new unless defined? @wbuffer
@@ -352,29 +411,12 @@ module OpenSSL::Buffering
 
     @sync ||= false
     buffer_size = @wbuffer.bytesize
-    if @sync or buffer_size > BLOCK_SIZE
-      nwrote = 0
-      begin
-        while nwrote < buffer_size do
-          begin
-            chunk = if nwrote > 0
-              @wbuffer.byteslice(nwrote, @wbuffer.bytesize)
-            else
-              @wbuffer
-            end
-
-            nwrote += syswrite(chunk)
-          rescue Errno::EAGAIN
-            retry
-          end
-        end
-      ensure
-        if nwrote < @wbuffer.bytesize
-          @wbuffer[0, nwrote] = ""
-        else
-          @wbuffer.clear
-        end
+    if @corked
+      if buffer_size >= BLOCK_SIZE
+        flush_wbuff(buffer_size - buffer_size % BLOCK_SIZE)
       end
+    elsif @sync or buffer_size > BLOCK_SIZE
+      flush_wbuff
     end
   end
 
@@ -383,14 +425,70 @@ module OpenSSL::Buffering
   ##
   # Writes _s_ to the stream.  If the argument is not a String it will be
   # converted using +.to_s+ method.  Returns the number of bytes written.
+  #
+  # If #sync is true and the stream is not corked, all of _s_ is sent at
+  # once without being copied into the buffer.
 
   def write(*s)
-    s.inject(0) do |written, str|
-      do_write(str)
-      written + str.bytesize
+    @sync ||= false
+    if @sync && !@corked
+      strings = s.map { |str| String === str ? str : str.to_s }
+      written = strings.sum(&:bytesize)
+      @wbuffer = Buffer.new unless defined? @wbuffer
+      nwrote = 0
+      begin
+        syswritev(@wbuffer.empty? ? strings : [@wbuffer, *strings]) { |n|
+          nwrote += n
+        }
+      ensure
+        consume_wbuff(nwrote, strings)
+      end
+      written
+    else
+      s.inject(0) do |written, str|
+        do_write(str)
+        written + str.bytesize
+      end
     end
   end
 
+  ##
+  # call-seq:
+  #   ssl.cork => self
+  #   ssl.cork { |ssl| ... } => obj
+  #
+  # Corks the stream.  Until #uncork is called, written data is held in the
+  # buffer even if #sync is true, and is only sent in whole BLOCK_SIZE
+  # chunks, producing as few TLS records as possible.
+  #
+  # If a block is given, the stream is uncorked when the block returns and
+  # the value of the block is returned.
+
+  def cork
+    @corked = true
+    return self unless block_given?
+    begin
+      yield self
+    ensure
+      uncork
+    end
+  end
+
+  ##
+  # Uncorks the stream and flushes buffered data.  See #cork.
+
+  def uncork
+    @corked = false
+    flush
+  end
+
+  ##
+  # Returns true if the stream is corked.  See #cork.
+
+  def corked?
+    !!@corked
+  end
+
   ##
   # Writes _s_ in the non-blocking manner.
   #
@@ -487,12 +585,8 @@ module OpenSSL::Buffering
   # Flushes buffered data to the SSLSocket.
 
   def flush
-    osync = @sync
-    @sync = true
-    do_write ""
-    return self
-  ensure
-    @sync = osync
+    flush_wbuff if defined? @wbuffer
+    self
   end
 
   ##
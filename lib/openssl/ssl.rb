@@ -394,6 +394,41 @@ module OpenSSL
         nil
       end
 
+      # call-seq:
+      #   ssl.sendfile(io, offset = 0, length = nil) -> integer
+      #
+      # Sends _length_ bytes, or everything up to the end of the file if
+      # _length_ is +nil+, of the file _io_ starting at _offset_. Buffered
+      # data is flushed first. Returns the number of bytes sent.
+      #
+      # If kernel TLS is in use for sending (see #ktls_send?), the file is
+      # encrypted by the kernel and never copied to userspace. Otherwise it
+      # is read into a single buffer and written one record at a time.
+      def sendfile(io, offset = 0, length = nil)
+        flush
+        rest = io.stat.size - offset
+        length = rest if length.nil? || length > rest
+        return 0 if length <= 0
+
+        if ktls_send? && respond_to?(:syssendfile, true)
+          return syssendfile(io, offset, length)
+        end
+
+        buf = String.new(capacity: Buffering::BLOCK_SIZE)
+        nsent = 0
+        while nsent < length
+          n = [length - nsent, Buffering::BLOCK_SIZE].min
+          begin
+            io.pread(n, offset + nsent, buf)
+          rescue EOFError
+            break
+          end
+          syswritev([buf])
+          nsent += buf.bytesize
+        end
+        nsent
+      end
+
       # Close the stream for reading.
       # This method is ignored by OpenSSL as there is no reasonable way to
       # implement it, but exists for compatibility with IO.
@@ -433,13 +468,39 @@ module OpenSSL
       end
 
       def session_new_cb
-        @context.session_new_cb
+        cb = @context.session_new_cb
+        cache = @context.client_session_cache
+        key = @session_cache_key
+        return cb unless cache && key
+
+        lambda { |ary|
+          cache.store(key, ary[1])
+          cb&.call(ary)
+        }
       end
 
       def session_get_cb
         @context.session_get_cb
       end
 
+      # Called by #connect if SSLContext#client_session_cache is set.
+      def session_cache_lookup
+        @session_cache_key = session_cache_key or return
+        sess = @context.client_session_cache.lookup(@session_cache_key)
+        self.session = sess if sess
+      end
+
+      def session_cache_key
+        host, port = @remote_host, @remote_port
+        unless host
+          return unless io.respond_to?(:remote_address)
+          addr = io.remote_address
+          return unless addr.ip?
+          host, port = addr.ip_address, addr.ip_port
+        end
+        [host, port, hostname, @context.alpn_protocols].freeze
+      end
+
       class << self
 
         # call-seq:
@@ -452,6 +513,10 @@ module OpenSSL
         # If _context_ is provided,
         # the SSL Sockets initial params will be taken from the context.
         #
+        # If the context has a ClientSessionCache set in
+        # SSLContext#client_session_cache, sessions are looked up by
+        # _remote\_host_ rather than by the IP address connected to.
+        #
         # === Examples
         #
         #   sock = OpenSSL::SSL::SSLSocket.open('localhost', 443)
@@ -467,12 +532,171 @@ module OpenSSL
           if context.nil?
             return OpenSSL::SSL::SSLSocket.new(sock)
           else
-            return OpenSSL::SSL::SSLSocket.new(sock, context)
+            ssl = OpenSSL::SSL::SSLSocket.new(sock, context)
+            ssl.instance_variable_set(:@remote_host, remote_host)
+            ssl.instance_variable_set(:@remote_port, remote_port)
+            return ssl
           end
         end
       end
     end
 
+    class SSLEngine
+      attr_reader :hostname
+
+      # The SSLContext object used in this connection.
+      attr_reader :context
+
+      # call-seq:
+      #   engine.session -> aSession
+      #
+      # Returns the SSLSession object currently used, or nil if the session is
+      # not established.
+      def session
+        SSL::Session.new(self)
+      rescue SSL::Session::SessionError
+        nil
+      end
+
+      private
+
+      def client_cert_cb
+        @context.client_cert_cb
+      end
+
+      def session_new_cb
+        @context.session_new_cb
+      end
+
+      def session_get_cb
+        @context.session_get_cb
+      end
+    end
+
+    ##
+    # A client-side session store, to be set in
+    # SSLContext#client_session_cache.
+    #
+    # Sessions are keyed by the server's host and port, the SNI host name and
+    # the ALPN protocols offered, and only the most recent session for each
+    # key is kept. The least recently used entry is evicted when the cache is
+    # full.
+    #
+    #   ctx = OpenSSL::SSL::SSLContext.new
+    #   ctx.set_params
+    #   ctx.client_session_cache = OpenSSL::SSL::ClientSessionCache.new(ttl: 300)
+    #   2.times do
+    #     ssl = OpenSSL::SSL::SSLSocket.open("www.example.com", 443, context: ctx)
+    #     ssl.hostname = "www.example.com"
+    #     ssl.connect # the second connection resumes the first session
+    #     ...
+    #   end
+    class ClientSessionCache
+      # The maximum number of sessions kept.
+      attr_reader :max_size
+
+      # The maximum number of seconds a session is kept, or +nil+. Sessions
+      # are also dropped when their Session#timeout expires.
+      attr_reader :ttl
+
+      # call-seq:
+      #    ClientSessionCache.new(max_size: 1024, ttl: nil) -> cache
+      def initialize(max_size: 1024, ttl: nil)
+        unless max_size.is_a?(Integer) && max_size > 0
+          raise ArgumentError, "max_size must be a positive Integer"
+        end
+        @max_size = max_size
+        @ttl = ttl
+        @entries = {}
+        @mutex = Thread::Mutex.new
+        @hits = @misses = @stores = @evictions = @expirations = 0
+      end
+
+      # call-seq:
+      #    cache.lookup(key) -> session or nil
+      #
+      # Returns the session stored for _key_, or +nil+ if there is none or
+      # it has expired.
+      def lookup(key)
+        @mutex.synchronize {
+          session, expires = @entries.delete(key)
+          if session && expires <= Time.now.to_f
+            @expirations += 1
+            session = nil
+          end
+          if session
+            @entries[key] = [session, expires]
+            @hits += 1
+          else
+            @misses += 1
+          end
+          session
+        }
+      end
+
+      # call-seq:
+      #    cache.store(key, session) -> session
+      #
+      # Stores _session_ for _key_, replacing the previous one.
+      def store(key, session)
+        expires = session.time.to_f + session.timeout
+        expires = [expires, Time.now.to_f + @ttl].min if @ttl
+        @mutex.synchronize {
+          @entries.delete(key)
+          @entries[key] = [session, expires]
+          @stores += 1
+          if @entries.size > @max_size
+            @entries.shift
+            @evictions += 1
+          end
+        }
+        session
+      end
+
+      # call-seq:
+      #    cache.delete(key) -> session or nil
+      #
+      # Removes the session stored for _key_.
+      def delete(key)
+        @mutex.synchronize { @entries.delete(key)&.first }
+      end
+
+      # Removes all sessions.
+      def clear
+        @mutex.synchronize { @entries.clear }
+        self
+      end
+
+      # Returns the number of sessions stored.
+      def size
+        @mutex.synchronize { @entries.size }
+      end
+
+      # call-seq:
+      #    cache.stats -> hash
+      #
+      # Returns a Hash with the following counters:
+      #
+      # :hits::        lookups that found a session
+      # :misses::      lookups that found none, including expired ones
+      # :stores::      sessions stored
+      # :evictions::   sessions dropped because the cache was full
+      # :expirations:: sessions dropped on lookup because they had expired
+      # :size::        the number of sessions stored
+      def stats
+        @mutex.synchronize {
+          {
+            hits: @hits,
+            misses: @misses,
+            stores: @stores,
+            evictions: @evictions,
+            expirations: @expirations,
+            size: @entries.size,
+          }
+        }
+      end
+    end
+
     ##
     # SSLServer represents a TCP/IP server socket with Secure Sockets Layer.
     class SSLServer
@@ -480,6 +704,27 @@ module OpenSSL
       # When true then #accept works exactly the same as TCPServer#accept
       attr_accessor :start_immediately
 
+      # When true, #accept performs the TLS handshakes of many clients
+      # concurrently and only returns an SSLSocket whose handshake has
+      # completed. A client that is slow to send its handshake messages does
+      # not delay the others. Handshake failures and timeouts are counted in
+      # #handshake_stats instead of being raised. This has no effect unless
+      # #start_immediately is true. The default is +false+.
+      #
+      # #accept may be called from several threads; the handshakes are then
+      # driven by one of them at a time.
+      attr_accessor :concurrent_handshakes
+
+      # The number of seconds a client may take to complete the handshake when
+      # #concurrent_handshakes is enabled, or +nil+ for no limit. The default
+      # is 10.
+      attr_accessor :handshake_timeout
+
+      # The maximum number of handshakes in progress when
+      # #concurrent_handshakes is enabled. Further connections are left in the
+      # listen queue until a slot becomes free. The default is 128.
+      attr_accessor :max_pending_handshakes
+
       # Creates a new instance of SSLServer.
       # * _srv_ is an instance of TCPServer.
       # * _ctx_ is an instance of OpenSSL::SSL::SSLContext.
@@ -493,6 +738,13 @@ module OpenSSL
           @ctx.session_id_context = session_id
         end
         @start_immediately = true
+        @concurrent_handshakes = false
+        @handshake_timeout = 10
+        @max_pending_handshakes = 128
+        @pending = {}
+        @established = []
+        @handshake_stats = Hash.new(0)
+        @handshake_mutex = Thread::Mutex.new
       end
 
       # Returns the TCPServer passed to the SSLServer when initialized.
@@ -512,6 +764,8 @@ module OpenSSL
 
       # Works similar to TCPServer#accept.
       def accept
+        return accept_concurrently if @start_immediately && @concurrent_handshakes
+
         # Socket#accept returns [socket, addrinfo].
         # TCPServer#accept returns a socket.
         # The following comma strips addrinfo.
@@ -531,9 +785,122 @@ module OpenSSL
         end
       end
 
+      # call-seq:
+      #    ssl_server.handshake_stats -> hash
+      #
+      # Returns the counters of the handshakes performed in
+      # #concurrent_handshakes mode, as a Hash with the following keys:
+      #
+      # :accepted :: TCP connections accepted
+      # :established :: handshakes completed and returned by #accept
+      # :failed :: handshakes that failed with an error
+      # :timed_out :: handshakes that did not complete in #handshake_timeout
+      # :pending :: handshakes currently in progress
+      def handshake_stats
+        # Not synchronized: #accept holds the lock while waiting for clients
+        {
+          accepted: @handshake_stats[:accepted],
+          established: @handshake_stats[:established],
+          failed: @handshake_stats[:failed],
+          timed_out: @handshake_stats[:timed_out],
+          pending: @pending.size,
+        }
+      end
+
       # See IO#close for details.
       def close
         @svr.close
+        # Wake up a thread waiting in #accept, which then raises IOError
+        @wakeup&.last&.write_nonblock("\0", exception: false)
+        @handshake_mutex.synchronize {
+          @pending.each_key { |ssl| ssl.close rescue nil }
+          @pending.clear
+          @established.each { |ssl| ssl.close rescue nil }
+          @established.clear
+          @wakeup&.each(&:close)
+          @wakeup = nil
+        }
+      end
+
+      private
+
+      def accept_concurrently
+        @handshake_mutex.synchronize { accept_concurrently0 }
+      end
+
+      def accept_concurrently0
+        # Written to by #close
+        @wakeup ||= IO.pipe
+        while @established.empty?
+          raise IOError, "closed stream" if @svr.closed?
+          now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          expire_handshakes(now)
+
+          readers = [@wakeup.first]
+          writers = []
+          readers << @svr if @pending.size < @max_pending_handshakes
+          @pending.each { |ssl, (_, wait)|
+            (wait == :wait_writable ? writers : readers) << ssl
+          }
+          deadline = @pending.each_value.map(&:first).compact.min
+          timeout = deadline && [deadline - now, 0].max
+          readable, writable = IO.select(readers, writers, nil, timeout)
+          next unless readable
+
+          if readable.delete(@wakeup.first)
+            @wakeup.first.read_nonblock(16, exception: false)
+          end
+          if readable.delete(@svr)
+            start_handshake
+          end
+          (readable + writable).each { |ssl| continue_handshake(ssl) }
+        end
+        @established.shift
+      end
+
+      def start_handshake
+        sock = @svr.accept_nonblock(exception: false)
+        return if sock == :wait_readable
+        sock, = sock
+        @handshake_stats[:accepted] += 1
+        begin
+          ssl = OpenSSL::SSL::SSLSocket.new(sock, @ctx)
+          ssl.sync_close = true
+        rescue StandardError
+          sock.close
+          @handshake_stats[:failed] += 1
+          return
+        end
+        deadline = @handshake_timeout &&
+          Process.clock_gettime(Process::CLOCK_MONOTONIC) + @handshake_timeout
+        @pending[ssl] = [deadline, :wait_readable]
+        continue_handshake(ssl)
+      rescue SystemCallError
+        # The client went away before the connection was accepted
+      end
+
+      def continue_handshake(ssl)
+        ret = ssl.accept_nonblock(exception: false)
+        if ret == :wait_readable || ret == :wait_writable
+          @pending[ssl][1] = ret
+        else
+          @pending.delete(ssl)
+          @established << ssl
+          @handshake_stats[:established] += 1
+        end
+      rescue StandardError
+        @pending.delete(ssl)
+        ssl.close rescue nil
+        @handshake_stats[:failed] += 1
+      end
+
+      def expire_handshakes(now)
+        @pending.delete_if { |ssl, (deadline, _)|
+          next false unless deadline && deadline <= now
+          ssl.close rescue nil
+          @handshake_stats[:timed_out] += 1
+          true
+        }
       end
     end
   end
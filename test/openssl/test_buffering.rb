@@ -77,6 +77,72 @@ class OpenSSL::TestBuffering < OpenSSL::TestCase
     assert_not_predicate @io, :sync, 'sync must not change'
   end
 
+  def test_flush_error_keeps_unsent
+    @io.write "abcdef"
+    calls = 0
+    @io.define_singleton_method(:syswrite) { |str|
+      raise Errno::ETIMEDOUT if (calls += 1) == 2
+      super(str.byteslice(0, 2))
+    }
+
+    assert_raise(Errno::ETIMEDOUT) { @io.flush }
+    assert_equal "ab", @io.string
+    @io.flush
+    assert_equal "abcdef", @io.string
+  end
+
+  def test_write_sync_error_keeps_unsent
+    @io.write "ab"
+    @io.sync = true
+    calls = 0
+    @io.define_singleton_method(:syswrite) { |str|
+      raise Errno::ETIMEDOUT if (calls += 1) == 3
+      super(str.byteslice(0, 3))
+    }
+
+    assert_raise(Errno::ETIMEDOUT) { @io.write("cd", "ef") }
+    assert_equal "abcd", @io.string
+    @io.flush
+    assert_equal "abcdef", @io.string
+  end
+
+  def test_cork
+    @io.sync = true
+    @io.cork
+    assert_predicate @io, :corked?
+    @io.write "a"
+    @io.print "b", "c"
+    assert_empty @io.string
+
+    @io.write "x" * (OpenSSL::Buffering::BLOCK_SIZE)
+    assert_equal OpenSSL::Buffering::BLOCK_SIZE, @io.string.bytesize
+
+    @io.uncork
+    assert_not_predicate @io, :corked?
+    assert_equal "abc" + "x" * OpenSSL::Buffering::BLOCK_SIZE, @io.string
+  end
+
+  def test_cork_block
+    @io.sync = true
+    ret = @io.cork { |io|
+      io.write "a", "b"
+      assert_empty @io.string
+      :ret
+    }
+    assert_equal :ret, ret
+    assert_not_predicate @io, :corked?
+    assert_equal "ab", @io.string
+  end
+
+  def test_write_multiple_sync
+    @io.sync = true
+    nwrites = 0
+    @io.define_singleton_method(:syswrite) { |str| nwrites += 1; super(str) }
+    assert_equal 6, @io.write("ab", "cd", "ef")
+    assert_equal "abcdef", @io.string
+    assert_equal 3, nwrites
+  end
+
   def test_getc
     @io.syswrite('abc')
     assert_equal(?a, @io.getc)
@@ -92,6 +158,36 @@ class OpenSSL::TestBuffering < OpenSSL::TestCase
     end
     assert_equal([97, 98, 99], res)
   end
+
+  def test_gets_separator_across_fills
+    @io.syswrite("a" * (OpenSSL::Buffering::BLOCK_SIZE - 1) + "\r\nbc\r\nd")
+    assert_equal("a" * (OpenSSL::Buffering::BLOCK_SIZE - 1) + "\r\n",
+                 @io.gets("\r\n"))
+    assert_equal("bc", @io.gets("\r\n", chomp: true))
+    assert_equal("d", @io.gets("\r\n"))
+    assert_nil(@io.gets("\r\n"))
+  end
+
+  def test_read_into_buffer
+    @io.syswrite("abcdef")
+    buf = +"xyz"
+    assert_same(buf, @io.read(2, buf))
+    assert_equal("ab", buf)
+    assert_equal(Encoding::BINARY, buf.encoding)
+    assert_same(buf, @io.readpartial(10, buf))
+    assert_equal("cdef", buf)
+    assert_nil(@io.read(1, buf))
+    assert_equal("", buf)
+  end
+
+  def test_ungetc
+    @io.syswrite("cd")
+    assert_equal(?c, @io.getc)
+    @io.ungetc("b")
+    @io.ungetc(?a.ord)
+    assert_equal(?a.ord, @io.getbyte)
+    assert_equal("bd", @io.read)
+  end
 end
 
 end
@@ -393,6 +393,75 @@ module OpenSSL::TestPairM
     }
   end
 
+  def test_write_multiple_strings
+    ssl_pair {|s1, s2|
+      s1.sync = true
+      strs = ["a", "b" * 20000, "c", "d" * 5, "e" * 40000]
+      assert_equal strs.sum(&:bytesize), s1.write(*strs)
+      assert_equal strs.join, s2.read(strs.sum(&:bytesize))
+
+      # The block is told what has been sent in case of an exception
+      progress = []
+      assert_equal strs.sum(&:bytesize),
+        s1.__send__(:syswritev, strs) { |n| progress << n }
+      assert_equal strs.sum(&:bytesize), progress.sum
+      assert_equal strs.join, s2.read(strs.sum(&:bytesize))
+
+      s1.cork { s1.puts "x"; s1.print "y" }
+      assert_equal "x\ny", s2.read(3)
+    }
+  end
+
+  def test_sendfile
+    data = Random.bytes(40000)
+    Tempfile.create("openssl-sendfile") { |f|
+      f.binmode
+      f.write(data)
+      f.flush
+
+      ssl_pair {|s1, s2|
+        assert_include([true, false], s1.ktls_send?)
+        assert_include([true, false], s1.ktls_recv?)
+
+        s1.print "head"
+        assert_equal 30000, s1.sendfile(f, 100, 30000)
+        assert_equal "head" + data[100, 30000], s2.read(30004)
+
+        assert_equal 40000, s1.sendfile(f)
+        assert_equal data, s2.read(40000)
+
+        assert_equal 10, s1.sendfile(f, 39990, 100)
+        assert_equal data[39990, 10], s2.read(10)
+        assert_equal 0, s1.sendfile(f, 50000)
+
+        if s1.ktls_send?
+          # The file ends before length bytes are sent
+          assert_equal 10, s1.__send__(:syssendfile, f, 39990, 100)
+          assert_equal data[39990, 10], s2.read(10)
+        end
+      }
+    }
+  end
+
+  def test_concurrent_sysread_syswrite
+    ssl_pair { |s1, s2|
+      data = "x" * 1_000_000
+      # s1 is read from and written to by different threads at the same time
+      writer = Thread.new { s1.write(data); s1.flush }
+      echo = Thread.new {
+        buf = +""
+        buf << s2.sysread(16384) while buf.bytesize < data.bytesize
+        s2.write(buf); s2.flush
+        buf.bytesize
+      }
+      received = +""
+      received << s1.sysread(16384) while received.bytesize < data.bytesize
+      assert_equal data.bytesize, echo.value
+      writer.join
+      assert_equal data, received
+    }
+  end
+
   def test_partial_tls_record_read_nonblock
     ssl_pair { |s1, s2|
       # the beginning of a TLS record
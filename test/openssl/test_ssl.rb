@@ -1033,6 +1033,53 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     end
   end
 
+  def test_keylog_file
+    omit "Keylog callback is not supported" if libressl?
+
+    Dir.mktmpdir { |dir|
+      path = File.join(dir, "keylog")
+      lines = []
+      context = OpenSSL::SSL::SSLContext.new
+      context.min_version = context.max_version = OpenSSL::SSL::TLS1_3_VERSION
+      context.keylog_file = path
+      context.keylog_cb = proc { |_sock, line| lines << line }
+
+      start_server { |port|
+        2.times {
+          server_connect(port, context) { |ssl|
+            ssl.puts "abc"
+            assert_equal("abc\n", ssl.gets)
+          }
+        }
+      }
+      assert_equal 10, lines.size
+      assert_equal lines.map { |line| line + "\n" }.join, File.read(path)
+
+      # Appends through a duplicated descriptor
+      File.open(path, "a") { |f|
+        context = OpenSSL::SSL::SSLContext.new
+        context.min_version = context.max_version = OpenSSL::SSL::TLS1_2_VERSION
+        context.keylog_file = f
+        start_server { |port|
+          server_connect(port, context) { |ssl|
+            ssl.puts "abc"
+            assert_equal("abc\n", ssl.gets)
+          }
+        }
+      }
+      appended = File.read(path).lines.drop(10)
+      assert_equal 1, appended.size
+      assert_equal "CLIENT_RANDOM", appended[0].split.first
+    }
+
+    context = OpenSSL::SSL::SSLContext.new
+    context.keylog_file = "/nonexistent/keylog"
+    assert_raise(Errno::ENOENT) { context.setup }
+    assert_not_predicate context, :frozen?
+    context.keylog_file = nil
+    assert_equal true, context.setup
+  end
+
   def test_tlsext_hostname
     fooctx = OpenSSL::SSL::SSLContext.new
     fooctx.cert = @cli_cert
@@ -1080,6 +1127,428 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     end
   end
 
+  def test_stats
+    start_server { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      ssl = nil
+      server_connect(port, ctx) { |s|
+        ssl = s
+        stats = ssl.stats
+        assert_kind_of Float, stats[:handshake_time]
+        assert_operator stats[:handshake_time], :>, 0
+        assert_equal false, stats[:resumed]
+        assert_equal 0, stats[:bytes_written]
+
+        ssl.write("abc\n"); assert_equal "abc\n", ssl.gets
+        stats = ssl.stats
+        assert_equal 4, stats[:bytes_written]
+        assert_equal 4, stats[:bytes_read]
+        assert_operator stats[:raw_bytes_written], :>, 4
+        assert_operator stats[:raw_bytes_read], :>, 4
+        assert_operator stats[:records_written], :>=, 2
+        assert_operator stats[:records_read], :>=, 2
+      }
+
+      stats = ctx.stats
+      assert_equal 1, stats[:connections]
+      assert_equal 1, stats[:handshakes]
+      assert_equal 0, stats[:resumed]
+      assert_equal ssl.stats[:handshake_time], stats[:handshake_time]
+      assert_equal 4, stats[:bytes_written]
+      assert_equal ssl.stats[:raw_bytes_written], stats[:raw_bytes_written]
+      assert_equal ssl.stats[:records_read], stats[:records_read]
+    }
+  end
+
+  def test_stats_in_callback
+    omit "LibreSSL does not call session_new_cb in TLS 1.3" if libressl?
+
+    start_server { |port|
+      stats = []
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.min_version = :TLS1_3
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_CLIENT
+      # Called from the SSL_read() that processes the NewSessionTicket
+      ctx.session_new_cb = lambda { |(sock, _)| stats << sock.stats }
+      server_connect(port, ctx) { |ssl|
+        ssl.write("abc\n"); assert_equal "abc\n", ssl.gets
+        assert_operator stats.size, :>=, 1
+        assert_equal 4, stats[0][:bytes_written]
+        assert_kind_of Float, stats[0][:handshake_time]
+      }
+    }
+  end
+
+  def test_record_size
+    start_server { |port|
+      data = "a" * 39999 + "\n"
+      write_records = ->(ssl, str) {
+        records = ssl.stats[:records_written]
+        ssl.write(str)
+        assert_equal str, ssl.gets
+        ssl.stats[:records_written] - records
+      }
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      server_connect(port, ctx) { |ssl|
+        assert_equal 3, write_records.(ssl, data)
+      }
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.max_send_fragment = 1000
+      server_connect(port, ctx) { |ssl|
+        assert_equal 40, write_records.(ssl, data)
+      }
+
+      # 3 records of 1369 bytes up to the threshold, then full-sized ones
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.dynamic_record_sizing = 4000
+      server_connect(port, ctx) { |ssl|
+        assert_equal 6, write_records.(ssl, data)
+        assert_equal 3, write_records.(ssl, data)
+        sleep 1.1
+        assert_equal 4, write_records.(ssl, "a" * 5999 + "\n")
+      }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.max_send_fragment = 100
+    assert_raise(OpenSSL::SSL::SSLError) { ctx.setup }
+  end
+
+  def test_timeout
+    server = TCPServer.new("127.0.0.1", 0)
+    port = server.connect_address.ip_port
+
+    # The peer accepts the TCP connection but never speaks TLS
+    sock = TCPSocket.new("127.0.0.1", port)
+    peer = server.accept
+    ssl = OpenSSL::SSL::SSLSocket.new(sock)
+    t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_raise(OpenSSL::SSL::SSLTimeoutError) { ssl.connect(timeout: 0.1) }
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - t, :<, 5
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) - 1
+    assert_raise(OpenSSL::SSL::SSLTimeoutError) { ssl.connect(deadline: deadline) }
+    ssl.close
+    peer.close
+
+    start_server { |port|
+      server_connect(port) { |ssl|
+        assert_raise(OpenSSL::SSL::SSLTimeoutError) {
+          ssl.sysread(10, timeout: 0.1)
+        }
+        assert_equal 4, ssl.syswrite("abc\n", timeout: 1)
+        assert_equal "abc\n", ssl.sysread(4, timeout: 1)
+        assert_equal 4, ssl.syswrite("def\n", deadline: nil)
+        assert_equal "def\n", ssl.sysread(4)
+      }
+    }
+  ensure
+    server&.close
+  end
+
+  def test_handshake_trace
+    ctx_proc = proc { |ctx| ctx.handshake_trace = 64 }
+    start_server(ctx_proc: ctx_proc) { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.max_version = :TLS1_3
+      server_connect(port, ctx) { |ssl|
+        assert_nil ssl.handshake_trace
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      [64, 3].each { |size|
+        begin
+          sock = TCPSocket.new("127.0.0.1", port)
+          ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
+          ssl.handshake_trace = size
+          assert_equal [], ssl.handshake_trace
+          ssl.connect
+          ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+          trace = ssl.handshake_trace
+        ensure
+          ssl&.close
+          sock&.close
+        end
+
+        trace.each { |time, dir, type, len|
+          assert_kind_of Float, time
+          assert_include [:sent, :received], dir
+          assert_kind_of Integer, len
+        }
+        assert_equal trace.map(&:first).sort, trace.map(&:first)
+        msgs = trace.map { |_, dir, type, _| [dir, type] }
+        assert_include msgs, [:sent, :finished]
+        if size == 64
+          assert_equal [:sent, :client_hello], msgs.first
+          assert_include msgs, [:received, :server_hello]
+          assert_include msgs, [:received, :certificate]
+        else
+          assert_equal 3, msgs.size
+        end
+      }
+    }
+  end
+
+  def test_handshake_trace_in_callback
+    omit "LibreSSL does not call session_new_cb in TLS 1.3" if libressl?
+
+    start_server { |port|
+      traces = []
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.min_version = :TLS1_3
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_CLIENT
+      ctx.handshake_trace = 64
+      # Called from the SSL_read() that processes the NewSessionTicket
+      ctx.session_new_cb = lambda { |(sock, _)|
+        traces << sock.handshake_trace
+        sock.handshake_trace = 8
+      }
+      server_connect(port, ctx) { |ssl|
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+        assert_operator traces.size, :>=, 1
+        msgs = traces[0].map { |_, dir, type, _| [dir, type] }
+        assert_equal [:sent, :client_hello], msgs.first
+        assert_include msgs, [:received, :new_session_ticket]
+        assert_operator ssl.handshake_trace.size, :<=, 8
+      }
+    }
+  end
+
+  def test_ocsp_stapling
+    omit "OCSP not supported" unless defined?(OpenSSL::OCSP)
+
+    build_response = ->(this_update, next_update) {
+      cid = OpenSSL::OCSP::CertificateId.new(@svr_cert, @ca_cert)
+      bres = OpenSSL::OCSP::BasicResponse.new
+      bres.add_status(cid, OpenSSL::OCSP::V_CERTSTATUS_GOOD, 0, nil,
+                      this_update, next_update, [])
+      bres.sign(@ca_cert, @ca_key, [], 0)
+      OpenSSL::OCSP::Response.create(OpenSSL::OCSP::RESPONSE_STATUS_SUCCESSFUL, bres)
+    }
+    res = build_response.(-300, 500)
+    sctx = nil
+    ctx_proc = proc { |ctx|
+      sctx = ctx
+      ret = ctx.set_ocsp_response(@svr_cert, res)
+      assert_kind_of Time, ret
+      assert_equal ret, ctx.ocsp_response_next_update(@svr_cert)
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      server_connect(port, ctx) { |ssl|
+        assert_nil ssl.ocsp_response
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.ocsp_status_request = true
+      server_connect(port, ctx) { |ssl|
+        assert_equal res.to_der, ssl.ocsp_response.to_der
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      # Refreshed on a context in use; an expired response is not stapled
+      assert_predicate sctx, :frozen?
+      sctx.set_ocsp_response(@svr_cert, build_response.(-600, -300).to_der)
+      server_connect(port, ctx) { |ssl|
+        assert_nil ssl.ocsp_response
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      assert_nil sctx.set_ocsp_response(@svr_cert, nil)
+      assert_nil sctx.ocsp_response_next_update(@svr_cert)
+      server_connect(port, ctx) { |ssl|
+        assert_nil ssl.ocsp_response
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    unsuccessful = OpenSSL::OCSP::Response.create(
+      OpenSSL::OCSP::RESPONSE_STATUS_TRYLATER, nil)
+    assert_raise(ArgumentError) { ctx.set_ocsp_response(@svr_cert, unsuccessful) }
+  end
+
+  def test_psk_keys
+    omit "external PSK not supported" unless OpenSSL::SSL::SSLContext.method_defined?(:psk_keys=)
+
+    key1 = "\x01" * 32
+    key2 = "\x02" * 32
+    sctx = nil
+    ctx_proc = proc { |ctx|
+      sctx = ctx
+      ctx.psk_keys = { "client1" => key1, "client2" => key2 }
+    }
+    start_server(ctx_proc: ctx_proc, ignore_listener_error: true) { |port|
+      # The server certificate is not verified, since it is not sent
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      ctx.cert_store = OpenSSL::X509::Store.new
+      ctx.ciphersuites = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+      ctx.psk_keys = { "client2" => key2 }
+      ctx.psk_identity = "client2"
+      server_connect(port, ctx) { |ssl|
+        assert_equal "TLSv1.3", ssl.ssl_version
+        assert_nil ssl.peer_cert
+        assert_equal "TLS_AES_128_GCM_SHA256", ssl.cipher[0]
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      # Unknown identity falls back to a certificate
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.psk_keys = { "client3" => key1 }
+      ctx.psk_identity = "client3"
+      server_connect(port, ctx) { |ssl|
+        assert_equal @svr_cert.to_der, ssl.peer_cert.to_der
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.ciphersuites = "TLS_AES_128_GCM_SHA256"
+      ctx.psk_keys = { "client1" => key2 }
+      ctx.psk_identity = "client1"
+      assert_handshake_error { server_connect(port, ctx) }
+
+      # Rotated on a context in use
+      sctx.psk_keys = { "client1" => key2 }
+      server_connect(port, ctx) { |ssl|
+        assert_nil ssl.peer_cert
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    assert_raise(ArgumentError) { ctx.psk_keys = { "a" => "" } }
+    assert_raise(ArgumentError) { ctx.psk_keys = { "a" => "x" * 49 } }
+    assert_raise(ArgumentError) { ctx.psk_keys = { "" => "x" } }
+  end
+
+  def test_servername_contexts
+    fooctx = OpenSSL::SSL::SSLContext.new
+    fooctx.cert = @cli_cert
+    fooctx.key = @cli_key
+    barctx = OpenSSL::SSL::SSLContext.new
+    barctx.cert = @cli_cert
+    barctx.key = @cli_key
+
+    cb_called = []
+    server_ctx = nil
+    ctx_proc = proc { |ctx|
+      server_ctx = ctx
+      ctx.servername_contexts = { "foo.example.com" => fooctx }
+      ctx.servername_cb = proc { |ssl, servername|
+        cb_called << servername
+        nil
+      }
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      assert_equal({ "foo.example.com" => fooctx }, server_ctx.servername_contexts)
+      assert_predicate server_ctx.servername_contexts, :frozen?
+      assert_predicate fooctx, :frozen?
+
+      connect = ->(hostname) {
+        sock = TCPSocket.new("127.0.0.1", port)
+        begin
+          ssl = OpenSSL::SSL::SSLSocket.new(sock)
+          ssl.hostname = hostname
+          ssl.connect
+          ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+          ssl.peer_cert.serial
+        ensure
+          ssl&.close
+          sock.close
+        end
+      }
+
+      assert_equal @cli_cert.serial, connect.("FOO.example.com")
+      assert_equal @svr_cert.serial, connect.("baz.example.com")
+      assert_equal ["baz.example.com"], cb_called
+
+      # Replace the map while the server is running
+      server_ctx.servername_contexts = {
+        "foo.example.com" => fooctx,
+        "*.example.com" => barctx,
+      }
+      assert_predicate barctx, :frozen?
+      assert_equal @cli_cert.serial, connect.("baz.example.com")
+      assert_equal @svr_cert.serial, connect.("a.baz.example.com")
+      assert_equal @svr_cert.serial, connect.("example.com")
+      assert_equal ["baz.example.com", "a.baz.example.com", "example.com"], cb_called
+
+      server_ctx.servername_contexts = nil
+      assert_nil server_ctx.servername_contexts
+      assert_equal @svr_cert.serial, connect.("foo.example.com")
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    assert_raise(ArgumentError) { ctx.servername_contexts = { "a.*.example" => fooctx } }
+    assert_raise(ArgumentError) { ctx.servername_contexts = { "*" => fooctx } }
+    assert_raise(TypeError) { ctx.servername_contexts = { "example.com" => Object.new } }
+  end
+
+  def test_cert_loader
+    Dir.mktmpdir { |dir|
+      File.write(File.join(dir, "foo.example.com.pem"),
+                 @cli_cert.to_pem + @ca_cert.to_pem + @cli_key.to_pem)
+      server_ctx = nil
+      ctx_proc = proc { |ctx|
+        server_ctx = ctx
+        ctx.cert_loader = File.join(dir, "%s.pem")
+      }
+      start_server(ctx_proc: ctx_proc) { |port|
+        connect = ->(hostname) {
+          sni_connect(port, hostname) { |ssl|
+            [ssl.peer_cert.serial, ssl.peer_cert_chain.size]
+          }
+        }
+
+        assert_equal [@cli_cert.serial, 2], connect.("foo.example.com")
+        assert_equal [@cli_cert.serial, 2], connect.("Foo.Example.Com")
+        assert_equal [@svr_cert.serial, 1], connect.("bar.example.com")
+        assert_equal [@svr_cert.serial, 1], connect.("../foo.example.com")
+        assert_equal({ hits: 1, misses: 2, evictions: 0, size: 2 },
+                     server_ctx.cert_cache_stats)
+
+        server_ctx.flush_cert_cache
+        assert_equal [@cli_cert.serial, 2], connect.("foo.example.com")
+        assert_equal({ hits: 1, misses: 3, evictions: 0, size: 1 },
+                     server_ctx.cert_cache_stats)
+      }
+    }
+
+    loaded = []
+    server_ctx = nil
+    ctx_proc = proc { |ctx|
+      server_ctx = ctx
+      ctx.cert_cache_size = 1
+      ctx.cert_loader = ->(hostname) {
+        loaded << hostname
+        case hostname
+        when "foo.example.com" then [@cli_cert, @cli_key]
+        when "bar.example.com" then @cli_cert.to_pem + @cli_key.to_pem
+        end
+      }
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      %w{foo.example.com foo.example.com bar.example.com foo.example.com
+         baz.example.com}.each { |hostname|
+        expected = hostname == "baz.example.com" ? @svr_cert : @cli_cert
+        sni_connect(port, hostname) { |ssl|
+          assert_equal expected.serial, ssl.peer_cert.serial
+        }
+      }
+      assert_equal %w{foo.example.com bar.example.com foo.example.com
+                      baz.example.com}, loaded
+      assert_equal({ hits: 1, misses: 4, evictions: 3, size: 1 },
+                   server_ctx.cert_cache_stats)
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.cert_loader = "/nonexistent.pem"
+    assert_raise(ArgumentError) { ctx.setup }
+  end
+
   def test_servername_cb_exception
     sock1, sock2 = socketpair
 
@@ -1159,36 +1628,85 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     }
 
     start_server(ctx_proc: ctx_proc, ignore_listener_error: true) do |port|
+      [true, :native].each do |verify_hostname|
+        ctx = OpenSSL::SSL::SSLContext.new
+        assert_equal false, ctx.verify_hostname
+        ctx.verify_hostname = verify_hostname
+        ctx.cert_store = OpenSSL::X509::Store.new
+        ctx.cert_store.add_cert(@ca_cert)
+        ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+
+        [
+          ["a.example.com", true],
+          ["A.Example.Com", true],
+          ["x.example.com", false],
+          ["b.example.com", false],
+          ["x.b.example.com", true],
+          ["cx.example.com", true],
+          ["d.x.example.com", false],
+        ].each do |name, expected_ok|
+          begin
+            sock = TCPSocket.new("127.0.0.1", port)
+            ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
+            ssl.hostname = name
+            if expected_ok
+              ssl.connect
+              ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+            else
+              assert_raise(OpenSSL::SSL::SSLError) { ssl.connect }
+            end
+          ensure
+            ssl.close if ssl
+            sock.close if sock
+          end
+        end
+      end
+    end
+  end
+
+  def test_verify_hostname_native
+    ctx_proc = proc { |ctx|
+      exts = [
+        ["keyUsage", "keyEncipherment,digitalSignature", true],
+        ["subjectAltName", "DNS:a.example.com,IP:127.0.0.1"],
+      ]
+      ctx.cert = issue_cert(@svr, @svr_key, 4, exts, @ca_cert, @ca_key)
+      ctx.key = @svr_key
+    }
+
+    start_server(ctx_proc: ctx_proc, ignore_listener_error: true) do |port|
+      verify_callback_err = nil
       ctx = OpenSSL::SSL::SSLContext.new
-      assert_equal false, ctx.verify_hostname
-      ctx.verify_hostname = true
+      ctx.verify_hostname = :native
       ctx.cert_store = OpenSSL::X509::Store.new
       ctx.cert_store.add_cert(@ca_cert)
       ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      ctx.verify_callback = -> (preverify_ok, store_ctx) {
+        verify_callback_err = store_ctx.error
+        preverify_ok
+      }
 
-      [
-        ["a.example.com", true],
-        ["A.Example.Com", true],
-        ["x.example.com", false],
-        ["b.example.com", false],
-        ["x.b.example.com", true],
-        ["cx.example.com", true],
-        ["d.x.example.com", false],
-      ].each do |name, expected_ok|
-        begin
-          sock = TCPSocket.new("127.0.0.1", port)
-          ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
-          ssl.hostname = name
-          if expected_ok
-            ssl.connect
-            ssl.puts "abc"; assert_equal "abc\n", ssl.gets
-          else
-            assert_raise(OpenSSL::SSL::SSLError) { ssl.connect }
-          end
-        ensure
-          ssl.close if ssl
-          sock.close if sock
-        end
+      ["a.example.com", "127.0.0.1"].each do |name|
+        sock = TCPSocket.new("127.0.0.1", port)
+        ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
+        ssl.hostname = name
+        ssl.connect
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      ensure
+        ssl&.close
+        sock&.close
+      end
+
+      # Reported by OpenSSL, while the Ruby implementation reports
+      # V_ERR_HOSTNAME_MISMATCH for any mismatch
+      begin
+        sock = TCPSocket.new("127.0.0.1", port)
+        ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
+        ssl.hostname = "127.0.0.2"
+        assert_raise(OpenSSL::SSL::SSLError) { ssl.connect }
+        assert_equal OpenSSL::X509::V_ERR_IP_ADDRESS_MISMATCH, verify_callback_err
+      ensure
+        sock&.close
       end
     end
   end
@@ -1626,6 +2144,173 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     }
   end
 
+  def test_handshake_without_gvl
+    called = []
+    ctx_proc = Proc.new { |ctx|
+      ctx.handshake_without_gvl = true
+      ctx.renegotiation_cb = -> (ssl) { called << :renegotiation_cb }
+      ctx.alpn_select_cb = -> (protocols) { called << :alpn_select_cb; protocols.first }
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.handshake_without_gvl = true
+      ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      ctx.cert_store = OpenSSL::X509::Store.new.tap { |store|
+        store.add_cert(@ca_cert)
+      }
+      ctx.verify_callback = -> (ok, store_ctx) { called << :verify_callback; ok }
+      ctx.alpn_protocols = ["http/1.1"]
+      server_connect(port, ctx) { |ssl|
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+        assert_equal("http/1.1", ssl.alpn_protocol)
+      }
+    }
+    assert_include(called, :renegotiation_cb)
+    assert_include(called, :alpn_select_cb)
+    assert_include(called, :verify_callback)
+
+    # An exception raised in a callback is propagated
+    sock1, sock2 = socketpair
+    t = Thread.new {
+      s1 = OpenSSL::SSL::SSLSocket.new(sock1)
+      s1.hostname = "localhost"
+      assert_raise(OpenSSL::SSL::SSLError) { s1.connect }
+    }
+    ctx2 = OpenSSL::SSL::SSLContext.new
+    ctx2.handshake_without_gvl = true
+    ctx2.servername_cb = lambda { |args| raise RuntimeError, "foo" }
+    s2 = OpenSSL::SSL::SSLSocket.new(sock2, ctx2)
+    assert_raise_with_message(RuntimeError, "foo") { s2.accept }
+    assert t.join
+  ensure
+    sock1&.close
+    sock2&.close
+    t&.kill&.join
+  end
+
+  def test_early_data
+    omit "early data not supported" unless OpenSSL::SSL::SSLSocket.method_defined?(:write_early_data)
+    omit "LibreSSL does not support early data" if libressl?
+
+    sctx = OpenSSL::SSL::SSLContext.new
+    sctx.add_certificate(@svr_cert, @svr_key)
+    sctx.max_early_data = 1024
+    assert_equal 1024, sctx.max_early_data
+    allowed = []
+    sctx.allow_early_data_cb = ->(ssl) { allowed << ssl; true }
+
+    tcps = TCPServer.new("127.0.0.1", 0)
+    port = tcps.local_address.ip_port
+    th = Thread.new {
+      2.times {
+        ssl = OpenSSL::SSL::SSLSocket.new(tcps.accept, sctx)
+        ssl.sync_close = true
+        early = +""
+        while chunk = ssl.read_early_data(3)
+          early << chunk
+        end
+        ssl.accept
+        ssl.puts(early.empty? ? "none" : early, ssl.early_data_status)
+        ssl.gets
+        ssl.close
+      }
+    }
+
+    sess = server_connect(port) { |ssl|
+      assert_equal "none\n", ssl.gets
+      assert_equal "not_sent\n", ssl.gets
+      ssl.session
+    }
+    assert_equal 1024, sess.max_early_data
+
+    sock = TCPSocket.new("127.0.0.1", port)
+    ssl = OpenSSL::SSL::SSLSocket.new(sock)
+    ssl.sync_close = true
+    ssl.session = sess
+    assert_equal 7, ssl.write_early_data("request")
+    ssl.connect
+    assert_equal true, ssl.session_reused?
+    assert_equal :accepted, ssl.early_data_status
+    assert_equal "request\n", ssl.gets
+    assert_equal "accepted\n", ssl.gets
+    ssl.puts("done")
+    th.join
+    assert_equal 1, allowed.size
+  ensure
+    ssl&.close
+    th&.kill&.join
+    tcps&.close
+  end
+
+  def test_cert_compression
+    omit "certificate compression not supported" unless OpenSSL::SSL::SSLSocket.method_defined?(:cert_compression)
+
+    sctx = nil
+    ctx_proc = proc { |ctx|
+      ctx.cert_compression = ["zstd", :brotli, "zlib"]
+      sctx = ctx
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      alg = nil
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.min_version = OpenSSL::SSL::TLS1_3_VERSION
+      server_connect(port, ctx) { |ssl|
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+        alg = ssl.cert_compression
+      }
+      assert_include [nil, "zstd", "brotli", "zlib"], alg
+      assert_equal({ handshakes: 1, compressed: alg ? 1 : 0 },
+                   sctx.cert_compression_stats)
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.cert_compression = []
+      server_connect(port, ctx) { |ssl|
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+        assert_nil ssl.cert_compression
+      }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.cert_compression = ["lzma"]
+    assert_raise(ArgumentError) { ctx.setup }
+    assert_not_predicate ctx, :frozen?
+    ctx.cert_compression = []
+    assert_equal true, ctx.setup
+  end
+
+  def test_raw_public_key
+    omit "raw public keys not supported" unless OpenSSL::SSL::SSLSocket.method_defined?(:peer_rpk)
+
+    ctx_proc = proc { |ctx|
+      ctx.cert = nil
+      ctx.server_cert_type = ["rpk", "x509"]
+    }
+    start_server(ctx_proc: ctx_proc, ignore_listener_error: true) { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.server_cert_type = ["rpk"]
+      ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      ctx.expected_rpks = [@cli_key, @svr_key]
+      server_connect(port, ctx) { |ssl|
+        assert_equal "rpk", ssl.server_cert_type
+        assert_equal "x509", ssl.client_cert_type
+        assert_nil ssl.peer_cert
+        assert_equal @svr_key.public_to_der, ssl.peer_rpk.public_to_der
+        assert_equal OpenSSL::X509::V_OK, ssl.verify_result
+        ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+      }
+
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.server_cert_type = ["rpk"]
+      ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      ctx.expected_rpks = [@cli_key]
+      assert_handshake_error { server_connect(port, ctx) }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.server_cert_type = ["pgp"]
+    assert_raise(ArgumentError) { ctx.setup }
+  end
+
   def test_alpn_protocol_selection_ary
     advertised = ["http/1.1", "spdy/2"]
     ctx_proc = Proc.new { |ctx|
@@ -1644,6 +2329,39 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     }
   end
 
+  def test_alpn_preference
+    cb_called = []
+    ctx_proc = Proc.new { |ctx|
+      ctx.alpn_preference = ["h2", "http/1.1"]
+      ctx.alpn_select_cb = -> (protocols) {
+        cb_called << protocols
+        protocols.last
+      }
+    }
+    start_server(ctx_proc: ctx_proc) { |port|
+      [
+        [["http/1.1", "h2"], "h2"],
+        [["spdy/2", "http/1.1"], "http/1.1"],
+        [["spdy/2", "spdy/3"], "spdy/3"],
+      ].each { |advertised, expected|
+        ctx = OpenSSL::SSL::SSLContext.new
+        ctx.alpn_protocols = advertised
+        server_connect(port, ctx) { |ssl|
+          assert_equal(expected, ssl.alpn_protocol)
+          ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+        }
+      }
+      assert_equal [["spdy/2", "spdy/3"]], cb_called
+    }
+
+    ctx_proc = Proc.new { |ctx| ctx.alpn_preference = ["h2"] }
+    start_server(ctx_proc: ctx_proc, ignore_listener_error: true) { |port|
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.alpn_protocols = ["http/1.1"]
+      assert_handshake_error { server_connect(port, ctx) }
+    }
+  end
+
   def test_alpn_protocol_selection_cancel
     sock1, sock2 = socketpair
 
@@ -2416,6 +3134,22 @@ class OpenSSL::TestSSL < OpenSSL::SSLTestCase
     end
   end
 
+  def sni_connect(port, hostname)
+    sock = TCPSocket.new("127.0.0.1", port)
+    ssl = OpenSSL::SSL::SSLSocket.new(sock)
+    ssl.sync_close = true
+    ssl.hostname = hostname
+    ssl.connect
+    ssl.puts "abc"; assert_equal "abc\n", ssl.gets
+    yield ssl
+  ensure
+    if ssl
+      ssl.close
+    elsif sock
+      sock.close
+    end
+  end
+
   def assert_handshake_error
     # different OpenSSL versions react differently when facing a SSL/TLS version
     # that has been marked as forbidden, therefore any of these may be raised
@@ -0,0 +1,163 @@
+# frozen_string_literal: true
+require_relative "utils"
+
+if defined?(OpenSSL::SSL)
+
+class OpenSSL::TestSSLEngine < OpenSSL::SSLTestCase
+  def setup
+    super
+    @sctx = OpenSSL::SSL::SSLContext.new
+    @sctx.cert = @svr_cert
+    @sctx.key = @svr_key
+  end
+
+  def engine_pair(cctx = OpenSSL::SSL::SSLContext.new, sctx = @sctx)
+    c = OpenSSL::SSL::SSLEngine.new(cctx)
+    s = OpenSSL::SSL::SSLEngine.new(sctx, server: true)
+    [c, s]
+  end
+
+  def pump(from, to)
+    data = from.drain
+    to.feed(data) if data
+  end
+
+  def do_handshake(c, s)
+    10.times {
+      rc = c.handshake
+      pump(c, s)
+      rs = s.handshake
+      pump(s, c)
+      return if rc == true && rs == true
+    }
+    flunk "handshake did not complete"
+  end
+
+  def test_handshake_and_data
+    c, s = engine_pair
+    assert_equal false, c.handshake_completed?
+    assert_equal :wait_readable, c.handshake
+    assert_operator c.pending_output, :>, 0
+    do_handshake(c, s)
+    assert_equal true, c.handshake_completed?
+    assert_equal 0, c.pending_output
+    assert_equal @svr_cert.to_der, c.peer_cert.to_der
+    assert_equal s.cipher, c.cipher
+
+    assert_equal :wait_readable, s.read(10)
+    assert_equal 5, c.write("hello")
+    pump(c, s)
+    buf = +""
+    assert_same buf, s.read(3, buf)
+    assert_equal "hel", buf
+    assert_equal "lo", s.read(10)
+
+    data = "x" * 100_000
+    assert_equal data.bytesize, s.write(data)
+    assert_operator s.pending_output, :>, data.bytesize
+    ret = +""
+    while chunk = s.drain(1000)
+      c.feed(chunk)
+      while (str = c.read(16384)).is_a?(String)
+        ret << str
+      end
+    end
+    assert_equal data, ret
+  end
+
+  def test_stats
+    c, s = engine_pair
+    assert_nil c.stats[:handshake_time]
+    do_handshake(c, s)
+    assert_kind_of Float, c.stats[:handshake_time]
+    assert_operator c.stats[:wait_readable], :>, 0
+
+    records = c.stats[:records_written]
+    assert_equal 5, c.write("hello")
+    pump(c, s)
+    assert_equal "hello", s.read(10)
+    assert_equal 5, c.stats[:bytes_written]
+    assert_equal 5, s.stats[:bytes_read]
+    assert_equal records + 1, c.stats[:records_written]
+    assert_equal c.stats[:raw_bytes_written], s.stats[:raw_bytes_read]
+    assert_equal 1, @sctx.stats[:handshakes]
+  end
+
+  def test_shutdown
+    c, s = engine_pair
+    do_handshake(c, s)
+    assert_equal false, c.shutdown
+    pump(c, s)
+    assert_nil s.read(10)
+    assert_equal true, s.shutdown
+    pump(s, c)
+    assert_nil c.read(10)
+  end
+
+  def test_hostname_and_callbacks
+    called = []
+    @sctx.servername_cb = ->((engine, name)) {
+      called << [:servername_cb, engine.class, name]
+      nil
+    }
+    @sctx.alpn_select_cb = ->(protocols) { protocols.last }
+    cctx = OpenSSL::SSL::SSLContext.new
+    cctx.alpn_protocols = ["h2", "http/1.1"]
+    cctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+    cctx.verify_hostname = true
+    cctx.cert_store = OpenSSL::X509::Store.new.tap { |store| store.add_cert(@ca_cert) }
+    cctx.verify_callback = ->(ok, store_ctx) { called << [:verify_callback, ok]; ok }
+
+    c, s = engine_pair(cctx)
+    c.hostname = "localhost"
+    do_handshake(c, s)
+    assert_equal "localhost", c.hostname
+    assert_equal "http/1.1", c.alpn_protocol
+    assert_equal OpenSSL::X509::V_OK, c.verify_result
+    assert_include called, [:servername_cb, OpenSSL::SSL::SSLEngine, "localhost"]
+    assert_include called, [:verify_callback, true]
+    assert_kind_of OpenSSL::SSL::Session, c.session
+  end
+
+  def test_handshake_failure
+    cctx = OpenSSL::SSL::SSLContext.new
+    cctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+    cctx.cert_store = OpenSSL::X509::Store.new
+    c, s = engine_pair(cctx)
+    assert_raise(OpenSSL::SSL::SSLError) { do_handshake(c, s) }
+  end
+
+  def test_callback_exception
+    @sctx.servername_cb = ->(args) { raise "foo" }
+    c, s = engine_pair
+    c.hostname = "localhost"
+    assert_raise_with_message(RuntimeError, "foo") { do_handshake(c, s) }
+  end
+
+  def test_with_ssl_socket
+    start_server { |port|
+      TCPSocket.open("127.0.0.1", port) { |sock|
+        c = OpenSSL::SSL::SSLEngine.new
+        until c.handshake == true
+          sock.write(c.drain) if c.pending_output > 0
+          c.feed(sock.readpartial(16384))
+        end
+        sock.write(c.drain) if c.pending_output > 0
+
+        c.write("abc\n")
+        sock.write(c.drain)
+        ret = nil
+        until ret.is_a?(String)
+          c.feed(sock.readpartial(16384))
+          ret = c.read(100)
+        end
+        assert_equal "abc\n", ret
+
+        c.shutdown
+        sock.write(c.drain)
+      }
+    }
+  end
+end
+
+end
@@ -49,6 +49,95 @@ class OpenSSL::TestSSLServer < OpenSSL::SSLTestCase
     server.close
   end
 
+  def test_concurrent_handshakes
+    tcps = TCPServer.new("127.0.0.1", 0)
+    port = tcps.local_address.ip_port
+    sctx = OpenSSL::SSL::SSLContext.new
+    sctx.add_certificate(@svr_cert, @svr_key)
+    server = OpenSSL::SSL::SSLServer.new(tcps, sctx)
+    server.concurrent_handshakes = true
+    server.handshake_timeout = 0.5
+
+    # A client that never sends a ClientHello must not block the others
+    stalled = TCPSocket.new("127.0.0.1", port)
+    # A client that does not speak TLS at all
+    broken = TCPSocket.new("127.0.0.1", port)
+    broken.write("GET / HTTP/1.0\r\n\r\n")
+
+    th = Thread.start do
+      2.times {
+        sssl = server.accept
+        assert_predicate(sssl, :session)
+        sssl.puts(sssl.gets)
+        sssl.close
+      }
+    end
+    2.times {
+      server_connect(port) do |ssl|
+        ssl.puts("abc")
+        assert_equal("abc\n", ssl.gets)
+      end
+    }
+    th.join
+
+    stats = server.handshake_stats
+    assert_equal(4, stats[:accepted])
+    assert_equal(2, stats[:established])
+    assert_equal(1, stats[:failed])
+    assert_equal(1, stats[:timed_out] + stats[:pending])
+
+    # The stalled client is dropped once its deadline passes
+    sleep 0.6
+    th = Thread.start { server.accept }
+    server_connect(port) { |ssl| ssl.puts("abc") }
+    th.value.close
+    assert_equal(1, server.handshake_stats[:timed_out])
+    assert_equal(0, server.handshake_stats[:pending])
+    assert_equal("", stalled.read)
+  ensure
+    stalled&.close
+    broken&.close
+    server&.close
+  end
+
+  def test_concurrent_handshakes_multiple_threads
+    tcps = TCPServer.new("127.0.0.1", 0)
+    port = tcps.local_address.ip_port
+    sctx = OpenSSL::SSL::SSLContext.new
+    sctx.add_certificate(@svr_cert, @svr_key)
+    server = OpenSSL::SSL::SSLServer.new(tcps, sctx)
+    server.concurrent_handshakes = true
+
+    threads = 4.times.map {
+      Thread.start do
+        sssl = server.accept
+        sssl.puts(sssl.gets)
+      ensure
+        sssl&.close
+      end
+    }
+    clients = 4.times.map { |i|
+      Thread.start do
+        server_connect(port) do |ssl|
+          ssl.puts("abc#{i}")
+          assert_equal("abc#{i}\n", ssl.gets)
+        end
+      end
+    }
+    clients.each(&:join)
+    threads.each(&:join)
+    assert_equal(4, server.handshake_stats[:established])
+
+    # #close wakes up a thread waiting for a client
+    th = Thread.start { server.accept }
+    th.report_on_exception = false
+    sleep 0.1
+    server.close
+    assert_raise(IOError) { th.join }
+  ensure
+    server&.close unless tcps&.closed?
+  end
+
   private
 
   def server_connect(port, ctx = nil)
@@ -146,6 +146,275 @@ __EOS__
     end
   end
 
+  def test_session_ticket_keys
+    key1 = OpenSSL::Random.random_bytes(80)
+    key2 = OpenSSL::Random.random_bytes(48)
+    sctx = nil
+    ctx_proc = proc { |ctx|
+      ctx.options &= ~OpenSSL::SSL::OP_NO_TICKET
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_OFF
+      ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION if libressl? || aws_lc?
+      ctx.session_ticket_keys = [key1]
+      sctx = ctx
+    }
+    start_server(ctx_proc: ctx_proc) do |port|
+      sess = server_connect_with_session(port, nil, nil) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal false, ssl.session_reused?
+        ssl.session
+      }
+      server_connect_with_session(port, nil, sess) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal true, ssl.session_reused?
+      }
+
+      # A ticket made with a previous key is still accepted, and renewed
+      sctx.session_ticket_keys = [key2, key1]
+      server_connect_with_session(port, nil, sess) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal true, ssl.session_reused?
+      }
+      stats = sctx.session_ticket_key_stats
+      assert_equal 2, stats[:decrypt]
+      assert_equal 1, stats[:renew]
+
+      sctx.session_ticket_keys = [key2]
+      server_connect_with_session(port, nil, sess) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal false, ssl.session_reused?
+      }
+
+      # No tickets are issued with an empty ring
+      sctx.session_ticket_keys = []
+      encrypt = sctx.session_ticket_key_stats[:encrypt]
+      assert_operator encrypt, :>=, 4
+      server_connect_with_session(port, nil, nil) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+      }
+      assert_equal encrypt, sctx.session_ticket_key_stats[:encrypt]
+    end
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    assert_raise(ArgumentError) { ctx.session_ticket_keys = ["x" * 32] }
+    assert_raise(TypeError) { ctx.session_ticket_keys = "x" * 48 }
+  end
+
+  def test_shared_session_cache
+    pend "SharedSessionCache is not available" unless defined?(OpenSSL::SSL::SharedSessionCache)
+
+    Tempfile.create("ssl_sessions") { |f|
+      cache1 = OpenSSL::SSL::SharedSessionCache.new(f.path, size: 64)
+      # Another process would open the same file
+      cache2 = OpenSSL::SSL::SharedSessionCache.new(f.path, size: 64)
+      assert_equal 64, cache1.size
+      assert_raise(ArgumentError) {
+        OpenSSL::SSL::SharedSessionCache.new(f.path, size: 128)
+      }
+
+      ctx_proc = proc { |cache|
+        proc { |ctx|
+          ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION
+          ctx.options |= OpenSSL::SSL::OP_NO_TICKET
+          ctx.session_id_context = "test"
+          ctx.shared_session_cache = cache
+        }
+      }
+      sess = nil
+      start_server(ctx_proc: ctx_proc.(cache1)) { |port|
+        sess = server_connect_with_session(port, nil, nil) { |ssl|
+          ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+          assert_equal false, ssl.session_reused?
+          ssl.session
+        }
+      }
+      start_server(ctx_proc: ctx_proc.(cache2)) { |port|
+        server_connect_with_session(port, nil, sess) { |ssl|
+          ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+          assert_equal true, ssl.session_reused?
+        }
+        cache2.clear
+        server_connect_with_session(port, nil, sess) { |ssl|
+          ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+          assert_equal false, ssl.session_reused?
+        }
+      }
+
+      stats = cache1.stats
+      assert_equal stats, cache2.stats
+      assert_equal 2, stats[:stores]
+      assert_equal 1, stats[:hits]
+      # A TLS 1.3-capable client sends a random legacy session ID in the first
+      # connection, which is looked up too
+      assert_operator stats[:misses], :>=, 1
+      assert_equal 0, stats[:evictions]
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.shared_session_cache = OpenSSL::SSL::SharedSessionCache.new
+    ctx.session_new_cb = proc { }
+    assert_raise(ArgumentError) { ctx.setup }
+    assert_not_predicate ctx, :frozen?
+    ctx.session_new_cb = nil
+    assert_equal true, ctx.setup
+  end
+
+  def test_shared_session_cache_stale_lock
+    pend "SharedSessionCache is not available" unless defined?(OpenSSL::SSL::SharedSessionCache)
+
+    Tempfile.create("ssl_sessions") { |f|
+      # A single set of 8 slots, following the 64-byte header and clock hand
+      cache = OpenSSL::SSL::SharedSessionCache.new(f.path, size: 8, slot_size: 2048)
+      # Leave every slot locked, as if a writer had been killed long ago
+      File.open(f.path, "r+b") { |io|
+        8.times { |i| io.pwrite([1, 0, 0].pack("L3"), 128 + i * 2048) }
+      }
+
+      ctx_proc = proc { |ctx|
+        ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION
+        ctx.options |= OpenSSL::SSL::OP_NO_TICKET
+        ctx.session_id_context = "test"
+        ctx.shared_session_cache = cache
+      }
+      start_server(ctx_proc: ctx_proc) { |port|
+        sess = server_connect_with_session(port, nil, nil) { |ssl|
+          ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+          ssl.session
+        }
+        server_connect_with_session(port, nil, sess) { |ssl|
+          ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+          assert_equal true, ssl.session_reused?
+        }
+      }
+      assert_equal 1, cache.stats[:stores]
+    }
+  end
+
+  def test_shared_session_cache_mixed_entry
+    pend "SharedSessionCache is not available" unless defined?(OpenSSL::SSL::SharedSessionCache)
+
+    Tempfile.create("ssl_sessions") { |f|
+      cache = OpenSSL::SSL::SharedSessionCache.new(f.path, size: 8, slot_size: 2048)
+      ctx_proc = proc { |ctx|
+        ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION
+        ctx.options |= OpenSSL::SSL::OP_NO_TICKET
+        ctx.session_id_context = "test"
+        ctx.shared_session_cache = cache
+      }
+      start_server(ctx_proc: ctx_proc) { |port|
+        sess1, sess2 = 2.times.map {
+          server_connect_with_session(port, nil, nil) { |ssl|
+            ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+            ssl.session
+          }
+        }
+        # Swap the session IDs of the two entries, as if a writer had kept
+        # writing to a slot after its lock was taken over
+        File.open(f.path, "r+b") { |io|
+          offsets = 8.times.map { |i| 128 + i * 2048 }.select { |off|
+            io.pread(4, off + 12).unpack1("L") > 0
+          }
+          assert_equal 2, offsets.size
+          ids = offsets.map { |off| io.pread(32, off + 32) }
+          offsets.zip(ids.reverse) { |off, id| io.pwrite(id, off + 32) }
+        }
+        [sess1, sess2].each { |sess|
+          server_connect_with_session(port, nil, sess) { |ssl|
+            ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+            assert_equal false, ssl.session_reused?
+          }
+        }
+      }
+    }
+  end
+
+  def test_export_import_sessions
+    pend "export_sessions is not available" unless OpenSSL::SSL::SSLContext.method_defined?(:export_sessions)
+
+    server_ctx = nil
+    ctx_proc = proc { |data|
+      proc { |ctx|
+        ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION
+        ctx.options |= OpenSSL::SSL::OP_NO_TICKET
+        ctx.session_id_context = "test"
+        assert_equal 1, ctx.import_sessions(data) if data
+        server_ctx = ctx
+      }
+    }
+    sess = data = nil
+    start_server(ctx_proc: ctx_proc.(nil)) { |port|
+      sess = server_connect_with_session(port, nil, nil) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal false, ssl.session_reused?
+        ssl.session
+      }
+      data = server_ctx.export_sessions
+    }
+    assert_include data, sess.id
+    assert_equal 0, server_ctx.import_sessions(data[0, 8])
+
+    # A restarted server
+    start_server(ctx_proc: ctx_proc.(data)) { |port|
+      server_connect_with_session(port, nil, sess) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+        assert_equal true, ssl.session_reused?
+      }
+    }
+
+    ctx = OpenSSL::SSL::SSLContext.new
+    assert_raise(ArgumentError) { ctx.import_sessions("garbage") }
+    assert_raise(ArgumentError) { ctx.import_sessions(data[0, data.bytesize - 1]) }
+  end
+
+  def test_export_sessions_while_connecting
+    pend "export_sessions is not available" unless OpenSSL::SSL::SSLContext.method_defined?(:export_sessions)
+
+    start_server { |port|
+      # Client sessions are added to the internal cache by SSL_read() while
+      # the NewSessionTicket message is processed without the GVL
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_CLIENT
+      threads = 4.times.map {
+        Thread.new {
+          5.times {
+            server_connect_with_session(port, ctx, nil) { |ssl|
+              ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+            }
+          }
+        }
+      }
+      exported = []
+      exported << ctx.export_sessions while threads.any?(&:alive?)
+      threads.each(&:join)
+      exported << ctx.export_sessions
+
+      assert_operator OpenSSL::SSL::SSLContext.new.import_sessions(exported.last), :>=, 1
+    }
+  end
+
+  def test_export_sessions_in_callback
+    pend "export_sessions is not available" unless OpenSSL::SSL::SSLContext.method_defined?(:export_sessions)
+    omit "LibreSSL does not call session_new_cb in TLS 1.3" if libressl?
+
+    start_server { |port|
+      results = []
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.min_version = :TLS1_3
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_CLIENT
+      # Raises if the callback is run from an SSL_read() without the GVL
+      ctx.session_new_cb = lambda { |_|
+        results << (ctx.export_sessions rescue $!)
+      }
+      server_connect_with_session(port, ctx, nil) { |ssl|
+        ssl.puts("abc"); assert_equal "abc\n", ssl.gets
+      }
+      assert_operator results.size, :>=, 1
+      results.each { |r|
+        assert_include [String, OpenSSL::SSL::SSLError], r.class
+      }
+      assert_kind_of String, ctx.export_sessions
+    }
+  end
+
   def test_server_session_cache
     ctx_proc = Proc.new do |ctx|
       ctx.max_version = OpenSSL::SSL::TLS1_2_VERSION
@@ -282,6 +551,30 @@ __EOS__
     end
   end
 
+  def test_ctx_client_session_cb_tls13_socket_in_use
+    omit "LibreSSL does not call session_new_cb in TLS 1.3" if libressl?
+
+    start_server do |port|
+      entered, resume = Thread::Queue.new, Thread::Queue.new
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.min_version = :TLS1_3
+      ctx.session_cache_mode = OpenSSL::SSL::SSLContext::SESSION_CACHE_CLIENT
+      ctx.session_new_cb = lambda { |ary|
+        entered << ary[0]
+        resume.pop
+      }
+
+      server_connect_with_session(port, ctx, nil) { |ssl|
+        reader = Thread.new { ssl.puts("abc"); ssl.gets }
+        # The SSL_read() running the callback must not keep the socket locked
+        assert_same(ssl, entered.pop)
+        assert_kind_of(Hash, ssl.stats)
+        resume.close
+        assert_equal("abc\n", reader.value)
+      }
+    end
+  end
+
   def test_ctx_client_session_cb_tls13_exception
     omit "LibreSSL does not call session_new_cb in TLS 1.3" if libressl?
 
@@ -305,6 +598,66 @@ __EOS__
     end
   end
 
+  def test_client_session_cache
+    start_server do |port|
+      cache = OpenSSL::SSL::ClientSessionCache.new(max_size: 2)
+      called = 0
+      ctx = OpenSSL::SSL::SSLContext.new
+      ctx.client_session_cache = cache
+      ctx.session_new_cb = ->(ary) { called += 1 }
+
+      connect = lambda do |hostname|
+        ssl = OpenSSL::SSL::SSLSocket.open("127.0.0.1", port, context: ctx)
+        ssl.hostname = hostname
+        ssl.sync_close = true
+        ssl.connect
+        ssl.puts("abc"); assert_equal("abc\n", ssl.gets)
+        ssl.session_reused?
+      ensure
+        ssl&.close
+      end
+
+      assert_equal false, connect.("a.example.com")
+      assert_operator called, :>=, 1
+      assert_equal true, connect.("a.example.com")
+      assert_equal false, connect.("b.example.com")
+      assert_equal false, connect.("c.example.com")
+      stats = cache.stats
+      assert_equal 1, stats[:hits]
+      assert_equal 3, stats[:misses]
+      assert_operator stats[:evictions], :>=, 1
+      assert_equal 2, stats[:size]
+      assert_nil cache.lookup(["127.0.0.1", port, "a.example.com", nil])
+      assert_not_nil cache.lookup(["127.0.0.1", port, "c.example.com", nil])
+      # Not stored twice
+      assert_equal 0, ctx.session_cache_stats[:cache_num]
+
+      cache.clear
+      assert_equal 0, cache.size
+      assert_equal false, connect.("a.example.com")
+    end
+  end
+
+  def test_client_session_cache_ttl
+    sess = OpenSSL::SSL::Session.new(DUMMY_SESSION)
+    sess.time = Time.now
+    sess.timeout = 300
+    cache = OpenSSL::SSL::ClientSessionCache.new(ttl: 0)
+    cache.store(:key, sess)
+    assert_nil cache.lookup(:key)
+    assert_equal 1, cache.stats[:expirations]
+
+    cache = OpenSSL::SSL::ClientSessionCache.new
+    cache.store(:key, sess)
+    assert_same sess, cache.lookup(:key)
+    assert_same sess, cache.delete(:key)
+    sess.time = Time.now - 600
+    cache.store(:key, sess)
+    assert_nil cache.lookup(:key)
+
+    assert_raise(ArgumentError) { OpenSSL::SSL::ClientSessionCache.new(max_size: 0) }
+  end
+
   def test_ctx_server_session_cb
     connections = nil
     called = {}
@@ -257,6 +257,34 @@ class OpenSSL::TestX509Certificate < OpenSSL::TestCase
     assert_equal(true, cert.check_private_key(@rsa1))
   end
 
+  def test_matches_host?
+    exts = [
+      ["subjectAltName", "DNS:a.example.com,DNS:*.b.example.com," \
+                         "DNS:c*.example.com,DNS:d.*.example.com," \
+                         "IP:192.168.7.1,IP:13::17"],
+    ]
+    cert = issue_cert(@ee1, @rsa1, 1, exts, nil, nil)
+    assert_equal(true, cert.matches_host?("a.example.com"))
+    assert_equal(true, cert.matches_host?("A.Example.Com"))
+    assert_equal(false, cert.matches_host?("x.example.com"))
+    assert_equal(false, cert.matches_host?("b.example.com"))
+    assert_equal(true, cert.matches_host?("x.b.example.com"))
+    assert_equal(false, cert.matches_host?("y.x.b.example.com"))
+    assert_equal(true, cert.matches_host?("cx.example.com"))
+    assert_equal(false, cert.matches_host?("d.x.example.com"))
+    assert_equal(false, cert.matches_host?("a.example.com\0.evil.com"))
+    assert_equal(true, cert.matches_host?("192.168.7.1"))
+    assert_equal(false, cert.matches_host?("192.168.7.2"))
+    assert_equal(true, cert.matches_host?("13:0:0:0:0:0:0:17"))
+    assert_equal(false, cert.matches_host?("EE1"))
+
+    # The subject's commonName is used only without dNSName
+    name = OpenSSL::X509::Name.parse("/CN=localhost")
+    cert = issue_cert(name, @rsa1, 1, [], nil, nil)
+    assert_equal(true, cert.matches_host?("localhost"))
+    assert_equal(false, cert.matches_host?("example.com"))
+  end
+
   def test_read_from_file
     cert = issue_cert(@ca, @rsa1, 1, [], nil, nil)
     Tempfile.create("cert") { |f|